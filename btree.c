@@ -35,8 +35,13 @@
  */
 
 #include <errno.h>
+#include <sched.h>
 #include "btree.h"
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 /*
  * Depending on the ratio of lookups vs. insert and removes, it may be
  * beneficial to spend more work trying to keep the tree as compact as
@@ -46,35 +51,146 @@
  */
 // #define AGGRESSIVE_COMPACTION
 
-#ifndef L1_CACHE_BYTES
-#define L1_CACHE_BYTES 128
-#endif
-
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define NODESIZE MAX(L1_CACHE_BYTES, 128)
+#define MAX_NODESIZE 4096
+
+#define LONG_PER_U64 (64 / BITS_PER_LONG)
+#define GEO32_KEYLEN	1
+#define GEO64_KEYLEN	LONG_PER_U64
+#define GEO128_KEYLEN	(2 * LONG_PER_U64)
+#define NO_PAIRS(keylen) (NODESIZE / sizeof(long) / (1 + (keylen)))
 
 struct btree_geo btree_geo32 = {
-	.keylen = 1,
-	.no_pairs = NODESIZE / sizeof(long) / 2,
+	.keylen = GEO32_KEYLEN,
+	.no_pairs = NO_PAIRS(GEO32_KEYLEN),
 };
 
-#define LONG_PER_U64 (64 / BITS_PER_LONG)
 struct btree_geo btree_geo64 = {
-	.keylen = LONG_PER_U64,
-	.no_pairs = NODESIZE / sizeof(long) / (1 + LONG_PER_U64),
+	.keylen = GEO64_KEYLEN,
+	.no_pairs = NO_PAIRS(GEO64_KEYLEN),
 };
 
 struct btree_geo btree_geo128 = {
-	.keylen = 2 * LONG_PER_U64,
-	.no_pairs = NODESIZE / sizeof(long) / (1 + 2 * LONG_PER_U64),
+	.keylen = GEO128_KEYLEN,
+	.no_pairs = NO_PAIRS(GEO128_KEYLEN),
 };
 
+/*
+ * Trees may use larger nodes than NODESIZE, see btree_init_nodesize().  The
+ * key length comes from the geometry, the number of pairs per node depends
+ * on the tree.  All entry points translate the caller's geometry into the
+ * one for this particular tree before doing anything else.
+ */
+static inline int tree_pairs(struct btree_head *head, int keylen,
+		int no_pairs)
+{
+	if (!head->nodesize)
+		return no_pairs;
+	return head->nodesize / sizeof(long) / (1 + keylen);
+}
+
+#define TREE_GEO(head, geo)						\
+	{ (geo)->keylen, tree_pairs(head, (geo)->keylen, (geo)->no_pairs) }
+
+/*
+ * Node pools.  Nodes are carved from large slabs and recycled through a
+ * free list instead of going back to libc one at a time.  A pool can serve
+ * any number of trees, as long as they share its node size.  All memory is
+ * released at once by btree_pool_destroy().
+ */
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MIN_NODES 16
+
+static size_t pool_stride(struct btree_pool *pool)
+{
+	return (pool->nodesize + L1_CACHE_BYTES - 1) & ~(L1_CACHE_BYTES - 1);
+}
+
+void btree_pool_init(struct btree_pool *pool, int nodesize)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->nodesize = nodesize ? nodesize : NODESIZE;
+	pool->slab_size = MAX(SLAB_SIZE, SLAB_MIN_NODES * pool_stride(pool));
+}
+
+void btree_pool_destroy(struct btree_pool *pool)
+{
+	void *slab, *next;
+
+	for (slab = pool->slabs; slab; slab = next) {
+		next = *(void **)slab;
+		free(slab);
+	}
+	pool->slabs = NULL;
+	pool->free = NULL;
+	pool->next = pool->end = NULL;
+}
+
+static int pool_grow(struct btree_pool *pool)
+{
+	void *slab;
+
+	if (posix_memalign(&slab, L1_CACHE_BYTES, pool->slab_size))
+		return -ENOMEM;
+	/* the first cacheline links the slabs for btree_pool_destroy() */
+	*(void **)slab = pool->slabs;
+	pool->slabs = slab;
+	pool->next = slab + L1_CACHE_BYTES;
+	pool->end = slab + pool->slab_size;
+	pool->no_slabs++;
+	return 0;
+}
+
+void *btree_alloc(void *pool_data)
+{
+	struct btree_pool *pool = pool_data;
+	void *node;
+
+	if (pool->free) {
+		node = pool->free;
+		pool->free = *(void **)node;
+	} else {
+		if (pool->next + pool_stride(pool) > pool->end)
+			if (pool_grow(pool))
+				return NULL;
+		node = pool->next;
+		pool->next += pool_stride(pool);
+	}
+	return memset(node, 0, pool->nodesize);
+}
+
+void btree_free(void *element, void *pool_data)
+{
+	struct btree_pool *pool = pool_data;
+
+	*(void **)element = pool->free;
+	pool->free = element;
+}
+
+/* Returns a chain of nodes linked like the free list in one go */
+static void pool_free_chain(struct btree_pool *pool, void *first, void *last)
+{
+	*(void **)last = pool->free;
+	pool->free = first;
+}
+
 static unsigned long *btree_node_alloc(struct btree_head *head)
 {
-	return calloc(1, NODESIZE);
+	if (head->pool)
+		return btree_alloc(head->pool);
+	return calloc(1, head->nodesize ? head->nodesize : NODESIZE);
+}
+
+static void btree_node_free(struct btree_head *head, unsigned long *node)
+{
+	if (head->pool)
+		btree_free(node, head->pool);
+	else
+		free(node);
 }
 
-static int longcmp(const unsigned long *l1, const unsigned long *l2, size_t n)
+static __always_inline int longcmp(const unsigned long *l1, const unsigned long *l2, size_t n)
 {
 	size_t i;
 
@@ -87,7 +203,7 @@ static int longcmp(const unsigned long *l1, const unsigned long *l2, size_t n)
 	return 0;
 }
 
-static unsigned long *longcpy(unsigned long *dest, const unsigned long *src,
+static __always_inline unsigned long *longcpy(unsigned long *dest, const unsigned long *src,
 		size_t n)
 {
 	size_t i;
@@ -97,7 +213,7 @@ static unsigned long *longcpy(unsigned long *dest, const unsigned long *src,
 	return dest;
 }
 
-static unsigned long *longset(unsigned long *s, unsigned long c, size_t n)
+static __always_inline unsigned long *longset(unsigned long *s, unsigned long c, size_t n)
 {
 	size_t i;
 
@@ -113,35 +229,35 @@ static unsigned long *longset(unsigned long *s, unsigned long c, size_t n)
  * Total number of keys and vals (N) is head->no_pairs.
  */
 
-static unsigned long *bkey(struct btree_geo *geo, unsigned long *node, int n)
+static __always_inline unsigned long *bkey(struct btree_geo *geo, unsigned long *node, int n)
 {
 	return &node[n * geo->keylen];
 }
 
-static unsigned long bval(struct btree_geo *geo, unsigned long *node, int n)
+static __always_inline unsigned long bval(struct btree_geo *geo, unsigned long *node, int n)
 {
 	return node[geo->no_pairs * geo->keylen + n];
 }
 
-static void setkey(struct btree_geo *geo, unsigned long *node,
+static __always_inline void setkey(struct btree_geo *geo, unsigned long *node,
 		unsigned long *key, int n)
 {
 	longcpy(bkey(geo, node, n), key, geo->keylen);
 }
 
-static void setval(struct btree_geo *geo, unsigned long *node,
+static __always_inline void setval(struct btree_geo *geo, unsigned long *node,
 		unsigned long val, int n)
 {
 	node[geo->no_pairs * geo->keylen + n] = val;
 }
 
-static void clearpair(struct btree_geo *geo, unsigned long *node, int n)
+static __always_inline void clearpair(struct btree_geo *geo, unsigned long *node, int n)
 {
 	longset(bkey(geo, node, n), 0, geo->keylen);
 	node[geo->no_pairs * geo->keylen + n] = 0;
 }
 
-#if 0
+#ifdef BTREE_DEBUG
 static void dumpkey(struct btree_geo *geo, unsigned long *key)
 {
 	int k;
@@ -185,24 +301,67 @@ static void __dumptree(struct btree_head *head, struct btree_geo *geo,
 	}
 }
 
-static void dumptree(struct btree_head *head, struct btree_geo *geo)
+void btree_dump(struct btree_head *head, struct btree_geo *geo)
 {
-	__dumptree(head, geo, head->node, head->height);
+	struct btree_geo tgeo = TREE_GEO(head, geo);
+
+	__dumptree(head, &tgeo, head->node, head->height);
 }
 #endif
 
+/*
+ * The finger caches the leaf of the last descent along with the range of
+ * keys that lead to it, see finger_leaf().  Anything that changes which
+ * keys lead to which leaf, or frees a leaf, has to drop it.
+ */
+static inline void finger_drop(struct btree_head *head)
+{
+	if (head->finger)
+		head->finger->leaf = NULL;
+}
+
 static inline void __btree_init(struct btree_head *head)
 {
 	head->node = NULL;
 	head->height = 0;
+	finger_drop(head);
 }
 
 void btree_init(struct btree_head *head)
 {
+	head->finger = NULL;
 	__btree_init(head);
+	head->nodesize = 0;
+	head->pool = NULL;
+	head->sync = NULL;
 }
 
-unsigned long *btree_last(struct btree_head *head, struct btree_geo *geo)
+void btree_init_nodesize(struct btree_head *head, int nodesize)
+{
+	BUG_ON(nodesize < NODESIZE || nodesize > MAX_NODESIZE);
+	head->finger = NULL;
+	__btree_init(head);
+	head->nodesize = nodesize == NODESIZE ? 0 : nodesize;
+	head->pool = NULL;
+	head->sync = NULL;
+}
+
+void btree_set_pool(struct btree_head *head, struct btree_pool *pool)
+{
+	BUG_ON(head->node);
+	BUG_ON(pool && pool->nodesize !=
+			(head->nodesize ? head->nodesize : NODESIZE));
+	head->pool = pool;
+}
+
+void btree_set_finger(struct btree_head *head, struct btree_finger *finger)
+{
+	head->finger = finger;
+	finger_drop(head);
+}
+
+static __always_inline unsigned long *__btree_last(struct btree_head *head,
+		struct btree_geo *geo)
 {
 	int height = head->height;
 	unsigned long *node = head->node;
@@ -216,27 +375,224 @@ unsigned long *btree_last(struct btree_head *head, struct btree_geo *geo)
 	return bkey(geo, node, 0);
 }
 
-static int keycmp(struct btree_geo *geo, unsigned long *node, int pos,
+unsigned long *btree_last(struct btree_head *head, struct btree_geo *geo)
+{
+	struct btree_geo tgeo = TREE_GEO(head, geo);
+
+	return __btree_last(head, &tgeo);
+}
+
+static __always_inline int keycmp(struct btree_geo *geo, unsigned long *node, int pos,
 		unsigned long *key)
 {
 	return longcmp(bkey(geo, node, pos), key, geo->keylen);
 }
 
-void *btree_lookup(struct btree_head *head, struct btree_geo *geo,
+/*
+ * Intra-node search.  We are looking for the first slot whose key is less
+ * than or equal to the search key.  Since keys are sorted in descending order
+ * and unused slots are NUL, which compares less or equal to any key, all
+ * slots before that position compare greater and all slots from there on
+ * compare less or equal.  That holds for the full node, used or not, so
+ * neither search variant needs to know the fill level.
+ *
+ * For single-long keys the position is simply the number of keys greater
+ * than the search key.  Counting them is branch-free and lets the compiler,
+ * or the vector code below, compare several slots at once.
+ *
+ * The vector variants are built with target attributes and picked at
+ * startup by what the cpu supports, so they are used without -mavx2.
+ */
+static int count_greater_c(const unsigned long *node, int n,
+		unsigned long key)
+{
+	int i, pos = 0;
+
+	for (i = 0; i < n; i++)
+		pos += node[i] > key;
+	return pos;
+}
+
+#ifdef __x86_64__
+/* no unsigned 64bit compare, flip the sign bit to get one */
+#define SIGN_BIAS ((long long)(1ULL << 63))
+
+__attribute__((target("sse4.2")))
+static int count_greater_sse42(const unsigned long *node, int n,
+		unsigned long key)
+{
+	__m128i k2 = _mm_set1_epi64x(key ^ SIGN_BIAS);
+	__m128i b2 = _mm_set1_epi64x(SIGN_BIAS);
+	int i, pos = 0;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		__m128i v = _mm_loadu_si128((__m128i *)(node + i));
+
+		v = _mm_xor_si128(v, b2);
+		pos += __builtin_popcount(_mm_movemask_pd(
+				_mm_castsi128_pd(_mm_cmpgt_epi64(v, k2))));
+	}
+	for ( ; i < n; i++)
+		pos += node[i] > key;
+	return pos;
+}
+
+__attribute__((target("avx2")))
+static int count_greater_avx2(const unsigned long *node, int n,
+		unsigned long key)
+{
+	__m256i k4 = _mm256_set1_epi64x(key ^ SIGN_BIAS);
+	__m256i b4 = _mm256_set1_epi64x(SIGN_BIAS);
+	int i, pos = 0;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i v = _mm256_loadu_si256((__m256i *)(node + i));
+
+		v = _mm256_xor_si256(v, b4);
+		pos += __builtin_popcount(_mm256_movemask_pd(
+				_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, k4))));
+	}
+	for ( ; i < n; i++)
+		pos += node[i] > key;
+	return pos;
+}
+
+static int (*count_greater)(const unsigned long *node, int n,
+		unsigned long key) = count_greater_c;
+
+__attribute__((constructor))
+static void pick_count_greater(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		count_greater = count_greater_avx2;
+	else if (__builtin_cpu_supports("sse4.2"))
+		count_greater = count_greater_sse42;
+}
+#else
+#define count_greater count_greater_c
+#endif
+
+static __always_inline int getpos_long(struct btree_geo *geo, unsigned long *node,
+		unsigned long key)
+{
+	return count_greater(node, geo->no_pairs, key);
+}
+
+/*
+ * Wider keys are compared word by word, so counting would cost a full
+ * comparison per slot.  A branch-free binary search needs log2(no_pairs)
+ * of them instead.  For small nodes that does not pay off against a linear
+ * scan, which stops at the first match.  With random 128bit keys, the 21
+ * slots of the 512 byte nodes logfs uses look up 25-45% faster with the
+ * linear scan, bisecting wins from roughly 40 slots.
+ *
+ * Counting single-long keys with AVX2 beats bisecting up to 128 slots, but
+ * not at 256.  Both with btree_bench -k rand.
+ */
+#ifndef BSEARCH_MIN_PAIRS
+#define BSEARCH_MIN_PAIRS 40
+#endif
+#ifndef BSEARCH_MIN_LONG_PAIRS
+#define BSEARCH_MIN_LONG_PAIRS 256
+#endif
+
+static __always_inline int getpos_linear(struct btree_geo *geo, unsigned long *node,
+		unsigned long *key)
+{
+	int i;
+
+	for (i = 0; i < geo->no_pairs; i++)
+		if (keycmp(geo, node, i, key) <= 0)
+			break;
+	return i;
+}
+
+static __always_inline int getpos_bsearch(struct btree_geo *geo, unsigned long *node,
+		unsigned long *key)
+{
+	int base = 0, n = geo->no_pairs, half;
+
+	while (n > 1) {
+		half = n / 2;
+		base = keycmp(geo, node, base + half, key) > 0 ? base + half : base;
+		n -= half;
+	}
+	return base + (keycmp(geo, node, base, key) > 0);
+}
+
+static __always_inline int getpos(struct btree_geo *geo, unsigned long *node,
 		unsigned long *key)
+{
+	if (geo->keylen != 1 && geo->no_pairs < BSEARCH_MIN_PAIRS)
+		return getpos_linear(geo, node, key);
+	/* ascending inserts always land in slot 0, check it first */
+	if (keycmp(geo, node, 0, key) <= 0)
+		return 0;
+	if (geo->keylen == 1 && geo->no_pairs < BSEARCH_MIN_LONG_PAIRS)
+		return getpos_long(geo, node, *key);
+	return getpos_bsearch(geo, node, key);
+}
+
+/*
+ * A leaf is reached by all keys from its own key in the parent up to, but
+ * not including, the key of its left neighbour.  @lo and @hi point to those
+ * keys, NULL meaning unbounded.  The parent key may be lower than the
+ * smallest key in the leaf, which only makes the range conservative.
+ */
+static __always_inline void finger_set(struct btree_head *head,
+		struct btree_geo *geo, unsigned long *leaf,
+		unsigned long *lo, unsigned long *hi)
+{
+	struct btree_finger *f = head->finger;
+
+	f->leaf = leaf;
+	if (lo)
+		longcpy(f->lo, lo, geo->keylen);
+	else
+		longset(f->lo, 0, geo->keylen);
+	if (hi)
+		longcpy(f->hi, hi, geo->keylen);
+	else
+		longset(f->hi, ~0UL, geo->keylen);
+}
+
+/* The cached leaf if @key falls into its range, NULL otherwise */
+static __always_inline unsigned long *finger_leaf(struct btree_head *head,
+		struct btree_geo *geo, unsigned long *key)
+{
+	struct btree_finger *f = head->finger;
+
+	if (!f || !f->leaf)
+		return NULL;
+	if (longcmp(key, f->lo, geo->keylen) < 0)
+		return NULL;
+	if (longcmp(key, f->hi, geo->keylen) >= 0)
+		return NULL;
+	return f->leaf;
+}
+
+static __always_inline void *__btree_lookup(struct btree_head *head,
+		struct btree_geo *geo, unsigned long *key)
 {
 	int i, height = head->height;
-	unsigned long *node = head->node;
+	unsigned long *node, *lo = NULL, *hi = NULL;
 
+	node = finger_leaf(head, geo, key);
+	if (node)
+		goto leaf;
+
+	node = head->node;
 	if (height == 0)
 		return NULL;
 
 	for ( ; height > 1; height--) {
-		for (i = 0; i < geo->no_pairs; i++)
-			if (keycmp(geo, node, i, key) <= 0)
-				break;
+		i = getpos(geo, node, key);
 		if (i == geo->no_pairs)
 			return NULL;
+		if (i > 0)
+			hi = bkey(geo, node, i - 1);
+		lo = bkey(geo, node, i);
 		node = (unsigned long *)bval(geo, node, i);
 		if (!node)
 			return NULL;
@@ -244,26 +600,25 @@ void *btree_lookup(struct btree_head *head, struct btree_geo *geo,
 
 	if (!node)
 		return NULL;
+	if (head->finger)
+		finger_set(head, geo, node, lo, hi);
 
-	for (i = 0; i < geo->no_pairs; i++)
-		if (keycmp(geo, node, i, key) == 0)
-			return (void *)bval(geo, node, i);
+leaf:
+	i = getpos(geo, node, key);
+	if (i < geo->no_pairs && keycmp(geo, node, i, key) == 0)
+		return (void *)bval(geo, node, i);
 	return NULL;
 }
 
-static int getpos(struct btree_geo *geo, unsigned long *node,
+void *btree_lookup(struct btree_head *head, struct btree_geo *geo,
 		unsigned long *key)
 {
-	int i;
+	struct btree_geo tgeo = TREE_GEO(head, geo);
 
-	for (i = 0; i < geo->no_pairs; i++) {
-		if (keycmp(geo, node, i, key) <= 0)
-			break;
-	}
-	return i;
+	return __btree_lookup(head, &tgeo, key);
 }
 
-static int getfill(struct btree_geo *geo, unsigned long *node, int start)
+static __always_inline int getfill(struct btree_geo *geo, unsigned long *node, int start)
 {
 	int i;
 
@@ -276,16 +631,14 @@ static int getfill(struct btree_geo *geo, unsigned long *node, int start)
 /*
  * locate the correct leaf node in the btree
  */
-static unsigned long *find_level(struct btree_head *head, struct btree_geo *geo,
+static __always_inline unsigned long *find_level(struct btree_head *head, struct btree_geo *geo,
 		unsigned long *key, int level)
 {
-	unsigned long *node = head->node;
+	unsigned long *node = head->node, *lo = NULL, *hi = NULL;
 	int i, height;
 
 	for (height = head->height; height > level; height--) {
-		for (i = 0; i < geo->no_pairs; i++)
-			if (keycmp(geo, node, i, key) <= 0)
-				break;
+		i = getpos(geo, node, key);
 
 		if ((i == geo->no_pairs) || !bval(geo, node, i)) {
 			/* right-most key is too large, update it */
@@ -295,12 +648,28 @@ static unsigned long *find_level(struct btree_head *head, struct btree_geo *geo,
 			setkey(geo, node, key, i);
 		}
 		BUG_ON(i < 0);
+		if (i > 0)
+			hi = bkey(geo, node, i - 1);
+		lo = bkey(geo, node, i);
 		node = (unsigned long *)bval(geo, node, i);
 	}
 	BUG_ON(!node);
+	if (level == 1 && head->finger)
+		finger_set(head, geo, node, lo, hi);
 	return node;
 }
 
+/* Find the leaf for @key, using the finger if possible */
+static __always_inline unsigned long *find_leaf(struct btree_head *head,
+		struct btree_geo *geo, unsigned long *key)
+{
+	unsigned long *node = finger_leaf(head, geo, key);
+
+	if (node)
+		return node;
+	return find_level(head, geo, key, 1);
+}
+
 static int btree_grow(struct btree_head *head, struct btree_geo *geo)
 {
 	unsigned long *node;
@@ -325,10 +694,11 @@ static void btree_shrink(struct btree_head *head, struct btree_geo *geo,
 	unsigned long *node;
 
 	if ((fill == 0) || ((fill == 1) && (head->height > 1))) {
+		finger_drop(head);
 		node = head->node;
 		head->node = (unsigned long *)bval(geo, node, 0);
 		head->height--;
-		free(node);
+		btree_node_free(head, node);
 	}
 }
 
@@ -340,6 +710,7 @@ static void steal_l(struct btree_head *head, struct btree_geo *geo, int level,
 {
 	int i;
 
+	finger_drop(head);
 	for (i = rfill - 1; i >= 0; i--) {
 		/* Shift entries on the right */
 		setkey(geo, right, bkey(geo, right, i), i + no_entries);
@@ -364,6 +735,7 @@ static void steal_r(struct btree_head *head, struct btree_geo *geo, int level,
 {
 	int i;
 
+	finger_drop(head);
 	for (i = 0; i < no_entries; i++) {
 		/* Move some entries to the left */
 		setkey(geo, left, bkey(geo, right, i), lfill + i);
@@ -391,11 +763,12 @@ static int split(struct btree_head *head, struct btree_geo *geo,
 	new = btree_node_alloc(head);
 	if (!new)
 		return -ENOMEM;
+	finger_drop(head);
 	err = btree_insert_level(head, geo,
 			bkey(geo, node, fill / 2 - 1),
 			(unsigned long)new, level + 1);
 	if (err) {
-		free(new);
+		btree_node_free(head, new);
 		return err;
 	}
 	for (i = 0; i < fill / 2; i++) {
@@ -499,7 +872,9 @@ retry:
 int btree_insert(struct btree_head *head, struct btree_geo *geo,
 		unsigned long *key, void *val)
 {
-	return btree_insert_level(head, geo, key, (unsigned long)val, 1);
+	struct btree_geo tgeo = TREE_GEO(head, geo);
+
+	return btree_insert_level(head, &tgeo, key, (unsigned long)val, 1);
 }
 
 static void *btree_remove_level(struct btree_head *head, struct btree_geo *geo,
@@ -511,6 +886,7 @@ static void merge(struct btree_head *head, struct btree_geo *geo, int level,
 {
 	int i;
 
+	finger_drop(head);
 	for (i = 0; i < rfill; i++) {
 		/* Move all entries to the left */
 		setkey(geo, left, bkey(geo, right, i), lfill + i);
@@ -521,14 +897,14 @@ static void merge(struct btree_head *head, struct btree_geo *geo, int level,
 	setval(geo, parent, (unsigned long)left, lpos + 1);
 	/* Remove left (formerly right) child from parent */
 	btree_remove_level(head, geo, bkey(geo, parent, lpos), level + 1);
-	free(right);
+	btree_node_free(head, right);
 }
 
 static void rebalance(struct btree_head *head, struct btree_geo *geo,
 		unsigned long *key, int level, unsigned long *child, int fill)
 {
 	unsigned long *parent, *left = NULL, *right = NULL;
-	int child_no, no_left, no_right, i;
+	int child_no, no_left = 0, no_right = 0, i;
 
 	parent = find_level(head, geo, key, level + 1);
 	child_no = getpos(geo, parent, key);
@@ -609,7 +985,9 @@ static void *btree_remove_level(struct btree_head *head, struct btree_geo *geo,
 	node = find_level(head, geo, key, level);
 	pos = getpos(geo, node, key);
 	fill = getfill(geo, node, pos);
-	if ((level == 1) && (keycmp(geo, node, pos, key) != 0))
+	/* an all-zero key matches the first unused slot */
+	if (level == 1 && (pos == geo->no_pairs || !bval(geo, node, pos) ||
+				keycmp(geo, node, pos, key) != 0))
 		return NULL;
 	ret = (void *)bval(geo, node, pos);
 
@@ -633,86 +1011,375 @@ static void *btree_remove_level(struct btree_head *head, struct btree_geo *geo,
 void *btree_remove(struct btree_head *head, struct btree_geo *geo,
 		unsigned long *key)
 {
+	struct btree_geo tgeo = TREE_GEO(head, geo);
+
 	if (head->height == 0)
 		return NULL;
 
-	return btree_remove_level(head, geo, key, 1);
+	return btree_remove_level(head, &tgeo, key, 1);
 }
 
-int btree_merge(struct btree_head *target, struct btree_head *victim,
-		struct btree_geo *geo, unsigned long *duplicate)
+/*
+ * Fast paths for the per-geometry instances below.  The common case of an
+ * insert or remove touches only a single leaf.  Anything that needs to split,
+ * merge or rebalance nodes is handed to the generic code, using @generic
+ * for the geometry so the local one never escapes the instance.
+ */
+static __always_inline int __btree_insert(struct btree_head *head,
+		struct btree_geo *geo, struct btree_geo *generic,
+		unsigned long *key, void *val)
 {
-	unsigned long *key;
-	void *val;
-	int err;
+	unsigned long *node;
+	int i, pos, fill;
 
-	BUG_ON(target == victim);
+	if (head->height == 0)
+		return btree_insert(head, generic, key, val);
 
-	if (!(target->node)) {
-		/* target is empty, just copy fields over */
-		target->node = victim->node;
-		target->height = victim->height;
-		__btree_init(victim);
-		return 0;
-	}
+	node = find_leaf(head, geo, key);
+	pos = getpos(geo, node, key);
+	fill = getfill(geo, node, pos);
+	if (fill == geo->no_pairs)
+		return btree_insert(head, generic, key, val);
+	BUG_ON(!val);
+	/* two identical keys are not allowed */
+	BUG_ON(pos < fill && keycmp(geo, node, pos, key) == 0);
 
-	for (;;) {
-		key = btree_last(victim, geo);
-		if (!key)
-			break;
-		val = btree_lookup(victim, geo, key);
-		err = btree_insert(target, geo, key, val);
-		if (err)
-			return err;
-		/* We must make a copy of the key, as the original will get
-		 * mangled inside btree_remove. */
-		longcpy(duplicate, key, geo->keylen);
-		btree_remove(victim, geo, duplicate);
+	/* shift and insert */
+	for (i = fill; i > pos; i--) {
+		setkey(geo, node, bkey(geo, node, i - 1), i);
+		setval(geo, node, bval(geo, node, i - 1), i);
 	}
+	setkey(geo, node, key, pos);
+	setval(geo, node, (unsigned long)val, pos);
 	return 0;
 }
 
-static size_t __btree_for_each(struct btree_head *head, struct btree_geo *geo,
-		unsigned long *node, long opaque,
-		void (*func)(void *elem, long opaque,
-			unsigned long *key, size_t index, void *func2),
-		void *func2, int reap, int height, size_t count)
+static __always_inline void *__btree_remove(struct btree_head *head,
+		struct btree_geo *geo, struct btree_geo *generic,
+		unsigned long *key)
+{
+	unsigned long *node;
+	int i, pos, fill;
+	void *ret;
+
+	if (head->height == 0)
+		return NULL;
+
+	node = find_leaf(head, geo, key);
+	pos = getpos(geo, node, key);
+	if (pos == geo->no_pairs || !bval(geo, node, pos) ||
+			keycmp(geo, node, pos, key) != 0)
+		return NULL;
+	fill = getfill(geo, node, pos);
+	if (fill - 1 < geo->no_pairs / 2)
+		return btree_remove(head, generic, key);
+
+	ret = (void *)bval(geo, node, pos);
+	/* remove and shift */
+	for (i = pos; i < fill - 1; i++) {
+		setkey(geo, node, bkey(geo, node, i + 1), i);
+		setval(geo, node, bval(geo, node, i + 1), i);
+	}
+	clearpair(geo, node, fill - 1);
+	return ret;
+}
+
+/*
+ * Bulk loading.  Builds the tree bottom-up from @count keys in ascending
+ * order, one level at a time.  Nodes on each level are filled as far as
+ * possible with the entries spread evenly, so no node but the root ends up
+ * less than half full.  The parent key of each child is its smallest key,
+ * which is simply the last used slot of the child.
+ */
+static void free_subtree(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *node, int height)
 {
 	int i;
-	unsigned long *child;
 
-	for (i = 0; i < geo->no_pairs; i++) {
-		child = (void *)bval(geo, node, i);
-		if (!child)
+	for (i = 0; height > 1 && i < geo->no_pairs; i++) {
+		if (!bval(geo, node, i))
 			break;
-		if (height > 1)
-			count = __btree_for_each(head, geo, child, opaque,
-					func, func2, reap, height - 1, count);
-		else
-			func(child, opaque, bkey(geo, node, i), count++,
-					func2);
+		free_subtree(head, geo, (unsigned long *)bval(geo, node, i),
+				height - 1);
 	}
-	if (reap)
-		free(node);
-	return count;
+	btree_node_free(head, node);
 }
 
-static void empty(void *elem, long opaque, unsigned long *key, size_t index,
-		void *func2)
+static int load_level(struct btree_head *head, struct btree_geo *geo,
+		unsigned long **parents, size_t no_parents,
+		unsigned long *keys, void **vals, unsigned long **children,
+		size_t count)
 {
+	size_t i, n = count;
+	size_t fill = count / no_parents, extra = count % no_parents;
+	unsigned long *node, *key, val;
+	int j;
+
+	/* Highest keys first, both within a node and across nodes */
+	for (i = 0; i < no_parents; i++) {
+		node = btree_node_alloc(head);
+		if (!node) {
+			while (i--)
+				btree_node_free(head,
+						parents[no_parents - 1 - i]);
+			return -ENOMEM;
+		}
+		for (j = 0; j < fill + (i < extra); j++) {
+			n--;
+			if (children) {
+				val = (unsigned long)children[n];
+				key = bkey(geo, children[n],
+						getfill(geo, children[n], 0) - 1);
+			} else {
+				val = (unsigned long)vals[n];
+				key = &keys[n * geo->keylen];
+				BUG_ON(!val);
+				/* keys must be sorted and unique */
+				BUG_ON(n > 0 && longcmp(key - geo->keylen, key,
+							geo->keylen) >= 0);
+			}
+			setkey(geo, node, key, j);
+			setval(geo, node, val, j);
+		}
+		/* parents are kept in ascending order as well */
+		parents[no_parents - 1 - i] = node;
+	}
+	return 0;
 }
 
-void visitorl(void *elem, long opaque, unsigned long *key, size_t index,
-		void *__func)
+static int __btree_load(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *keys, void **vals, size_t count)
 {
-	visitorl_t func = __func;
+	unsigned long **nodes;
+	size_t i, n, no_parents;
+	int height = 1, err;
 
-	func(elem, opaque, *key, index);
-}
+	BUG_ON(head->node);
+	if (!count)
+		return 0;
 
-void visitor32(void *elem, long opaque, unsigned long *__key, size_t index,
-		void *__func)
-{
+	n = (count + geo->no_pairs - 1) / geo->no_pairs;
+	/* room for one level and its parents */
+	nodes = malloc(2 * n * sizeof(*nodes));
+	if (!nodes)
+		return -ENOMEM;
+	err = load_level(head, geo, nodes, n, keys, vals, NULL, count);
+	while (!err && n > 1) {
+		no_parents = (n + geo->no_pairs - 1) / geo->no_pairs;
+		err = load_level(head, geo, nodes + n, no_parents,
+				NULL, NULL, nodes, n);
+		if (err) {
+			for (i = 0; i < n; i++)
+				free_subtree(head, geo, nodes[i], height);
+			break;
+		}
+		memmove(nodes, nodes + n, no_parents * sizeof(*nodes));
+		n = no_parents;
+		height++;
+	}
+	if (!err) {
+		finger_drop(head);
+		head->node = nodes[0];
+		head->height = height;
+	}
+	free(nodes);
+	return err;
+}
+
+int btree_load(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *keys, void **vals, size_t count)
+{
+	struct btree_geo tgeo = TREE_GEO(head, geo);
+
+	return __btree_load(head, &tgeo, keys, vals, count);
+}
+
+static size_t count_entries(struct btree_geo *geo, unsigned long *node,
+		int height)
+{
+	size_t count = 0;
+	int i, fill = getfill(geo, node, 0);
+
+	if (height == 1)
+		return fill;
+	for (i = 0; i < fill; i++)
+		count += count_entries(geo, (unsigned long *)bval(geo, node, i),
+				height - 1);
+	return count;
+}
+
+/* Append all entries below @node to @keys and @vals in ascending order */
+static size_t collect(struct btree_geo *geo, unsigned long *node, int height,
+		unsigned long *keys, void **vals, size_t n)
+{
+	int i;
+
+	for (i = getfill(geo, node, 0) - 1; i >= 0; i--) {
+		if (height > 1) {
+			n = collect(geo, (unsigned long *)bval(geo, node, i),
+					height - 1, keys, vals, n);
+			continue;
+		}
+		longcpy(&keys[n * geo->keylen], bkey(geo, node, i),
+				geo->keylen);
+		vals[n++] = (void *)bval(geo, node, i);
+	}
+	return n;
+}
+
+/*
+ * Linear merge.  Both trees are flattened into sorted arrays, merged and
+ * the result bulk loaded into a fresh tree.  Only once that succeeded are
+ * the old nodes freed, so on failure both trees are still intact.
+ */
+static int merge_linear(struct btree_head *target, struct btree_head *victim,
+		struct btree_geo *tgeo, struct btree_geo *vgeo)
+{
+	struct btree_head new = {
+		.nodesize = target->nodesize,
+		.pool = target->pool,
+	};
+	size_t nt = 0, nv, i, j, k;
+	unsigned long *keys, *vkeys;
+	void **vals, **vvals;
+	int keylen = tgeo->keylen, cmp, err = -ENOMEM;
+
+	if (target->node)
+		nt = count_entries(tgeo, target->node, target->height);
+	nv = count_entries(vgeo, victim->node, victim->height);
+	keys = malloc((nt + nv) * keylen * sizeof(long));
+	vals = malloc((nt + nv) * sizeof(void *));
+	vkeys = malloc(nv * keylen * sizeof(long));
+	vvals = malloc(nv * sizeof(void *));
+	if (!keys || !vals || !vkeys || !vvals)
+		goto out;
+
+	if (target->node)
+		collect(tgeo, target->node, target->height, keys, vals, 0);
+	collect(vgeo, victim->node, victim->height, vkeys, vvals, 0);
+	/* merge from the back, target entries are already in place */
+	i = nt;
+	j = nv;
+	for (k = nt + nv; j > 0; k--) {
+		cmp = i > 0 ? longcmp(&keys[(i - 1) * keylen],
+				&vkeys[(j - 1) * keylen], keylen) : -1;
+		/* two identical keys are not allowed */
+		BUG_ON(cmp == 0);
+		if (cmp > 0) {
+			i--;
+			longcpy(&keys[(k - 1) * keylen], &keys[i * keylen],
+					keylen);
+			vals[k - 1] = vals[i];
+		} else {
+			j--;
+			longcpy(&keys[(k - 1) * keylen], &vkeys[j * keylen],
+					keylen);
+			vals[k - 1] = vvals[j];
+		}
+	}
+
+	err = __btree_load(&new, tgeo, keys, vals, nt + nv);
+	if (err)
+		goto out;
+	if (target->node)
+		free_subtree(target, tgeo, target->node, target->height);
+	free_subtree(victim, vgeo, victim->node, victim->height);
+	finger_drop(target);
+	target->node = new.node;
+	target->height = new.height;
+	__btree_init(victim);
+out:
+	free(keys);
+	free(vals);
+	free(vkeys);
+	free(vvals);
+	return err;
+}
+
+int btree_merge(struct btree_head *target, struct btree_head *victim,
+		struct btree_geo *geo, unsigned long *duplicate)
+{
+	struct btree_geo tgeo = TREE_GEO(target, geo);
+	struct btree_geo vgeo = TREE_GEO(victim, geo);
+	unsigned long *key;
+	void *val;
+	int err;
+
+	BUG_ON(target == victim);
+
+	if (!(target->node) && target->nodesize == victim->nodesize &&
+			target->pool == victim->pool) {
+		/* target is empty, just copy fields over */
+		finger_drop(target);
+		target->node = victim->node;
+		target->height = victim->height;
+		__btree_init(victim);
+		return 0;
+	}
+	if (!(victim->node))
+		return 0;
+
+	if (!merge_linear(target, victim, &tgeo, &vgeo))
+		return 0;
+
+	/* Not enough memory for the linear merge, move entries one by one */
+	for (;;) {
+		key = btree_last(victim, geo);
+		if (!key)
+			break;
+		val = btree_lookup(victim, geo, key);
+		err = btree_insert(target, geo, key, val);
+		if (err)
+			return err;
+		/* We must make a copy of the key, as the original will get
+		 * mangled inside btree_remove. */
+		longcpy(duplicate, key, geo->keylen);
+		btree_remove(victim, geo, duplicate);
+	}
+	return 0;
+}
+
+static size_t __btree_for_each(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *node, long opaque,
+		void (*func)(void *elem, long opaque,
+			unsigned long *key, size_t index, void *func2),
+		void *func2, int reap, int height, size_t count)
+{
+	int i;
+	unsigned long *child;
+
+	for (i = 0; i < geo->no_pairs; i++) {
+		child = (void *)bval(geo, node, i);
+		if (!child)
+			break;
+		if (height > 1)
+			count = __btree_for_each(head, geo, child, opaque,
+					func, func2, reap, height - 1, count);
+		else
+			func(child, opaque, bkey(geo, node, i), count++,
+					func2);
+	}
+	if (reap)
+		btree_node_free(head, node);
+	return count;
+}
+
+static void empty(void *elem, long opaque, unsigned long *key, size_t index,
+		void *func2)
+{
+}
+
+void visitorl(void *elem, long opaque, unsigned long *key, size_t index,
+		void *__func)
+{
+	visitorl_t func = __func;
+
+	func(elem, opaque, *key, index);
+}
+
+void visitor32(void *elem, long opaque, unsigned long *__key, size_t index,
+		void *__func)
+{
 	visitor32_t func = __func;
 	u32 *key = (void *)__key;
 
@@ -742,12 +1409,13 @@ size_t btree_visitor(struct btree_head *head, struct btree_geo *geo,
 		void (*func)(void *elem, long opaque, unsigned long *key,
 			size_t index, void *func2), void *func2)
 {
+	struct btree_geo tgeo = TREE_GEO(head, geo);
 	size_t count = 0;
 
 	if (!func2)
 		func = empty;
 	if (head->node)
-		count = __btree_for_each(head, geo, head->node, opaque, func,
+		count = __btree_for_each(head, &tgeo, head->node, opaque, func,
 				func2, 0, head->height, 0);
 	return count;
 }
@@ -757,13 +1425,917 @@ size_t btree_grim_visitor(struct btree_head *head, struct btree_geo *geo,
 		void (*func)(void *elem, long opaque, unsigned long *key,
 			size_t index, void *func2), void *func2)
 {
+	struct btree_geo tgeo = TREE_GEO(head, geo);
 	size_t count = 0;
 
 	if (!func2)
 		func = empty;
 	if (head->node)
-		count = __btree_for_each(head, geo, head->node, opaque, func,
+		count = __btree_for_each(head, &tgeo, head->node, opaque, func,
 				func2, 1, head->height, 0);
 	__btree_init(head);
 	return count;
 }
+
+/*
+ * Parallel visitors.  The tree is cut into subtrees on the highest level
+ * that has at least VISIT_TASKS of them per thread.  Workers pick subtrees
+ * from a shared counter in key order, so a slow subtree does not hold up
+ * the rest.  In ordered mode a parallel counting pass first establishes
+ * the index of the first entry in each subtree, which makes the indices
+ * identical to those of btree_visitor().  Otherwise each worker counts
+ * its own entries from zero.
+ */
+#define VISIT_TASKS 8
+
+struct visit_ctl {
+	struct btree_head *head;
+	struct btree_geo *geo;
+	void (*func)(void *elem, long opaque, unsigned long *key,
+			size_t index, void *func2);
+	void *func2;
+	long *opaque;
+	unsigned long **task;
+	size_t *start;		/* index of the first entry, ordered mode */
+	size_t no_tasks;
+	size_t next;
+	int height;		/* of the task subtrees */
+	int flags;
+	int reap;
+	pthread_mutex_t lock;	/* protects head->pool when reaping */
+};
+
+struct visit_worker {
+	struct visit_ctl *ctl;
+	int id;
+	size_t count;
+	void *free, *free_last;	/* nodes reaped for head->pool */
+	pthread_t thread;
+};
+
+static size_t visit_next(struct visit_ctl *ctl)
+{
+	return __atomic_fetch_add(&ctl->next, 1, __ATOMIC_RELAXED);
+}
+
+static void *visit_count(void *data)
+{
+	struct visit_worker *w = data;
+	struct visit_ctl *ctl = w->ctl;
+	size_t t;
+
+	while ((t = visit_next(ctl)) < ctl->no_tasks)
+		ctl->start[t] = count_entries(ctl->geo, ctl->task[t],
+				ctl->height);
+	return NULL;
+}
+
+/*
+ * Pool nodes are chained up privately and handed back once per worker, so
+ * reaping does not serialise on the pool.  free() is thread-safe anyway.
+ */
+static void reap_subtree(struct visit_worker *w, unsigned long *node,
+		int height)
+{
+	struct btree_geo *geo = w->ctl->geo;
+	int i;
+
+	for (i = 0; height > 1 && i < geo->no_pairs; i++) {
+		if (!bval(geo, node, i))
+			break;
+		reap_subtree(w, (unsigned long *)bval(geo, node, i),
+				height - 1);
+	}
+	if (!w->ctl->head->pool) {
+		free(node);
+		return;
+	}
+	*(void **)node = w->free;
+	if (!w->free)
+		w->free_last = node;
+	w->free = node;
+}
+
+static void *visit_work(void *data)
+{
+	struct visit_worker *w = data;
+	struct visit_ctl *ctl = w->ctl;
+	size_t t, base, end;
+
+	while ((t = visit_next(ctl)) < ctl->no_tasks) {
+		base = ctl->flags & BTREE_VISIT_ORDERED ? ctl->start[t] : w->count;
+		end = __btree_for_each(ctl->head, ctl->geo, ctl->task[t],
+				ctl->opaque[w->id], ctl->func, ctl->func2, 0,
+				ctl->height, base);
+		w->count += end - base;
+		if (ctl->reap)
+			reap_subtree(w, ctl->task[t], ctl->height);
+	}
+	if (w->free) {
+		pthread_mutex_lock(&ctl->lock);
+		pool_free_chain(ctl->head->pool, w->free, w->free_last);
+		pthread_mutex_unlock(&ctl->lock);
+	}
+	return NULL;
+}
+
+/* The calling thread is worker 0 and picks up the slack if pthread fails */
+static void visit_run(struct visit_ctl *ctl, struct visit_worker *w,
+		int threads, void *(*fn)(void *))
+{
+	int i;
+
+	ctl->next = 0;
+	for (i = 1; i < threads; i++)
+		if (pthread_create(&w[i].thread, NULL, fn, &w[i]))
+			w[i].ctl = NULL;
+	fn(&w[0]);
+	for (i = 1; i < threads; i++)
+		if (w[i].ctl)
+			pthread_join(w[i].thread, NULL);
+}
+
+/* Collect the nodes of the highest level with at least @want of them */
+static unsigned long **visit_tasks(struct btree_geo *geo, unsigned long *root,
+		int height, size_t want, size_t *no_tasks, int *task_height)
+{
+	unsigned long **task, **next;
+	size_t i, n = 1, m;
+	int j, fill;
+
+	task = malloc(sizeof(*task));
+	if (!task)
+		return NULL;
+	task[0] = root;
+	for ( ; height > 1 && n < want; height--) {
+		for (i = m = 0; i < n; i++)
+			m += getfill(geo, task[i], 0);
+		next = malloc(m * sizeof(*next));
+		if (!next) {
+			free(task);
+			return NULL;
+		}
+		for (i = m = 0; i < n; i++) {
+			fill = getfill(geo, task[i], 0);
+			for (j = 0; j < fill; j++)
+				next[m++] = (unsigned long *)bval(geo, task[i], j);
+		}
+		free(task);
+		task = next;
+		n = m;
+	}
+	*no_tasks = n;
+	*task_height = height;
+	return task;
+}
+
+/* Free the nodes above the task subtrees after a parallel reap */
+static void free_upper(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *node, int height, int stop)
+{
+	int i;
+
+	for (i = 0; height - 1 > stop && i < geo->no_pairs; i++) {
+		if (!bval(geo, node, i))
+			break;
+		free_upper(head, geo, (unsigned long *)bval(geo, node, i),
+				height - 1, stop);
+	}
+	btree_node_free(head, node);
+}
+
+static size_t visitor_parallel(struct btree_head *head, struct btree_geo *geo,
+		int threads, int flags, long *opaque,
+		void (*func)(void *elem, long opaque, unsigned long *key,
+			size_t index, void *func2), void *func2, int reap)
+{
+	struct visit_ctl ctl;
+	struct visit_worker *w;
+	size_t i, count = 0, start;
+
+	w = calloc(threads, sizeof(*w));
+	if (!w)
+		return -1;
+	ctl.task = visit_tasks(geo, head->node, head->height,
+			(size_t)threads * VISIT_TASKS, &ctl.no_tasks, &ctl.height);
+	if (!ctl.task) {
+		free(w);
+		return -1;
+	}
+	ctl.start = malloc(ctl.no_tasks * sizeof(*ctl.start));
+	if (!ctl.start) {
+		free(ctl.task);
+		free(w);
+		return -1;
+	}
+	ctl.head = head;
+	ctl.geo = geo;
+	ctl.func = func;
+	ctl.func2 = func2;
+	ctl.opaque = opaque;
+	ctl.flags = flags;
+	ctl.reap = reap;
+	pthread_mutex_init(&ctl.lock, NULL);
+	for (i = 0; i < threads; i++) {
+		w[i].ctl = &ctl;
+		w[i].id = i;
+	}
+
+	if (flags & BTREE_VISIT_ORDERED) {
+		visit_run(&ctl, w, threads, visit_count);
+		for (i = start = 0; i < ctl.no_tasks; i++) {
+			count = ctl.start[i];
+			ctl.start[i] = start;
+			start += count;
+		}
+		for (i = 1; i < threads; i++)
+			w[i].ctl = &ctl;
+	}
+	visit_run(&ctl, w, threads, visit_work);
+
+	for (i = count = 0; i < threads; i++)
+		count += w[i].count;
+	if (reap && ctl.height < head->height)
+		free_upper(head, geo, head->node, head->height, ctl.height);
+	pthread_mutex_destroy(&ctl.lock);
+	free(ctl.start);
+	free(ctl.task);
+	free(w);
+	return count;
+}
+
+/*
+ * Like btree_visitor(), but with @threads threads calling @func.  Worker n
+ * passes opaque[n] to it.  Returns -1 without visiting anything if memory
+ * runs out.
+ */
+size_t btree_visitor_parallel(struct btree_head *head, struct btree_geo *geo,
+		int threads, int flags, long *opaque,
+		void (*func)(void *elem, long opaque, unsigned long *key,
+			size_t index, void *func2), void *func2)
+{
+	struct btree_geo tgeo = TREE_GEO(head, geo);
+
+	if (threads <= 1 || head->height <= 1)
+		return btree_visitor(head, geo, opaque[0], func, func2);
+	if (!func2)
+		func = empty;
+	return visitor_parallel(head, &tgeo, threads, flags, opaque, func,
+			func2, 0);
+}
+
+/* Like btree_grim_visitor(), see btree_visitor_parallel() */
+size_t btree_grim_visitor_parallel(struct btree_head *head,
+		struct btree_geo *geo, int threads, int flags, long *opaque,
+		void (*func)(void *elem, long opaque, unsigned long *key,
+			size_t index, void *func2), void *func2)
+{
+	struct btree_geo tgeo = TREE_GEO(head, geo);
+	size_t count;
+
+	if (threads <= 1 || head->height <= 1)
+		return btree_grim_visitor(head, geo, opaque[0], func, func2);
+	if (!func2)
+		func = empty;
+	count = visitor_parallel(head, &tgeo, threads, flags, opaque, func,
+			func2, 1);
+	if (count != -1)
+		__btree_init(head);
+	return count;
+}
+
+#ifdef BTREE_DEBUG
+/*
+ * Invariant checker.  Note that a parent key only has to be less than or
+ * equal to the smallest key of its child.  Removes do not raise parent keys
+ * when they take out the smallest key of a child.
+ */
+static void check_fail(struct btree_geo *geo, unsigned long *node,
+		const char *msg)
+{
+	printf("btree_check: %s\n", msg);
+	dumpnode(geo, node);
+	fflush(stdout);
+	BUG();
+}
+
+/* Checks that all keys below @node lie within [lo, hi), NULL is unbounded */
+static size_t check_node(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *node, int height, unsigned long *lo,
+		unsigned long *hi, int *found_finger)
+{
+	struct btree_finger *f = head->finger;
+	size_t count = 0;
+	int i, k, fill = getfill(geo, node, 0);
+
+	if (fill == 0 && node != head->node)
+		check_fail(geo, node, "empty node");
+	for (i = fill; i < geo->no_pairs; i++) {
+		for (k = 0; k < geo->keylen; k++)
+			if (bkey(geo, node, i)[k])
+				check_fail(geo, node, "key in unused slot");
+		if (bval(geo, node, i))
+			check_fail(geo, node, "value after unused slot");
+	}
+	for (i = 0; i < fill; i++) {
+		if (i > 0 && keycmp(geo, node, i, bkey(geo, node, i - 1)) >= 0)
+			check_fail(geo, node, "keys out of order");
+		if (lo && keycmp(geo, node, i, lo) < 0)
+			check_fail(geo, node, "key below parent key");
+		if (hi && keycmp(geo, node, i, hi) >= 0)
+			check_fail(geo, node, "key above range");
+	}
+
+	if (height == 1) {
+		if (f && f->leaf == node) {
+			if (lo && longcmp(f->lo, lo, geo->keylen) < 0)
+				check_fail(geo, node, "finger below leaf range");
+			if (hi && longcmp(f->hi, hi, geo->keylen) > 0)
+				check_fail(geo, node, "finger above leaf range");
+			*found_finger = 1;
+		}
+		return fill;
+	}
+	for (i = 0; i < fill; i++)
+		count += check_node(head, geo, (unsigned long *)bval(geo, node, i),
+				height - 1, bkey(geo, node, i),
+				i ? bkey(geo, node, i - 1) : hi, found_finger);
+	return count;
+}
+
+/*
+ * Walks the whole tree, checking node contents, key order and ranges and
+ * the finger.  Dumps the offending node and aborts on the first violation.
+ * Returns the number of entries.
+ */
+size_t btree_check(struct btree_head *head, struct btree_geo *geo)
+{
+	struct btree_geo tgeo = TREE_GEO(head, geo);
+	int found_finger = 0;
+	size_t count;
+
+	BUG_ON(!head->node != !head->height);
+	if (!head->node) {
+		BUG_ON(head->finger && head->finger->leaf);
+		return 0;
+	}
+	count = check_node(head, &tgeo, head->node, head->height, NULL, NULL,
+			&found_finger);
+	BUG_ON(head->finger && head->finger->leaf && !found_finger);
+	return count;
+}
+
+/* Returns the number of nodes handed out and not freed again */
+size_t btree_pool_check(struct btree_pool *pool)
+{
+	size_t stride = pool_stride(pool), carved = 0, free = 0;
+	void *slab, *node;
+
+	for (slab = pool->slabs; slab; slab = *(void **)slab) {
+		if (slab == pool->slabs)
+			carved += (pool->next - slab - L1_CACHE_BYTES) / stride;
+		else
+			carved += (pool->slab_size - L1_CACHE_BYTES) / stride;
+	}
+	for (node = pool->free; node; node = *(void **)node)
+		BUG_ON(++free > carved);
+	return carved - free;
+}
+#endif
+
+/*
+ * Cursors.  A cursor remembers the node and slot on every level of the path
+ * to the current entry, so stepping to a neighbour only touches the nodes
+ * that actually change.  Since the lowest keys are to the right, "next"
+ * (towards larger keys) means moving left within a node.
+ *
+ * Any modification of the tree, except through btree_cursor_remove() on
+ * this very cursor, invalidates the cursor.
+ */
+static void *cursor_val(struct btree_cursor *c)
+{
+	if (!c->height)
+		return NULL;
+	return (void *)bval(&c->geo, c->node[0], c->pos[0]);
+}
+
+/*
+ * Step one entry towards lower (dir = 1) or higher (dir = -1) keys.  Walks
+ * up until some level has a neighbouring slot, then down along the near
+ * edge of the neighbouring subtree.
+ */
+static void *cursor_step(struct btree_cursor *c, int dir)
+{
+	struct btree_geo *geo = &c->geo;
+	unsigned long *node;
+	int level, pos = 0;
+
+	if (!c->height)
+		return NULL;
+	for (level = 0; level < c->height; level++) {
+		pos = c->pos[level] + dir;
+		if (pos >= 0 && pos < geo->no_pairs &&
+				bval(geo, c->node[level], pos))
+			break;
+	}
+	if (level == c->height) {
+		c->height = 0;
+		return NULL;
+	}
+	c->pos[level] = pos;
+	for ( ; level > 0; level--) {
+		node = (unsigned long *)bval(geo, c->node[level],
+				c->pos[level]);
+		c->node[level - 1] = node;
+		c->pos[level - 1] = dir > 0 ? 0 : getfill(geo, node, 0) - 1;
+	}
+	return cursor_val(c);
+}
+
+/*
+ * Walk down towards @key, or along the right edge for the smallest key if
+ * @key is NULL.  The leaf position is the first slot with a key less than or
+ * equal to @key and may be one past the last used slot.
+ */
+static void cursor_descend(struct btree_cursor *c, unsigned long *key)
+{
+	struct btree_geo *geo = &c->geo;
+	unsigned long *node = c->head->node;
+	int level, pos, fill;
+
+	BUG_ON(c->head->height > BTREE_MAX_HEIGHT);
+	c->height = c->head->height;
+	for (level = c->height - 1; level >= 0; level--) {
+		fill = getfill(geo, node, 0);
+		pos = key ? getpos(geo, node, key) : fill;
+		/* below the smallest key, keep to the right edge */
+		if (level > 0 && pos >= fill)
+			pos = fill - 1;
+		c->node[level] = node;
+		c->pos[level] = pos;
+		if (level > 0)
+			node = (unsigned long *)bval(geo, node, pos);
+	}
+}
+
+static void cursor_init(struct btree_cursor *c, struct btree_head *head,
+		struct btree_geo *geo)
+{
+	struct btree_geo tgeo = TREE_GEO(head, geo);
+
+	c->head = head;
+	c->geo = tgeo;
+	c->height = 0;
+}
+
+void *btree_cursor_first(struct btree_cursor *c, struct btree_head *head,
+		struct btree_geo *geo)
+{
+	cursor_init(c, head, geo);
+	if (!head->node)
+		return NULL;
+	cursor_descend(c, NULL);
+	return cursor_step(c, -1);
+}
+
+void *btree_cursor_last(struct btree_cursor *c, struct btree_head *head,
+		struct btree_geo *geo)
+{
+	int level;
+
+	cursor_init(c, head, geo);
+	if (!head->node)
+		return NULL;
+	BUG_ON(head->height > BTREE_MAX_HEIGHT);
+	c->height = head->height;
+	c->node[c->height - 1] = head->node;
+	for (level = c->height - 1; level >= 0; level--) {
+		c->pos[level] = 0;
+		if (level > 0)
+			c->node[level - 1] = (unsigned long *)bval(&c->geo,
+					c->node[level], 0);
+	}
+	return cursor_val(c);
+}
+
+void *btree_cursor_seek(struct btree_cursor *c, struct btree_head *head,
+		struct btree_geo *geo, unsigned long *key)
+{
+	int pos;
+
+	cursor_init(c, head, geo);
+	if (!head->node)
+		return NULL;
+	cursor_descend(c, key);
+	pos = c->pos[0];
+	if (pos < c->geo.no_pairs && bval(&c->geo, c->node[0], pos) &&
+			keycmp(&c->geo, c->node[0], pos, key) == 0)
+		return cursor_val(c);
+	/* the slot holds the next smaller key, step back up */
+	return cursor_step(c, -1);
+}
+
+void *btree_cursor_next(struct btree_cursor *c)
+{
+	return cursor_step(c, -1);
+}
+
+void *btree_cursor_prev(struct btree_cursor *c)
+{
+	return cursor_step(c, 1);
+}
+
+unsigned long *btree_cursor_key(struct btree_cursor *c)
+{
+	if (!c->height)
+		return NULL;
+	return bkey(&c->geo, c->node[0], c->pos[0]);
+}
+
+/*
+ * Would removing one entry from the current leaf, leaving @fill entries,
+ * make btree_remove_level() change the tree structure?  Mirrors the checks
+ * in rebalance() and btree_shrink() using the parent from the cursor path.
+ * An underfull leaf that can neither merge nor needs to steal is left alone
+ * there, which is the common case when draining a tree in order.
+ */
+static int cursor_needs_rebalance(struct btree_cursor *c, int fill)
+{
+	struct btree_geo *geo = &c->geo;
+	unsigned long *parent, *sibling;
+	int pos;
+
+	if (fill >= geo->no_pairs / 2)
+		return 0;
+	if (c->height == 1 || fill <= 1)
+		return c->height > 1 || fill == 0;
+	parent = c->node[1];
+	pos = c->pos[1];
+	if (pos > 0) {
+		sibling = (unsigned long *)bval(geo, parent, pos - 1);
+		if (fill + getfill(geo, sibling, 0) <= geo->no_pairs)
+			return 1;
+	}
+	if (pos + 1 < geo->no_pairs && bval(geo, parent, pos + 1)) {
+		sibling = (unsigned long *)bval(geo, parent, pos + 1);
+		if (fill + getfill(geo, sibling, 0) <= geo->no_pairs)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Remove the current entry and move to the next smaller one, returning its
+ * value.  Unless the tree needs rebalancing, the entry is shifted out in
+ * place and the cursor stays where it is.  Otherwise the generic code does
+ * the work and the cursor is repositioned from the root.
+ */
+void *btree_cursor_remove(struct btree_cursor *c)
+{
+	struct btree_geo *geo = &c->geo;
+	unsigned long *node = c->node[0];
+	int n, pos = c->pos[0], fill;
+
+	if (!c->height)
+		return NULL;
+	BUG_ON(c->height != c->head->height);
+	fill = getfill(geo, node, pos);
+	if (cursor_needs_rebalance(c, fill - 1)) {
+		longcpy(c->key, bkey(geo, node, pos), geo->keylen);
+		btree_remove_level(c->head, geo, c->key, 1);
+		if (!c->head->node) {
+			c->height = 0;
+			return NULL;
+		}
+		cursor_descend(c, c->key);
+		pos = c->pos[0];
+		if (pos < geo->no_pairs && bval(geo, c->node[0], pos))
+			return cursor_val(c);
+		return cursor_step(c, 1);
+	}
+
+	/* keys and values are contiguous, shift both in one go */
+	n = fill - 1 - pos;
+	memmove(bkey(geo, node, pos), bkey(geo, node, pos + 1),
+			n * geo->keylen * sizeof(long));
+	memmove(&node[geo->no_pairs * geo->keylen + pos],
+			&node[geo->no_pairs * geo->keylen + pos + 1],
+			n * sizeof(long));
+	clearpair(geo, node, fill - 1);
+	if (pos < fill - 1)
+		return cursor_val(c);
+	/* removed the smallest key in this leaf, continue in the next one */
+	return cursor_step(c, 1);
+}
+
+/*
+ * Concurrent access, see btree_set_sync().  Lookups never take a lock.
+ * They validate what they read against two kinds of sequence counters:
+ *
+ * - sync->seq changes around structural modifications (splits, merges,
+ *   growing, shrinking and bound updates).  Those run exclusively, under
+ *   the write side of sync->lock.
+ * - Every leaf maps to one of BTREE_SYNC_STRIPES striped counters.  Inserts
+ *   and removes that fit into a single leaf only hold the read side of
+ *   sync->lock, which keeps all inner nodes stable, and lock just the
+ *   stripe of their leaf.  Writers to different leaves run in parallel.
+ *
+ * A reader checks sync->seq before following each child pointer, so it
+ * never dereferences a pointer read from a node that was being changed.
+ * Once it has read the leaf, it checks both the stripe and sync->seq.
+ * Freed nodes may still be read by a lookup that is about to fail
+ * validation.  That is safe because the nodes come from a pool, which
+ * keeps its memory until the pool is destroyed.
+ */
+#define SYNC_RETRIES 16
+
+static unsigned long *sync_stripe(struct btree_sync *sync, unsigned long *node)
+{
+	u64 hash = (unsigned long)node * 0x9e3779b97f4a7c15ULL;
+
+	return &sync->stripe[hash >> (64 - BTREE_SYNC_STRIPE_BITS)].seq;
+}
+
+static inline int seq_valid(unsigned long *seq, unsigned long start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(seq, __ATOMIC_RELAXED) == start;
+}
+
+static inline void seq_begin(unsigned long *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seq_end(unsigned long *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static void stripe_lock(unsigned long *seq)
+{
+	unsigned long old;
+
+	for (;;) {
+		old = __atomic_load_n(seq, __ATOMIC_RELAXED);
+		if (!(old & 1) && __atomic_compare_exchange_n(seq, &old,
+					old + 1, 0, __ATOMIC_ACQUIRE,
+					__ATOMIC_RELAXED))
+			break;
+		sched_yield();
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+int btree_sync_init(struct btree_sync *sync)
+{
+	memset(sync, 0, sizeof(*sync));
+	return -pthread_rwlock_init(&sync->lock, NULL);
+}
+
+void btree_sync_destroy(struct btree_sync *sync)
+{
+	pthread_rwlock_destroy(&sync->lock);
+}
+
+void btree_set_sync(struct btree_head *head, struct btree_sync *sync)
+{
+	/* readers rely on type-stable node memory and must not move fingers */
+	BUG_ON(sync && (!head->pool || head->finger));
+	head->sync = sync;
+}
+
+/* Exclusive access for anything but the _sync operations */
+void btree_sync_lock(struct btree_head *head)
+{
+	pthread_rwlock_wrlock(&head->sync->lock);
+	seq_begin(&head->sync->seq);
+}
+
+void btree_sync_unlock(struct btree_head *head)
+{
+	seq_end(&head->sync->seq);
+	pthread_rwlock_unlock(&head->sync->lock);
+}
+
+/*
+ * Optimistic lookup.  Returns 0 and sets @ret if everything read was
+ * consistent, -EAGAIN if it has to be retried.
+ */
+static int lookup_optimistic(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *key, void **ret)
+{
+	struct btree_sync *sync = head->sync;
+	unsigned long start, ver, *node, *stripe;
+	int i, height;
+
+	*ret = NULL;
+	start = __atomic_load_n(&sync->seq, __ATOMIC_ACQUIRE);
+	if (start & 1)
+		return -EAGAIN;
+	height = __atomic_load_n(&head->height, __ATOMIC_RELAXED);
+	node = __atomic_load_n(&head->node, __ATOMIC_RELAXED);
+	if (height == 0)
+		return seq_valid(&sync->seq, start) ? 0 : -EAGAIN;
+
+	for ( ; height > 1; height--) {
+		i = getpos(geo, node, key);
+		node = i < geo->no_pairs ?
+			(unsigned long *)bval(geo, node, i) : NULL;
+		if (!seq_valid(&sync->seq, start))
+			return -EAGAIN;
+		if (!node)
+			return 0;
+	}
+
+	stripe = sync_stripe(sync, node);
+	ver = __atomic_load_n(stripe, __ATOMIC_ACQUIRE);
+	if ((ver & 1) || !seq_valid(&sync->seq, start))
+		return -EAGAIN;
+	i = getpos(geo, node, key);
+	if (i < geo->no_pairs && keycmp(geo, node, i, key) == 0)
+		*ret = (void *)bval(geo, node, i);
+	/* splits and merges change the leaf without touching its stripe */
+	if (!seq_valid(stripe, ver) || !seq_valid(&sync->seq, start))
+		return -EAGAIN;
+	return 0;
+}
+
+/*
+ * Find the leaf for @key with the read side of sync->lock held.  Returns
+ * NULL if the tree is empty or the descent would have to update a bound,
+ * both of which need exclusive access for an insert.
+ */
+static unsigned long *find_leaf_shared(struct btree_head *head,
+		struct btree_geo *geo, unsigned long *key)
+{
+	unsigned long *node = head->node;
+	int i, height;
+
+	if (head->height == 0)
+		return NULL;
+	for (height = head->height; height > 1; height--) {
+		i = getpos(geo, node, key);
+		if (i == geo->no_pairs || !bval(geo, node, i))
+			return NULL;
+		node = (unsigned long *)bval(geo, node, i);
+	}
+	return node;
+}
+
+void *btree_lookup_sync(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *key)
+{
+	struct btree_geo tgeo = TREE_GEO(head, geo);
+	struct btree_sync *sync = head->sync;
+	unsigned long *node, *stripe;
+	void *ret = NULL;
+	int i;
+
+	for (i = 0; i < SYNC_RETRIES; i++)
+		if (!lookup_optimistic(head, &tgeo, key, &ret))
+			return ret;
+
+	/* heavy write traffic, lock the leaf to guarantee progress */
+	pthread_rwlock_rdlock(&sync->lock);
+	node = find_leaf_shared(head, &tgeo, key);
+	if (node) {
+		stripe = sync_stripe(sync, node);
+		stripe_lock(stripe);
+		i = getpos(&tgeo, node, key);
+		if (i < tgeo.no_pairs && keycmp(&tgeo, node, i, key) == 0)
+			ret = (void *)bval(&tgeo, node, i);
+		seq_end(stripe);
+	}
+	pthread_rwlock_unlock(&sync->lock);
+	return ret;
+}
+
+int btree_insert_sync(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *key, void *val)
+{
+	struct btree_geo tgeo = TREE_GEO(head, geo);
+	struct btree_sync *sync = head->sync;
+	unsigned long *node, *stripe;
+	int i, pos, fill, err;
+
+	BUG_ON(!val);
+	pthread_rwlock_rdlock(&sync->lock);
+	node = find_leaf_shared(head, &tgeo, key);
+	if (node) {
+		stripe = sync_stripe(sync, node);
+		stripe_lock(stripe);
+		pos = getpos(&tgeo, node, key);
+		fill = getfill(&tgeo, node, pos);
+		if (fill < tgeo.no_pairs) {
+			/* two identical keys are not allowed */
+			BUG_ON(pos < fill && keycmp(&tgeo, node, pos, key) == 0);
+			for (i = fill; i > pos; i--) {
+				setkey(&tgeo, node, bkey(&tgeo, node, i - 1), i);
+				setval(&tgeo, node, bval(&tgeo, node, i - 1), i);
+			}
+			setkey(&tgeo, node, key, pos);
+			setval(&tgeo, node, (unsigned long)val, pos);
+			seq_end(stripe);
+			pthread_rwlock_unlock(&sync->lock);
+			return 0;
+		}
+		seq_end(stripe);
+	}
+	pthread_rwlock_unlock(&sync->lock);
+
+	btree_sync_lock(head);
+	err = btree_insert(head, geo, key, val);
+	btree_sync_unlock(head);
+	return err;
+}
+
+void *btree_remove_sync(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *key)
+{
+	struct btree_geo tgeo = TREE_GEO(head, geo);
+	struct btree_sync *sync = head->sync;
+	unsigned long *node, *stripe;
+	int i, pos, fill;
+	void *ret;
+
+	pthread_rwlock_rdlock(&sync->lock);
+	node = find_leaf_shared(head, &tgeo, key);
+	if (!node) {
+		pthread_rwlock_unlock(&sync->lock);
+		return NULL;
+	}
+	stripe = sync_stripe(sync, node);
+	stripe_lock(stripe);
+	pos = getpos(&tgeo, node, key);
+	if (pos == tgeo.no_pairs || !bval(&tgeo, node, pos) ||
+			keycmp(&tgeo, node, pos, key) != 0) {
+		seq_end(stripe);
+		pthread_rwlock_unlock(&sync->lock);
+		return NULL;
+	}
+	fill = getfill(&tgeo, node, pos);
+	if (fill - 1 >= tgeo.no_pairs / 2 || (head->height == 1 && fill > 1)) {
+		ret = (void *)bval(&tgeo, node, pos);
+		for (i = pos; i < fill - 1; i++) {
+			setkey(&tgeo, node, bkey(&tgeo, node, i + 1), i);
+			setval(&tgeo, node, bval(&tgeo, node, i + 1), i);
+		}
+		clearpair(&tgeo, node, fill - 1);
+		seq_end(stripe);
+		pthread_rwlock_unlock(&sync->lock);
+		return ret;
+	}
+	seq_end(stripe);
+	pthread_rwlock_unlock(&sync->lock);
+
+	btree_sync_lock(head);
+	ret = btree_remove(head, geo, key);
+	btree_sync_unlock(head);
+	return ret;
+}
+
+/*
+ * Per-geometry instances of the hot operations.  The key length is a compile
+ * time constant, so all per-slot loops get unrolled and key comparisons turn
+ * into native word compares.  The number of pairs per node comes from the
+ * tree.  The wrappers in btree.h use these, the generic functions remain for
+ * arbitrary geometries and for the structural slow paths.
+ */
+#define INSTANCE_GEO(head, KEYLEN)					\
+	{ KEYLEN, tree_pairs(head, KEYLEN, NO_PAIRS(KEYLEN)) }
+
+#define BTREE_INSTANCE(name, KEYLEN)					\
+void *btree_lookup_##name(struct btree_head *head, unsigned long *key)	\
+{									\
+	struct btree_geo geo = INSTANCE_GEO(head, KEYLEN);		\
+									\
+	return __btree_lookup(head, &geo, key);				\
+}									\
+									\
+int btree_insert_##name(struct btree_head *head, unsigned long *key,	\
+		void *val)						\
+{									\
+	struct btree_geo geo = INSTANCE_GEO(head, KEYLEN);		\
+									\
+	return __btree_insert(head, &geo, &btree_##name, key, val);	\
+}									\
+									\
+void *btree_remove_##name(struct btree_head *head, unsigned long *key)	\
+{									\
+	struct btree_geo geo = INSTANCE_GEO(head, KEYLEN);		\
+									\
+	return __btree_remove(head, &geo, &btree_##name, key);		\
+}									\
+									\
+unsigned long *btree_last_##name(struct btree_head *head)		\
+{									\
+	struct btree_geo geo = INSTANCE_GEO(head, KEYLEN);		\
+									\
+	return __btree_last(head, &geo);				\
+}
+
+BTREE_INSTANCE(geo32, GEO32_KEYLEN)
+BTREE_INSTANCE(geo64, GEO64_KEYLEN)
+BTREE_INSTANCE(geo128, GEO128_KEYLEN)
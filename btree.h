@@ -1,6 +1,7 @@
 #ifndef BTREE_H
 #define BTREE_H
 
+#include <pthread.h>
 #include "kerncompat.h"
 
 /*
@@ -8,11 +9,63 @@
  * [key0, key1, ..., keyN] [val0, val1, ..., valN]
  * Each key is an array of unsigned longs, head->no_longs in total.
  * Total number of keys and vals (N) is head->no_pairs.
+ *
+ * Nodes are NODESIZE bytes unless the tree was set up with
+ * btree_init_nodesize(), in which case N grows with the node.
  */
 
+#define BTREE_MAX_KEYLEN (128 / BITS_PER_LONG)
+
+#ifndef L1_CACHE_BYTES
+#define L1_CACHE_BYTES 128
+#endif
+
+/*
+ * Optional lookup hint, see btree_set_finger().  Remembers the last leaf
+ * found and the range of keys [lo, hi) leading to it.  Lookups, inserts and
+ * removes within that range skip the descent from the root.
+ */
+struct btree_finger {
+	unsigned long *leaf;
+	unsigned long lo[BTREE_MAX_KEYLEN];
+	unsigned long hi[BTREE_MAX_KEYLEN];
+};
+
+/*
+ * Node allocator shared by any number of trees with the same node size,
+ * see btree_set_pool().  Trees without a pool use calloc and free.
+ */
+struct btree_pool {
+	int nodesize;
+	size_t slab_size;
+	void *free;		/* recycled nodes */
+	void *next, *end;	/* unused part of the newest slab */
+	void *slabs;
+	unsigned long no_slabs;
+};
+
+/*
+ * Shared state for trees accessed by several threads, see btree_set_sync().
+ * Leaves map onto the striped sequence counters by address.
+ */
+#define BTREE_SYNC_STRIPE_BITS 8
+#define BTREE_SYNC_STRIPES (1 << BTREE_SYNC_STRIPE_BITS)
+
+struct btree_sync {
+	pthread_rwlock_t lock;
+	unsigned long seq;
+	struct {
+		unsigned long seq;
+	} __attribute__((aligned(L1_CACHE_BYTES))) stripe[BTREE_SYNC_STRIPES];
+};
+
 struct btree_head {
 	unsigned long *node;
 	int height;
+	int nodesize;	/* 0 for the default */
+	struct btree_finger *finger;
+	struct btree_pool *pool;
+	struct btree_sync *sync;
 };
 
 struct btree_geo {
@@ -23,6 +76,22 @@ extern struct btree_geo btree_geo32;
 extern struct btree_geo btree_geo64;
 extern struct btree_geo btree_geo128;
 
+/*
+ * Position within a tree, see btree_cursor_*().  node[0] and pos[0] are the
+ * leaf, node[height - 1] is the root.  height is 0 once the cursor ran off
+ * either end of the tree.
+ */
+#define BTREE_MAX_HEIGHT 32
+
+struct btree_cursor {
+	struct btree_head *head;
+	struct btree_geo geo;
+	int height;
+	unsigned long *node[BTREE_MAX_HEIGHT];
+	int pos[BTREE_MAX_HEIGHT];
+	unsigned long key[BTREE_MAX_KEYLEN];
+};
+
 struct btree_headl { struct btree_head h; };
 struct btree_head32 { struct btree_head h; };
 struct btree_head64 { struct btree_head h; };
@@ -33,8 +102,17 @@ struct btree_head128 { struct btree_head h; };
  * consists only of wrappers that try to add some typesafety, make the code
  * a little self-documenting and generally be nice to people.
  */
+void btree_pool_init(struct btree_pool *pool, int nodesize);
+void btree_pool_destroy(struct btree_pool *pool);
+void *btree_alloc(void *pool_data);
 void btree_free(void *element, void *pool_data);
 void btree_init(struct btree_head *head);
+void btree_init_nodesize(struct btree_head *head, int nodesize);
+void btree_set_finger(struct btree_head *head, struct btree_finger *finger);
+void btree_set_pool(struct btree_head *head, struct btree_pool *pool);
+int btree_sync_init(struct btree_sync *sync);
+void btree_sync_destroy(struct btree_sync *sync);
+void btree_set_sync(struct btree_head *head, struct btree_sync *sync);
 void *btree_lookup(struct btree_head *head, struct btree_geo *geo,
 		unsigned long *key);
 int btree_insert(struct btree_head *head, struct btree_geo *geo,
@@ -43,6 +121,8 @@ void *btree_remove(struct btree_head *head, struct btree_geo *geo,
 		unsigned long *key);
 int btree_merge(struct btree_head *target, struct btree_head *victim,
 		struct btree_geo *geo, unsigned long *duplicate);
+int btree_load(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *keys, void **vals, size_t count);
 unsigned long *btree_last(struct btree_head *head, struct btree_geo *geo);
 size_t btree_visitor(struct btree_head *head, struct btree_geo *geo,
 		long opaque,
@@ -53,26 +133,149 @@ size_t btree_grim_visitor(struct btree_head *head, struct btree_geo *geo,
 		void (*func)(void *elem, long opaque, unsigned long *key,
 			size_t index, void *func2), void *func2);
 
+/*
+ * Parallel visitors.  @func runs on several threads at once, each passing
+ * its own element of @opaque.  Entries are not delivered in key order
+ * across threads, not even with BTREE_VISIT_ORDERED.  That flag only makes
+ * index the same as for the plain visitors, the position of the entry in
+ * tree order.  Otherwise index counts the entries each thread has seen.
+ * Within one thread, entries always come in tree order.
+ */
+#define BTREE_VISIT_ORDERED	1
+
+size_t btree_visitor_parallel(struct btree_head *head, struct btree_geo *geo,
+		int threads, int flags, long *opaque,
+		void (*func)(void *elem, long opaque, unsigned long *key,
+			size_t index, void *func2), void *func2);
+size_t btree_grim_visitor_parallel(struct btree_head *head,
+		struct btree_geo *geo, int threads, int flags, long *opaque,
+		void (*func)(void *elem, long opaque, unsigned long *key,
+			size_t index, void *func2), void *func2);
+
+/*
+ * Cursors walk the tree in key order.  Each call returns the value of the
+ * entry the cursor ends up on, or NULL if there is none.  seek finds the
+ * smallest key greater than or equal to @key.  remove deletes the current
+ * entry and moves on to the next smaller one.  Modifying the tree in any
+ * other way invalidates all cursors on it.
+ */
+void *btree_cursor_first(struct btree_cursor *c, struct btree_head *head,
+		struct btree_geo *geo);
+void *btree_cursor_last(struct btree_cursor *c, struct btree_head *head,
+		struct btree_geo *geo);
+void *btree_cursor_seek(struct btree_cursor *c, struct btree_head *head,
+		struct btree_geo *geo, unsigned long *key);
+void *btree_cursor_next(struct btree_cursor *c);
+void *btree_cursor_prev(struct btree_cursor *c);
+void *btree_cursor_remove(struct btree_cursor *c);
+unsigned long *btree_cursor_key(struct btree_cursor *c);
+
+/*
+ * Thread-safe variants for trees with btree_set_sync().  Lookups do not
+ * block and scale with the number of readers.  Inserts and removes that
+ * stay within one leaf only serialize against writers to the same stripe.
+ * Any other operation on such a tree has to be bracketed by
+ * btree_sync_lock() and btree_sync_unlock().
+ */
+void *btree_lookup_sync(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *key);
+int btree_insert_sync(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *key, void *val);
+void *btree_remove_sync(struct btree_head *head, struct btree_geo *geo,
+		unsigned long *key);
+void btree_sync_lock(struct btree_head *head);
+void btree_sync_unlock(struct btree_head *head);
+
+#ifdef BTREE_DEBUG
+size_t btree_check(struct btree_head *head, struct btree_geo *geo);
+size_t btree_pool_check(struct btree_pool *pool);
+void btree_dump(struct btree_head *head, struct btree_geo *geo);
+#endif
+
+/*
+ * Instances of the hot operations compiled for a fixed geometry, see
+ * BTREE_INSTANCE in btree.c.
+ */
+#define BTREE_INSTANCE_DECL(name)					\
+void *btree_lookup_##name(struct btree_head *head, unsigned long *key);	\
+int btree_insert_##name(struct btree_head *head, unsigned long *key,	\
+		void *val);						\
+void *btree_remove_##name(struct btree_head *head, unsigned long *key);	\
+unsigned long *btree_last_##name(struct btree_head *head);
+
+BTREE_INSTANCE_DECL(geo32)
+BTREE_INSTANCE_DECL(geo64)
+BTREE_INSTANCE_DECL(geo128)
+
 /* key is unsigned long */
 static inline void btree_initl(struct btree_headl *head)
 {
 	btree_init(&head->h);
 }
 
+static inline void btree_initl_nodesize(struct btree_headl *head, int nodesize)
+{
+	btree_init_nodesize(&head->h, nodesize);
+}
+
+static inline void btree_set_fingerl(struct btree_headl *head,
+		struct btree_finger *finger)
+{
+	btree_set_finger(&head->h, finger);
+}
+
+static inline void btree_set_pooll(struct btree_headl *head,
+		struct btree_pool *pool)
+{
+	btree_set_pool(&head->h, pool);
+}
+
 static inline void *btree_lookupl(struct btree_headl *head, unsigned long key)
 {
-	return btree_lookup(&head->h, &btree_geo32, &key);
+	return btree_lookup_geo32(&head->h, &key);
 }
 
 static inline int btree_insertl(struct btree_headl *head, unsigned long key,
 		void *val)
 {
-	return btree_insert(&head->h, &btree_geo32, &key, val);
+	return btree_insert_geo32(&head->h, &key, val);
 }
 
 static inline void *btree_removel(struct btree_headl *head, unsigned long key)
 {
-	return btree_remove(&head->h, &btree_geo32, &key);
+	return btree_remove_geo32(&head->h, &key);
+}
+
+/* keys must be sorted in ascending order, the tree must be empty */
+static inline int btree_loadl(struct btree_headl *head, unsigned long *keys,
+		void **vals, size_t count)
+{
+	return btree_load(&head->h, &btree_geo32, keys, vals, count);
+}
+
+static inline void *btree_cursor_firstl(struct btree_cursor *c,
+		struct btree_headl *head)
+{
+	return btree_cursor_first(c, &head->h, &btree_geo32);
+}
+
+static inline void *btree_cursor_lastl(struct btree_cursor *c,
+		struct btree_headl *head)
+{
+	return btree_cursor_last(c, &head->h, &btree_geo32);
+}
+
+static inline void *btree_cursor_seekl(struct btree_cursor *c,
+		struct btree_headl *head, unsigned long key)
+{
+	return btree_cursor_seek(c, &head->h, &btree_geo32, &key);
+}
+
+static inline unsigned long btree_cursor_keyl(struct btree_cursor *c)
+{
+	unsigned long *key = btree_cursor_key(c);
+
+	return key ? *key : 0;
 }
 
 static inline int btree_mergel(struct btree_headl *target,
@@ -101,26 +304,57 @@ static inline size_t btree_grim_visitorl(struct btree_headl *head, long opaque,
 	return btree_grim_visitor(&head->h, &btree_geo32, opaque, visitorl, func2);
 }
 
+static inline size_t btree_visitor_parallell(struct btree_headl *head,
+		int threads, int flags, long *opaque, visitorl_t func2)
+{
+	return btree_visitor_parallel(&head->h, &btree_geo32, threads, flags,
+			opaque, visitorl, func2);
+}
+
+static inline size_t btree_grim_visitor_parallell(struct btree_headl *head,
+		int threads, int flags, long *opaque, visitorl_t func2)
+{
+	return btree_grim_visitor_parallel(&head->h, &btree_geo32, threads,
+			flags, opaque, visitorl, func2);
+}
+
 /* key is u32 */
 static inline void btree_init32(struct btree_head32 *head)
 {
 	btree_init(&head->h);
 }
 
+static inline void btree_init32_nodesize(struct btree_head32 *head, int nodesize)
+{
+	btree_init_nodesize(&head->h, nodesize);
+}
+
+static inline void btree_set_finger32(struct btree_head32 *head,
+		struct btree_finger *finger)
+{
+	btree_set_finger(&head->h, finger);
+}
+
+static inline void btree_set_pool32(struct btree_head32 *head,
+		struct btree_pool *pool)
+{
+	btree_set_pool(&head->h, pool);
+}
+
 static inline void *btree_lookup32(struct btree_head32 *head, u32 key)
 {
-	return btree_lookup(&head->h, &btree_geo32, (unsigned long *)&key);
+	return btree_lookup_geo32(&head->h, (unsigned long *)&key);
 }
 
 static inline int btree_insert32(struct btree_head32 *head, u32 key,
 		void *val)
 {
-	return btree_insert(&head->h, &btree_geo32, (unsigned long *)&key, val);
+	return btree_insert_geo32(&head->h, (unsigned long *)&key, val);
 }
 
 static inline void *btree_remove32(struct btree_head32 *head, u32 key)
 {
-	return btree_remove(&head->h, &btree_geo32, (unsigned long *)&key);
+	return btree_remove_geo32(&head->h, (unsigned long *)&key);
 }
 
 static inline int btree_merge32(struct btree_head32 *target,
@@ -148,33 +382,120 @@ static inline size_t btree_grim_visitor32(struct btree_head32 *head, long opaque
 	return btree_grim_visitor(&head->h, &btree_geo32, opaque, visitor32, func2);
 }
 
+static inline size_t btree_visitor_parallel32(struct btree_head32 *head,
+		int threads, int flags, long *opaque, visitor32_t func2)
+{
+	return btree_visitor_parallel(&head->h, &btree_geo32, threads, flags,
+			opaque, visitor32, func2);
+}
+
+static inline size_t btree_grim_visitor_parallel32(struct btree_head32 *head,
+		int threads, int flags, long *opaque, visitor32_t func2)
+{
+	return btree_grim_visitor_parallel(&head->h, &btree_geo32, threads,
+			flags, opaque, visitor32, func2);
+}
+
 /* key is u64 */
 static inline void btree_init64(struct btree_head64 *head)
 {
 	btree_init(&head->h);
 }
 
+static inline void btree_init64_nodesize(struct btree_head64 *head, int nodesize)
+{
+	btree_init_nodesize(&head->h, nodesize);
+}
+
+static inline void btree_set_finger64(struct btree_head64 *head,
+		struct btree_finger *finger)
+{
+	btree_set_finger(&head->h, finger);
+}
+
+static inline void btree_set_pool64(struct btree_head64 *head,
+		struct btree_pool *pool)
+{
+	btree_set_pool(&head->h, pool);
+}
+
+static inline void btree_set_sync64(struct btree_head64 *head,
+		struct btree_sync *sync)
+{
+	btree_set_sync(&head->h, sync);
+}
+
+static inline void *btree_lookup_sync64(struct btree_head64 *head, u64 key)
+{
+	return btree_lookup_sync(&head->h, &btree_geo64, (unsigned long *)&key);
+}
+
+static inline int btree_insert_sync64(struct btree_head64 *head, u64 key,
+		void *val)
+{
+	return btree_insert_sync(&head->h, &btree_geo64, (unsigned long *)&key,
+			val);
+}
+
+static inline void *btree_remove_sync64(struct btree_head64 *head, u64 key)
+{
+	return btree_remove_sync(&head->h, &btree_geo64, (unsigned long *)&key);
+}
+
 static inline void *btree_lookup64(struct btree_head64 *head, u64 key)
 {
-	return btree_lookup(&head->h, &btree_geo64, (unsigned long *)&key);
+	return btree_lookup_geo64(&head->h, (unsigned long *)&key);
 }
 
 static inline int btree_insert64(struct btree_head64 *head, u64 key,
 		void *val)
 {
-	return btree_insert(&head->h, &btree_geo64, (unsigned long *)&key, val);
+	return btree_insert_geo64(&head->h, (unsigned long *)&key, val);
 }
 
 static inline void *btree_remove64(struct btree_head64 *head, u64 key)
 {
-	return btree_remove(&head->h, &btree_geo64, (unsigned long *)&key);
+	return btree_remove_geo64(&head->h, (unsigned long *)&key);
+}
+
+static inline int btree_load64(struct btree_head64 *head, u64 *keys,
+		void **vals, size_t count)
+{
+	return btree_load(&head->h, &btree_geo64, (unsigned long *)keys, vals,
+			count);
+}
+
+static inline void *btree_cursor_first64(struct btree_cursor *c,
+		struct btree_head64 *head)
+{
+	return btree_cursor_first(c, &head->h, &btree_geo64);
+}
+
+static inline void *btree_cursor_last64(struct btree_cursor *c,
+		struct btree_head64 *head)
+{
+	return btree_cursor_last(c, &head->h, &btree_geo64);
+}
+
+static inline void *btree_cursor_seek64(struct btree_cursor *c,
+		struct btree_head64 *head, u64 key)
+{
+	return btree_cursor_seek(c, &head->h, &btree_geo64,
+			(unsigned long *)&key);
+}
+
+static inline u64 btree_cursor_key64(struct btree_cursor *c)
+{
+	u64 *key = (u64 *)btree_cursor_key(c);
+
+	return key ? *key : 0;
 }
 
 static inline u64 btree_last64(struct btree_head64 *head)
 {
 	u64 *key;
 
-	key = (u64 *)btree_last(&head->h, &btree_geo64);
+	key = (u64 *)btree_last_geo64(&head->h);
 	if (key)
 		return *key;
 	else
@@ -207,34 +528,130 @@ static inline size_t btree_grim_visitor64(struct btree_head64 *head, long opaque
 	return btree_grim_visitor(&head->h, &btree_geo64, opaque, visitor64, func2);
 }
 
+static inline size_t btree_visitor_parallel64(struct btree_head64 *head,
+		int threads, int flags, long *opaque, visitor64_t func2)
+{
+	return btree_visitor_parallel(&head->h, &btree_geo64, threads, flags,
+			opaque, visitor64, func2);
+}
+
+static inline size_t btree_grim_visitor_parallel64(struct btree_head64 *head,
+		int threads, int flags, long *opaque, visitor64_t func2)
+{
+	return btree_grim_visitor_parallel(&head->h, &btree_geo64, threads,
+			flags, opaque, visitor64, func2);
+}
+
 /* key is 128bit (two u64) */
 static inline void btree_init128(struct btree_head128 *head)
 {
 	btree_init(&head->h);
 }
 
+static inline void btree_init128_nodesize(struct btree_head128 *head, int nodesize)
+{
+	btree_init_nodesize(&head->h, nodesize);
+}
+
+static inline void btree_set_finger128(struct btree_head128 *head,
+		struct btree_finger *finger)
+{
+	btree_set_finger(&head->h, finger);
+}
+
+static inline void btree_set_pool128(struct btree_head128 *head,
+		struct btree_pool *pool)
+{
+	btree_set_pool(&head->h, pool);
+}
+
+static inline void btree_set_sync128(struct btree_head128 *head,
+		struct btree_sync *sync)
+{
+	btree_set_sync(&head->h, sync);
+}
+
+static inline void *btree_lookup_sync128(struct btree_head128 *head, u64 k1,
+		u64 k2)
+{
+	u64 key[2] = {k1, k2};
+	return btree_lookup_sync(&head->h, &btree_geo128, (unsigned long *)&key);
+}
+
+static inline int btree_insert_sync128(struct btree_head128 *head, u64 k1,
+		u64 k2, void *val)
+{
+	u64 key[2] = {k1, k2};
+	return btree_insert_sync(&head->h, &btree_geo128, (unsigned long *)&key,
+			val);
+}
+
+static inline void *btree_remove_sync128(struct btree_head128 *head, u64 k1,
+		u64 k2)
+{
+	u64 key[2] = {k1, k2};
+	return btree_remove_sync(&head->h, &btree_geo128, (unsigned long *)&key);
+}
+
 static inline void *btree_lookup128(struct btree_head128 *head, u64 k1, u64 k2)
 {
 	u64 key[2] = {k1, k2};
-	return btree_lookup(&head->h, &btree_geo128, (unsigned long *)&key);
+	return btree_lookup_geo128(&head->h, (unsigned long *)&key);
 }
 
 static inline int btree_insert128(struct btree_head128 *head, u64 k1, u64 k2,
 		void *val)
 {
 	u64 key[2] = {k1, k2};
-	return btree_insert(&head->h, &btree_geo128, (unsigned long *)&key, val);
+	return btree_insert_geo128(&head->h, (unsigned long *)&key, val);
 }
 
 static inline void *btree_remove128(struct btree_head128 *head, u64 k1, u64 k2)
 {
 	u64 key[2] = {k1, k2};
-	return btree_remove(&head->h, &btree_geo128, (unsigned long *)&key);
+	return btree_remove_geo128(&head->h, (unsigned long *)&key);
+}
+
+/* keys holds two u64 per entry */
+static inline int btree_load128(struct btree_head128 *head, u64 *keys,
+		void **vals, size_t count)
+{
+	return btree_load(&head->h, &btree_geo128, (unsigned long *)keys, vals,
+			count);
+}
+
+static inline void *btree_cursor_first128(struct btree_cursor *c,
+		struct btree_head128 *head)
+{
+	return btree_cursor_first(c, &head->h, &btree_geo128);
+}
+
+static inline void *btree_cursor_last128(struct btree_cursor *c,
+		struct btree_head128 *head)
+{
+	return btree_cursor_last(c, &head->h, &btree_geo128);
+}
+
+static inline void *btree_cursor_seek128(struct btree_cursor *c,
+		struct btree_head128 *head, u64 k1, u64 k2)
+{
+	u64 key[2] = {k1, k2};
+	return btree_cursor_seek(c, &head->h, &btree_geo128,
+			(unsigned long *)&key);
+}
+
+static inline void btree_cursor_key128(struct btree_cursor *c, u64 *k1,
+		u64 *k2)
+{
+	u64 *key = (u64 *)btree_cursor_key(c);
+
+	*k1 = key ? key[0] : 0;
+	*k2 = key ? key[1] : 0;
 }
 
 static inline void btree_last128(struct btree_head128 *head, u64 *k1, u64 *k2)
 {
-	u64 *key = (u64 *)btree_last(&head->h, &btree_geo128);
+	u64 *key = (u64 *)btree_last_geo128(&head->h);
 
 	if (key) {
 		*k1 = key[0];
@@ -272,4 +689,18 @@ static inline size_t btree_grim_visitor128(struct btree_head128 *head, long opaq
 	return btree_grim_visitor(&head->h, &btree_geo128, opaque, visitor128, func2);
 }
 
+static inline size_t btree_visitor_parallel128(struct btree_head128 *head,
+		int threads, int flags, long *opaque, visitor128_t func2)
+{
+	return btree_visitor_parallel(&head->h, &btree_geo128, threads, flags,
+			opaque, visitor128, func2);
+}
+
+static inline size_t btree_grim_visitor_parallel128(struct btree_head128 *head,
+		int threads, int flags, long *opaque, visitor128_t func2)
+{
+	return btree_grim_visitor_parallel(&head->h, &btree_geo128, threads,
+			flags, opaque, visitor128, func2);
+}
+
 #endif
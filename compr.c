@@ -0,0 +1,318 @@
+/*
+ * compr.c
+ *
+ * Copyright (c) 2007-2008 Joern Engel <joern@logfs.org>
+ *
+ * License: GPL version 2
+ */
+#include <asm/types.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "kerncompat.h"
+#include "logfs_abi.h"
+#include "logfs.h"
+
+/*
+ * Compression contexts are set up once per thread and reset for every call.
+ * deflateInit() alone costs more than compressing a small journal entry.
+ */
+static __thread struct z_stream_s *deflate_stream;
+static __thread struct z_stream_s *inflate_stream;
+
+static int zlib_compress(void *in, void *out, size_t inlen, size_t outlen)
+{
+	struct z_stream_s *stream = deflate_stream;
+	int err;
+
+	if (!stream) {
+		stream = zalloc(sizeof(*stream));
+		if (!stream)
+			return -ENOMEM;
+		err = deflateInit(stream, 3);
+		if (err != Z_OK) {
+			free(stream);
+			return -EIO;
+		}
+		deflate_stream = stream;
+	} else {
+		err = deflateReset(stream);
+		if (err != Z_OK)
+			return -EIO;
+	}
+
+	stream->next_in = in;
+	stream->avail_in = inlen;
+	stream->next_out = out;
+	stream->avail_out = outlen;
+
+	err = deflate(stream, Z_FINISH);
+	if (err != Z_STREAM_END)
+		return -EIO;
+
+	if (stream->total_out >= stream->total_in)
+		return -EIO;
+	return stream->total_out;
+}
+
+static int zlib_uncompress(void *in, void *out, size_t inlen, size_t outlen)
+{
+	struct z_stream_s *stream = inflate_stream;
+	int err;
+
+	if (!stream) {
+		stream = zalloc(sizeof(*stream));
+		if (!stream)
+			return -ENOMEM;
+		err = inflateInit(stream);
+		if (err != Z_OK) {
+			free(stream);
+			return -EIO;
+		}
+		inflate_stream = stream;
+	} else {
+		err = inflateReset(stream);
+		if (err != Z_OK)
+			return -EIO;
+	}
+
+	stream->next_in = in;
+	stream->avail_in = inlen;
+	stream->next_out = out;
+	stream->avail_out = outlen;
+
+	err = inflate(stream, Z_FINISH);
+	if (err != Z_STREAM_END)
+		return -EIO;
+	return stream->total_out;
+}
+
+/*
+ * LZ4 block format: a sequence starts with a token, literal length in the
+ * high nibble and match length - 4 in the low one.  A nibble of 15 is
+ * continued by bytes that get added until one is below 255.  Then follow
+ * the literals, a 16bit little-endian match offset and the extra match
+ * length bytes.  The last sequence has literals only.  The last 5 bytes are
+ * always literals and no match starts within the last 12 bytes, as with the
+ * reference implementation, so either side can decode the other's output.
+ *
+ * The hash table stores positions relative to a base that advances with
+ * every call, so stale entries from previous inputs are recognized without
+ * clearing the table.
+ */
+#define LZ4_HASH_BITS		12
+#define LZ4_MIN_MATCH		4
+#define LZ4_LAST_LITERALS	5
+#define LZ4_MFLIMIT		12
+#define LZ4_MAX_DISTANCE	0xffff
+#define LZ4_SKIP_SHIFT		6
+
+struct lz4_ctx {
+	u32 base;
+	u32 table[1 << LZ4_HASH_BITS];
+};
+
+static __thread struct lz4_ctx *lz4_ctx;
+
+static inline u32 lz4_read32(const u8 *p)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline u32 lz4_hash(u32 v)
+{
+	return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/* Extra length bytes for a nibble of 15 */
+static u8 *lz4_put_len(u8 *op, size_t len)
+{
+	for (len -= 15; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/* Emits one sequence, returns NULL if it might not fit */
+static u8 *lz4_sequence(u8 *op, u8 *oend, const u8 *lit, size_t litlen,
+		size_t offset, size_t mlen)
+{
+	u8 *token = op++;
+
+	if (litlen + litlen / 255 + mlen / 255 + 5 > oend - token)
+		return NULL;
+
+	if (litlen >= 15) {
+		*token = 15 << 4;
+		op = lz4_put_len(op, litlen);
+	} else
+		*token = litlen << 4;
+	memcpy(op, lit, litlen);
+	op += litlen;
+	if (!mlen)
+		return op;
+
+	*op++ = offset;
+	*op++ = offset >> 8;
+	mlen -= LZ4_MIN_MATCH;
+	if (mlen >= 15) {
+		*token |= 15;
+		op = lz4_put_len(op, mlen);
+	} else
+		*token |= mlen;
+	return op;
+}
+
+static int lz4_compress(void *in, void *out, size_t inlen, size_t outlen)
+{
+	struct lz4_ctx *ctx = lz4_ctx;
+	const u8 *istart = in, *ip = in, *anchor = in, *iend = ip + inlen;
+	const u8 *mflimit = iend - LZ4_MFLIMIT;
+	const u8 *mlimit = iend - LZ4_LAST_LITERALS;
+	const u8 *match;
+	u8 *op = out, *oend = op + outlen;
+	u32 seq, h, cur, ref, base;
+	size_t mlen;
+
+	if (!ctx) {
+		ctx = zalloc(sizeof(*ctx));
+		if (!ctx)
+			return -ENOMEM;
+		lz4_ctx = ctx;
+	}
+	if (inlen > 0x7fffffff)
+		return -EIO;
+	if (ctx->base > 0xffffffffu - inlen - 1) {
+		memset(ctx->table, 0, sizeof(ctx->table));
+		ctx->base = 0;
+	}
+	base = ctx->base;
+	ctx->base += inlen + 1;
+
+	if (inlen <= LZ4_MFLIMIT)
+		goto last;
+
+	while (ip < mflimit) {
+		seq = lz4_read32(ip);
+		h = lz4_hash(seq);
+		cur = base + (ip - istart);
+		ref = ctx->table[h];
+		ctx->table[h] = cur;
+		if (ref < base || ref >= cur || cur - ref > LZ4_MAX_DISTANCE ||
+				lz4_read32(istart + (ref - base)) != seq) {
+			/* step faster through incompressible data */
+			ip += 1 + ((ip - anchor) >> LZ4_SKIP_SHIFT);
+			continue;
+		}
+		match = istart + (ref - base);
+		while (ip > anchor && match > istart && ip[-1] == match[-1]) {
+			ip--;
+			match--;
+		}
+		mlen = LZ4_MIN_MATCH;
+		while (ip + mlen < mlimit && ip[mlen] == match[mlen])
+			mlen++;
+
+		op = lz4_sequence(op, oend, anchor, ip - anchor, ip - match,
+				mlen);
+		if (!op)
+			return -EIO;
+		ip += mlen;
+		anchor = ip;
+	}
+last:
+	op = lz4_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op || op - (u8 *)out >= inlen)
+		return -EIO;
+	return op - (u8 *)out;
+}
+
+static int lz4_uncompress(void *in, void *out, size_t inlen, size_t outlen)
+{
+	const u8 *ip = in, *iend = ip + inlen, *match;
+	u8 *op = out, *oend = op + outlen;
+	size_t len, offset;
+	u8 token, c;
+
+	while (ip < iend) {
+		token = *ip++;
+		len = token >> 4;
+		if (len == 15) {
+			do {
+				if (ip >= iend)
+					return -EIO;
+				c = *ip++;
+				len += c;
+			} while (c == 255);
+		}
+		if (len > iend - ip || len > oend - op)
+			return -EIO;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -EIO;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > op - (u8 *)out)
+			return -EIO;
+		len = token & 15;
+		if (len == 15) {
+			do {
+				if (ip >= iend)
+					return -EIO;
+				c = *ip++;
+				len += c;
+			} while (c == 255);
+		}
+		len += LZ4_MIN_MATCH;
+		if (len > oend - op)
+			return -EIO;
+		/* may overlap the output it copies */
+		for (match = op - offset; len; len--)
+			*op++ = *match++;
+	}
+	return op - (u8 *)out;
+}
+
+/*
+ * Returns the compressed length or a negative error, including when the
+ * output would not be smaller than the input.
+ */
+int logfs_compress(void *in, void *out, size_t inlen, size_t outlen,
+		u8 compr)
+{
+	switch (compr) {
+	case COMPR_ZLIB:
+		return zlib_compress(in, out, inlen, outlen);
+	case COMPR_LZ4:
+		return lz4_compress(in, out, inlen, outlen);
+	default:
+		return -EINVAL;
+	}
+}
+
+/* Returns the uncompressed length or a negative error */
+int logfs_uncompress(void *in, void *out, size_t inlen, size_t outlen,
+		u8 compr)
+{
+	switch (compr) {
+	case COMPR_NONE:
+		if (inlen > outlen)
+			return -EIO;
+		memcpy(out, in, inlen);
+		return inlen;
+	case COMPR_ZLIB:
+		return zlib_uncompress(in, out, inlen, outlen);
+	case COMPR_LZ4:
+		return lz4_uncompress(in, out, inlen, outlen);
+	default:
+		return -EINVAL;
+	}
+}
@@ -1,5 +1,5 @@
 /*
- * LogFS mkfs
+ * LogFS fsck
  *
  * Copyright (c) 2007-2008 Joern Engel <joern@logfs.org>
  *
@@ -12,8 +12,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <linux/fs.h>
 #include <linux/types.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,26 +30,89 @@
 #include <mtd/mtd-abi.h>
 #include "logfs_abi.h"
 #include "logfs.h"
+#include "fsck.h"
 
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Problems with the filesystem, each one makes fsck fail */
+void fsck_error(struct fsck *fs, const char *fmt, ...)
+{
+	va_list args;
+
+	pthread_mutex_lock(&report_lock);
+	fs->errors++;
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	pthread_mutex_unlock(&report_lock);
+}
+
+/* Details only shown with --verbose */
+void fsck_info(struct fsck *fs, const char *fmt, ...)
+{
+	va_list args;
+
+	if (!fs->verbose)
+		return;
+	pthread_mutex_lock(&report_lock);
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	pthread_mutex_unlock(&report_lock);
+}
+
+static void print_summary(struct fsck *fs)
+{
+	struct logfs_je_anchor *da = &fs->anchor;
+	struct logfs_je_dynsb *dynsb = &fs->dynsb;
+
+	printf("%u segments of %u bytes, %u byte blocks, %u byte writes\n",
+			fs->no_segs, fs->segsize, fs->blocksize, fs->writesize);
+	printf("journal in segment %u, %u segment(s) long\n",
+			fs->journal_segno, fs->no_journal_chain);
+	printf("inode file: %llu bytes, height %u, last inode %llu\n",
+			(u64)be64_to_cpu(da->da_size), da->da_height,
+			(u64)be64_to_cpu(da->da_last_ino));
+	printf("used bytes: %llu, gec %llu\n",
+			(u64)be64_to_cpu(dynsb->ds_used_bytes),
+			(u64)be64_to_cpu(dynsb->ds_gec));
+	printf("%zu aliases, %d open areas, %zu cached free segments\n",
+			fs->no_alias, fs->no_area, fs->no_free_seg);
+}
 
 static void usage(void)
 {
 	printf(
 "logfsck <options> <device>\n"
 "\n"
+"Checks a LogFS image without modifying it.\n"
+"\n"
 "Options:\n"
 "  -h --help            display this help\n"
+"  -j --threads         number of threads for the scan and walk\n"
+"                       (default: number of cpus)\n"
+"  -m --index-memory    memory for the object index in MiB, larger\n"
+"                       indices go to a temporary file (default: 256)\n"
+"  -v --verbose         report details of the checks\n"
 "\n");
 }
 
 int main(int argc, char **argv)
 {
+	struct fsck _fs, *fs = &_fs;
+	int err, threads = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t index_mem = 256;
+
+	memset(fs, 0, sizeof(*fs));
 	check_crc32();
 	for (;;) {
 		int oi = 1;
-		char short_opts[] = "h";
+		char short_opts[] = "hj:m:v";
 		static const struct option long_opts[] = {
 			{"help",		0, NULL, 'h'},
+			{"threads",		1, NULL, 'j'},
+			{"index-memory",	1, NULL, 'm'},
+			{"verbose",		0, NULL, 'v'},
 			{ }
 		};
 		int c = getopt_long(argc, argv, short_opts, long_opts, &oi);
@@ -57,17 +122,67 @@ int main(int argc, char **argv)
 		case 'h':
 			usage();
 			exit(EXIT_SUCCESS);
+		case 'j':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			index_mem = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			fs->verbose = 1;
+			break;
 		default:
-			fail("unknown option\n");
+			usage();
+			exit(FSCK_USAGE);
 		}
 	}
 
 	if (optind != argc - 1) {
 		usage();
-		exit(EXIT_FAILURE);
+		exit(FSCK_USAGE);
 	}
+	if (threads < 1)
+		threads = 1;
+	if (index_mem < 1)
+		index_mem = 1;
 
-	printf("foo\n");
+	err = fsck_open(fs, argv[optind]);
+	if (err) {
+		printf("logfsck: cannot open %s: %s\n", argv[optind],
+				strerror(-err));
+		exit(FSCK_ERROR);
+	}
+	err = fsck_read_super(fs);
+	if (err)
+		exit(FSCK_ERROR);
+	err = fsck_read_journal(fs);
+	if (err)
+		exit(FSCK_ERROR);
 
-	return 0;
+	print_summary(fs);
+	fs->index = index_alloc(index_mem << 20, threads);
+	if (!fs->index) {
+		printf("logfsck: %s\n", strerror(ENOMEM));
+		exit(FSCK_ERROR);
+	}
+	err = fsck_scan(fs, threads);
+	if (!err)
+		err = index_finish(fs->index);
+	if (err) {
+		printf("logfsck: %s\n", strerror(-err));
+		exit(FSCK_ERROR);
+	}
+	index_stats(fs->index);
+	err = fsck_walk(fs, threads);
+	if (!err)
+		err = fsck_check_space(fs);
+	if (err) {
+		printf("logfsck: %s\n", strerror(-err));
+		exit(FSCK_ERROR);
+	}
+	if (fs->errors) {
+		printf("%llu error(s)\n", fs->errors);
+		exit(FSCK_UNCORRECTED);
+	}
+	return FSCK_OK;
 }
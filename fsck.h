@@ -0,0 +1,172 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include "kerncompat.h"
+#include "logfs_abi.h"
+#include "logfs.h"
+
+/*
+ * fsck exit codes, as with e2fsck
+ */
+enum {
+	FSCK_OK		= 0,
+	FSCK_UNCORRECTED = 4,
+	FSCK_ERROR	= 8,
+	FSCK_USAGE	= 16,
+};
+
+/*
+ * Segment types found by the scan, in addition to SEG_SUPER, SEG_JOURNAL
+ * and SEG_OSTORE
+ */
+enum {
+	SEG_FREE	= 0x00,
+	SEG_UNKNOWN	= 0x04,
+};
+
+/**
+ * struct seg_info - scan result for one segment
+ *
+ * @type:			segment type
+ * @level:			GC level from the segment header
+ * @objects:			number of objects
+ * @used_bytes:			end of the last object
+ * @bad_ofs:			offset of the first problem within the segment
+ * @why:			description of the first problem, NULL if none
+ */
+struct seg_info {
+	u8 type;
+	u8 level;
+	u32 objects;
+	u32 used_bytes;
+	u32 bad_ofs;
+	const char *why;
+};
+
+/**
+ * struct obj_entry - object index entry
+ *
+ * @ino:			inode number
+ * @bix:			block index
+ * @ofs:			device offset of the object header
+ * @len:			object length, including the header
+ * @level:			tree level
+ */
+struct obj_entry {
+	u64 ino;
+	u64 bix;
+	u64 ofs;
+	u32 len;
+	u8 level;
+};
+
+struct obj_index;
+struct index_writer;
+struct space_count;
+
+/* Totals of the tree walk */
+struct walk_stats {
+	u64 inodes;
+	u64 indirect;
+	u64 data;
+	u64 reads;
+	u64 bytes_read;
+};
+
+/* Bytes dev_read() lays over the device, see dev_patch() */
+struct dev_patch {
+	u64 ofs;
+	u32 len;
+	void *data;
+};
+
+/*
+ * Read-only view of a LogFS image.  Regular files and block devices are
+ * mapped as a whole, so only the pages actually looked at get read.  MTD
+ * character devices cannot be mapped and are read with pread() instead.
+ */
+struct fsck {
+	int fd;
+	void *map;			/* NULL for MTD */
+	u64 devsize;
+	u32 erasesize;			/* MTD only */
+	int verbose;
+	u64 errors;
+
+	/* superblock */
+	struct logfs_disk_super ds;
+	u64 sb_ofs[2];
+	u32 segsize;
+	u32 blocksize;
+	u32 writesize;
+	u32 no_segs;
+	u32 journal_seg[LOGFS_JOURNAL_SEGS];
+	int no_journal_segs;
+
+	/* newest journal commit */
+	u32 journal_segno;
+	u32 no_journal_chain;		/* segments incl. spillouts */
+	int have_anchor, have_dynsb;
+	struct logfs_je_anchor anchor;
+	struct logfs_je_dynsb dynsb;
+	struct logfs_obj_alias *alias;
+	size_t no_alias;
+	struct logfs_je_area area[LOGFS_NO_AREAS];
+	int no_area;
+	struct dev_patch patch[LOGFS_NO_AREAS];
+	int no_patch;
+	struct logfs_je_free_segments *free_seg;
+	size_t no_free_seg;
+
+	/* segment scan */
+	struct seg_info *seg;
+	struct obj_index *index;
+
+	/* tree walk */
+	struct walk_stats walk;
+	struct space_count *space;	/* merged from all walk workers */
+};
+
+void fsck_error(struct fsck *fs, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+void fsck_info(struct fsck *fs, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+/* super.c */
+int fsck_open(struct fsck *fs, const char *name);
+void *dev_read(struct fsck *fs, u64 ofs, size_t len, void *buf);
+int dev_patch(struct fsck *fs, u64 ofs, const void *data, u32 len);
+void dev_release(struct fsck *fs, u64 ofs, size_t len);
+int fsck_read_super(struct fsck *fs);
+
+/* journal.c */
+int fsck_read_journal(struct fsck *fs);
+
+/* scan.c */
+int fsck_scan(struct fsck *fs, int threads);
+
+/* index.c */
+struct obj_index *index_alloc(size_t budget, int threads);
+struct index_writer *index_writer_alloc(struct obj_index *idx);
+int index_add(struct index_writer *w, u64 ino, u64 bix, u8 level, u64 ofs,
+		u32 len, u64 gec);
+int index_writer_free(struct index_writer *w);
+int index_finish(struct obj_index *idx);
+const struct obj_entry *index_lookup(struct obj_index *idx, u64 ino,
+		u64 bix, u8 level);
+size_t index_count(struct obj_index *idx);
+void index_stats(struct obj_index *idx);
+void index_free(struct obj_index *idx);
+
+/* walk.c */
+int fsck_walk(struct fsck *fs, int threads);
+
+/* space.c */
+struct space_count *space_alloc(struct fsck *fs);
+void space_free(struct space_count *sc);
+int space_add(struct space_count *sc, u64 ino, u64 ofs, u32 len);
+int space_inode(struct space_count *sc, u64 ino, u64 used_bytes);
+int space_merge(struct space_count *dst, struct space_count *src);
+int fsck_check_space(struct fsck *fs);
+
+#endif
@@ -0,0 +1,472 @@
+/*
+ * index.c
+ *
+ * Copyright (c) 2007-2008 Joern Engel <joern@logfs.org>
+ *
+ * License: GPL version 2
+ */
+#define _LARGEFILE64_SOURCE
+#define __USE_FILE_OFFSET64
+#include <asm/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "kerncompat.h"
+#include "logfs_abi.h"
+#include "logfs.h"
+#include "fsck.h"
+
+/*
+ * Object index, mapping (ino, bix, level) to the newest object on the
+ * medium.
+ *
+ * Each scan thread collects objects in a buffer of its own.  A full buffer
+ * is sorted, stripped of duplicates and becomes a run.  Runs stay in
+ * memory as long as they take up less than half of the memory budget,
+ * later ones get appended to an unlinked temporary file.  Once the scan is
+ * done, all runs are merged into a single sorted array, which again goes
+ * to a temporary file if it exceeds the budget.  Either way lookups are a
+ * binary search over every INDEX_SAMPLE'th key, which stays in cache,
+ * followed by one over a single INDEX_SAMPLE entry block.
+ *
+ * Of several objects with the same key, the one in the segment with the
+ * highest gec wins, then the one at the higher offset.
+ */
+#define INDEX_SAMPLE	256
+#define INDEX_MIN_RUN	1024
+
+struct run_entry {
+	u64 ino;
+	u64 bix;
+	u64 ofs;
+	u64 gec;
+	u32 len;
+	u8 level;
+};
+
+struct run {
+	struct run_entry *mem;		/* NULL if spilled */
+	u64 file_ofs;
+	size_t count;
+};
+
+struct obj_index {
+	pthread_mutex_t lock;
+	size_t budget;
+	size_t run_len;			/* entries per writer buffer */
+	size_t mem_used;		/* bytes in in-memory runs */
+	struct run *run;
+	size_t no_runs;
+	int spill_fd;
+	u64 spill_size;
+
+	struct obj_entry *entry;
+	size_t count;
+	size_t map_len;			/* entry is mapped if non-zero */
+	struct obj_entry *sample;
+	size_t no_sample;
+	u64 superseded;
+	u64 runs;
+	u64 spilled_runs;
+};
+
+struct index_writer {
+	struct obj_index *idx;
+	struct run_entry *buf;
+	size_t n;
+};
+
+static inline int key_cmp(u64 ino1, u64 bix1, u8 level1,
+		u64 ino2, u64 bix2, u8 level2)
+{
+	if (ino1 != ino2)
+		return ino1 < ino2 ? -1 : 1;
+	if (bix1 != bix2)
+		return bix1 < bix2 ? -1 : 1;
+	if (level1 != level2)
+		return level1 < level2 ? -1 : 1;
+	return 0;
+}
+
+/* Sorts by key, newest first among equal keys */
+static int run_cmp(const void *_a, const void *_b)
+{
+	const struct run_entry *a = _a, *b = _b;
+	int cmp;
+
+	cmp = key_cmp(a->ino, a->bix, a->level, b->ino, b->bix, b->level);
+	if (cmp)
+		return cmp;
+	if (a->gec != b->gec)
+		return a->gec > b->gec ? -1 : 1;
+	if (a->ofs != b->ofs)
+		return a->ofs > b->ofs ? -1 : 1;
+	return 0;
+}
+
+static int same_key(const struct run_entry *a, const struct run_entry *b)
+{
+	return a->ino == b->ino && a->bix == b->bix && a->level == b->level;
+}
+
+static int safe_pwrite_all(int fd, const void *buf, size_t size, u64 ofs)
+{
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = pwrite(fd, buf, size, ofs);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += ret;
+		ofs += ret;
+		size -= ret;
+	}
+	return 0;
+}
+
+static int spill_open(struct obj_index *idx)
+{
+	FILE *f;
+
+	if (idx->spill_fd >= 0)
+		return 0;
+	f = tmpfile();
+	if (!f)
+		return -errno;
+	idx->spill_fd = dup(fileno(f));
+	fclose(f);
+	return idx->spill_fd < 0 ? -errno : 0;
+}
+
+struct obj_index *index_alloc(size_t budget, int threads)
+{
+	struct obj_index *idx = zalloc(sizeof(*idx));
+
+	if (!idx)
+		return NULL;
+	pthread_mutex_init(&idx->lock, NULL);
+	idx->budget = budget;
+	idx->run_len = max(budget / 4 / threads / sizeof(struct run_entry),
+			(size_t)INDEX_MIN_RUN);
+	idx->spill_fd = -1;
+	return idx;
+}
+
+struct index_writer *index_writer_alloc(struct obj_index *idx)
+{
+	struct index_writer *w = zalloc(sizeof(*w));
+
+	if (!w)
+		return NULL;
+	w->idx = idx;
+	w->buf = malloc(idx->run_len * sizeof(*w->buf));
+	if (!w->buf) {
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+static int flush_run(struct index_writer *w)
+{
+	struct obj_index *idx = w->idx;
+	struct run_entry *buf = w->buf;
+	struct run *run;
+	size_t i, n, bytes;
+	u64 file_ofs;
+	int err = 0;
+
+	if (!w->n)
+		return 0;
+	qsort(buf, w->n, sizeof(*buf), run_cmp);
+	for (i = 1, n = 1; i < w->n; i++)
+		if (!same_key(buf + i, buf + n - 1))
+			buf[n++] = buf[i];
+	bytes = n * sizeof(*buf);
+
+	pthread_mutex_lock(&idx->lock);
+	idx->superseded += w->n - n;
+	w->n = 0;
+	run = realloc(idx->run, (idx->no_runs + 1) * sizeof(*run));
+	if (!run) {
+		err = -ENOMEM;
+		goto out;
+	}
+	idx->run = run;
+	run += idx->no_runs;
+	run->count = n;
+	run->mem = NULL;
+	if (idx->mem_used + bytes <= idx->budget / 2)
+		run->mem = malloc(bytes);
+	if (run->mem) {
+		memcpy(run->mem, buf, bytes);
+		idx->mem_used += bytes;
+		idx->no_runs++;
+		idx->runs++;
+		goto out;
+	}
+
+	err = spill_open(idx);
+	if (err)
+		goto out;
+	file_ofs = run->file_ofs = idx->spill_size;
+	idx->spill_size += bytes;
+	idx->no_runs++;
+	idx->runs++;
+	idx->spilled_runs++;
+	pthread_mutex_unlock(&idx->lock);
+	/* the file range is ours, the write needs no lock */
+	return safe_pwrite_all(idx->spill_fd, buf, bytes, file_ofs);
+out:
+	pthread_mutex_unlock(&idx->lock);
+	return err;
+}
+
+int index_add(struct index_writer *w, u64 ino, u64 bix, u8 level, u64 ofs,
+		u32 len, u64 gec)
+{
+	struct run_entry *e = w->buf + w->n++;
+
+	e->ino = ino;
+	e->bix = bix;
+	e->ofs = ofs;
+	e->gec = gec;
+	e->len = len;
+	e->level = level;
+	if (w->n == w->idx->run_len)
+		return flush_run(w);
+	return 0;
+}
+
+/* Flushes the last run and frees the writer */
+int index_writer_free(struct index_writer *w)
+{
+	int err;
+
+	if (!w)
+		return 0;
+	err = flush_run(w);
+	free(w->buf);
+	free(w);
+	return err;
+}
+
+/*
+ * k-way merge of all runs.  The heap holds the index of each run that
+ * still has entries, ordered by its current entry.
+ */
+struct cursor {
+	struct run_entry *pos, *end;
+};
+
+static void heap_down(struct cursor *c, size_t *heap, size_t n, size_t i)
+{
+	size_t child, tmp;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= n)
+			break;
+		if (child + 1 < n && run_cmp(c[heap[child + 1]].pos,
+					c[heap[child]].pos) < 0)
+			child++;
+		if (run_cmp(c[heap[i]].pos, c[heap[child]].pos) <= 0)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/* Room for @count entries, in a file of its own beyond the budget */
+static int alloc_result(struct obj_index *idx, size_t count)
+{
+	size_t len = max(count, (size_t)1) * sizeof(*idx->entry);
+	void *map;
+	FILE *f;
+	int err = 0;
+
+	if (len <= idx->budget) {
+		idx->entry = malloc(len);
+		return idx->entry ? 0 : -ENOMEM;
+	}
+
+	f = tmpfile();
+	if (!f)
+		return -errno;
+	if (ftruncate(fileno(f), len))
+		err = -errno;
+	if (!err) {
+		map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fileno(f), 0);
+		if (map == MAP_FAILED) {
+			err = -errno;
+		} else {
+			idx->entry = map;
+			idx->map_len = len;
+		}
+	}
+	/* the mapping keeps the unlinked file alive */
+	fclose(f);
+	return err;
+}
+
+int index_finish(struct obj_index *idx)
+{
+	struct run_entry *spill = NULL, *last = NULL;
+	struct cursor *c;
+	struct obj_entry *e;
+	size_t *heap, i, n = 0, total = 0;
+	int err = -ENOMEM;
+
+	for (i = 0; i < idx->no_runs; i++)
+		total += idx->run[i].count;
+	c = calloc(idx->no_runs + 1, sizeof(*c));
+	heap = calloc(idx->no_runs + 1, sizeof(*heap));
+	if (!c || !heap)
+		goto out;
+	if (idx->spill_size) {
+		spill = mmap(NULL, idx->spill_size, PROT_READ, MAP_SHARED,
+				idx->spill_fd, 0);
+		if (spill == MAP_FAILED) {
+			spill = NULL;
+			err = -errno;
+			goto out;
+		}
+		madvise(spill, idx->spill_size, MADV_SEQUENTIAL);
+	}
+	err = alloc_result(idx, total);
+	if (err)
+		goto out;
+
+	for (i = 0; i < idx->no_runs; i++) {
+		struct run *run = idx->run + i;
+
+		c[i].pos = run->mem ? run->mem :
+			spill + run->file_ofs / sizeof(*spill);
+		c[i].end = c[i].pos + run->count;
+		if (run->count)
+			heap[n++] = i;
+	}
+	for (i = n / 2; i-- > 0; )
+		heap_down(c, heap, n, i);
+
+	e = idx->entry;
+	while (n) {
+		struct cursor *top = c + heap[0];
+
+		if (last && same_key(top->pos, last)) {
+			idx->superseded++;
+		} else {
+			e->ino = top->pos->ino;
+			e->bix = top->pos->bix;
+			e->ofs = top->pos->ofs;
+			e->len = top->pos->len;
+			e->level = top->pos->level;
+			e++;
+		}
+		last = top->pos++;
+		if (top->pos == top->end)
+			heap[0] = heap[--n];
+		heap_down(c, heap, n, 0);
+	}
+	idx->count = e - idx->entry;
+
+	idx->no_sample = (idx->count + INDEX_SAMPLE - 1) / INDEX_SAMPLE;
+	idx->sample = malloc(max(idx->no_sample, (size_t)1) *
+			sizeof(*idx->sample));
+	if (!idx->sample) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < idx->no_sample; i++)
+		idx->sample[i] = idx->entry[i * INDEX_SAMPLE];
+	err = 0;
+out:
+	/* runs are no longer needed, the merged index replaces them */
+	if (spill)
+		munmap(spill, idx->spill_size);
+	if (idx->spill_fd >= 0)
+		close(idx->spill_fd);
+	idx->spill_fd = -1;
+	for (i = 0; i < idx->no_runs; i++)
+		free(idx->run[i].mem);
+	free(idx->run);
+	idx->run = NULL;
+	idx->no_runs = 0;
+	free(heap);
+	free(c);
+	return err;
+}
+
+static inline int entry_cmp(const struct obj_entry *e, u64 ino, u64 bix,
+		u8 level)
+{
+	return key_cmp(e->ino, e->bix, e->level, ino, bix, level);
+}
+
+/* Returns the entry for (ino, bix, level) or NULL */
+const struct obj_entry *index_lookup(struct obj_index *idx, u64 ino,
+		u64 bix, u8 level)
+{
+	size_t lo = 0, hi = idx->no_sample, mid;
+	const struct obj_entry *e;
+
+	/* last sample not greater than the key */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (entry_cmp(idx->sample + mid, ino, bix, level) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+	e = idx->entry + (lo - 1) * INDEX_SAMPLE;
+	lo = 0;
+	hi = min((size_t)INDEX_SAMPLE, idx->count - (e - idx->entry));
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (entry_cmp(e + mid, ino, bix, level) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < min((size_t)INDEX_SAMPLE, idx->count - (e - idx->entry)) &&
+			!entry_cmp(e + lo, ino, bix, level))
+		return e + lo;
+	return NULL;
+}
+
+size_t index_count(struct obj_index *idx)
+{
+	return idx->count;
+}
+
+void index_stats(struct obj_index *idx)
+{
+	printf("index: %zu objects, %llu superseded, %zu KiB%s, %llu of %llu "
+			"runs spilled\n", idx->count, idx->superseded,
+			idx->count * sizeof(*idx->entry) >> 10,
+			idx->map_len ? " in a temporary file" : "",
+			idx->spilled_runs, idx->runs);
+}
+
+void index_free(struct obj_index *idx)
+{
+	if (!idx)
+		return;
+	if (idx->map_len)
+		munmap(idx->entry, idx->map_len);
+	else
+		free(idx->entry);
+	free(idx->sample);
+	pthread_mutex_destroy(&idx->lock);
+	free(idx);
+}
@@ -0,0 +1,403 @@
+/*
+ * journal.c
+ *
+ * Copyright (c) 2007-2008 Joern Engel <joern@logfs.org>
+ *
+ * License: GPL version 2
+ */
+#include <asm/types.h>
+#include <errno.h>
+
+#include "kerncompat.h"
+#include "logfs_abi.h"
+#include "logfs.h"
+#include "fsck.h"
+
+#define JE_START	ALIGN(sizeof(struct logfs_segment_header), 16)
+
+/*
+ * A journal segment with all journal entries that pass their crc check,
+ * found by walking from the start until the first one that does not.
+ */
+struct jseg {
+	u32 segno;
+	void *buf;
+	u32 *je;			/* offsets within the segment */
+	u32 no_je;
+};
+
+static int read_jseg(struct fsck *fs, struct jseg *js, u32 segno)
+{
+	struct logfs_segment_header *sh;
+	struct logfs_journal_header *jh;
+	u32 pos, len;
+
+	js->segno = segno;
+	js->no_je = 0;
+	sh = dev_read(fs, (u64)segno * fs->segsize, fs->segsize, js->buf);
+	if (!sh)
+		return -EIO;
+	js->buf = sh;
+	if (sh->crc != logfs_crc32(sh, LOGFS_SEGMENT_HEADERSIZE, 4) ||
+			sh->type != SEG_JOURNAL ||
+			be32_to_cpu(sh->segno) != segno)
+		return -EINVAL;
+
+	for (pos = JE_START; pos + sizeof(*jh) <= fs->segsize; ) {
+		jh = js->buf + pos;
+		len = be16_to_cpu(jh->h_len);
+		if (len > fs->segsize - pos - sizeof(*jh))
+			break;
+		if (jh->h_crc != logfs_crc32(jh, len + sizeof(*jh), 4))
+			break;
+		js->je[js->no_je++] = pos;
+		pos += sizeof(*jh) + ALIGN(len, 16);
+	}
+	return 0;
+}
+
+static int find_je(struct jseg *js, u32 pos)
+{
+	u32 lo = 0, hi = js->no_je, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (js->je[mid] < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < js->no_je && js->je[lo] == pos;
+}
+
+static u16 je_type(struct jseg *js, u32 pos)
+{
+	struct logfs_journal_header *jh = js->buf + pos;
+
+	return be16_to_cpu(jh->h_type);
+}
+
+/* Uncompressed payload of the entry at @pos, returns its length */
+static int read_je(struct fsck *fs, struct jseg *js, u32 pos, void *buf)
+{
+	struct logfs_journal_header *jh = js->buf + pos;
+	u16 len = be16_to_cpu(jh->h_len);
+	u16 datalen = be16_to_cpu(jh->h_datalen);
+	int ret;
+
+	if (jh->h_compr == COMPR_LZ4 && !(be64_to_cpu(
+				fs->ds.ds_feature_incompat) & LOGFS_FEATURE_LZ4))
+		return -EINVAL;
+	if (datalen > fs->blocksize)
+		return -EINVAL;
+	ret = logfs_uncompress(jh + 1, buf, len, fs->blocksize, jh->h_compr);
+	if (ret != datalen)
+		return -EIO;
+	return ret;
+}
+
+/*
+ * A commit is valid if every offset it lists points to a valid entry in
+ * the same segment.  Returns the number of offsets, or -1.
+ */
+static int check_commit(struct fsck *fs, struct jseg *js, u32 pos,
+		__be64 *ofs)
+{
+	u64 base = (u64)js->segno * fs->segsize;
+	int i, n;
+
+	n = read_je(fs, js, pos, ofs);
+	if (n < 0 || n % sizeof(*ofs))
+		return -1;
+	n /= sizeof(*ofs);
+	for (i = 0; i < n; i++) {
+		if (be64_to_cpu(ofs[i]) < base ||
+				be64_to_cpu(ofs[i]) >= base + fs->segsize ||
+				!find_je(js, be64_to_cpu(ofs[i]) - base) ||
+				je_type(js, be64_to_cpu(ofs[i]) - base) ==
+				JE_COMMIT)
+			return -1;
+	}
+	return n;
+}
+
+/* Newest valid commit of a segment, -1 if there is none */
+static s64 last_commit(struct fsck *fs, struct jseg *js, __be64 *ofs)
+{
+	s32 i;
+
+	for (i = js->no_je - 1; i >= 0; i--)
+		if (je_type(js, js->je[i]) == JE_COMMIT &&
+				check_commit(fs, js, js->je[i], ofs) >= 0)
+			return js->je[i];
+	return -1;
+}
+
+/* ds_gec of the dynsb a commit lists, 0 if there is none */
+static u64 commit_gec(struct fsck *fs, struct jseg *js, __be64 *ofs, int n,
+		void *buf)
+{
+	u64 base = (u64)js->segno * fs->segsize;
+	struct logfs_je_dynsb *dynsb = buf;
+	u32 pos;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		pos = be64_to_cpu(ofs[i]) - base;
+		if (je_type(js, pos) == JE_DYNSB &&
+				read_je(fs, js, pos, buf) == sizeof(*dynsb))
+			return be64_to_cpu(dynsb->ds_gec);
+	}
+	return 0;
+}
+
+static int add_alias(struct fsck *fs, void *buf, int len)
+{
+	struct logfs_obj_alias *alias;
+	size_t n = len / sizeof(*alias);
+
+	alias = realloc(fs->alias, (fs->no_alias + n) * sizeof(*alias));
+	if (!alias)
+		return -ENOMEM;
+	memcpy(alias + fs->no_alias, buf, n * sizeof(*alias));
+	fs->alias = alias;
+	fs->no_alias += n;
+	return 0;
+}
+
+static int add_free_segments(struct fsck *fs, void *buf, int len)
+{
+	struct logfs_je_free_segments *fseg;
+	size_t i, n = len / sizeof(*fseg);
+
+	fseg = realloc(fs->free_seg, (fs->no_free_seg + n) * sizeof(*fseg));
+	if (!fseg)
+		return -ENOMEM;
+	memcpy(fseg + fs->no_free_seg, buf, n * sizeof(*fseg));
+	fs->free_seg = fseg;
+	for (i = fs->no_free_seg; i < fs->no_free_seg + n; i++)
+		if (be32_to_cpu(fseg[i].segno) >= fs->no_segs)
+			fsck_error(fs, "journal: free segment %u is beyond the "
+					"filesystem\n", be32_to_cpu(fseg[i].segno));
+	fs->no_free_seg += n;
+	return 0;
+}
+
+/* The partial write unit following @a goes over the erased device */
+static int check_area(struct fsck *fs, struct logfs_je_area *a, int len)
+{
+	u32 segno = be32_to_cpu(a->segno);
+	u32 used = be32_to_cpu(a->used_bytes);
+	u32 wbuf_len = used & (fs->writesize - 1);
+
+	if (fs->no_area == LOGFS_NO_AREAS) {
+		fsck_error(fs, "journal: more than %d areas\n",
+				LOGFS_NO_AREAS);
+		return 0;
+	}
+	if (segno >= fs->no_segs || used > fs->segsize ||
+			used < LOGFS_SEGMENT_HEADERSIZE ||
+			a->gc_level >= LOGFS_NO_AREAS ||
+			len != sizeof(*a) + wbuf_len) {
+		fsck_error(fs, "journal: bad area, segment %u, %u bytes used, "
+				"level %u\n", segno, used, a->gc_level);
+		return 0;
+	}
+	fs->area[fs->no_area++] = *a;
+	return dev_patch(fs, (u64)segno * fs->segsize + used - wbuf_len,
+			a + 1, wbuf_len);
+}
+
+/*
+ * Decodes the entries a commit lists.  Returns the segment the journal
+ * continues in, 0 if it ends here, or a negative error.
+ */
+static s64 read_commit(struct fsck *fs, struct jseg *js, __be64 *ofs, int n,
+		void *buf)
+{
+	u64 base = (u64)js->segno * fs->segsize;
+	s64 next = 0;
+	u32 pos;
+	u16 type;
+	int i, len, err;
+
+	for (i = 0; i < n; i++) {
+		pos = be64_to_cpu(ofs[i]) - base;
+		type = je_type(js, pos);
+		len = read_je(fs, js, pos, buf);
+		if (len < 0) {
+			fsck_error(fs, "journal: cannot read entry type 0x%x "
+					"at 0x%llx\n", type, base + pos);
+			continue;
+		}
+
+		switch (type) {
+		case JE_ANCHOR:
+			if (len != sizeof(fs->anchor))
+				goto bad_len;
+			memcpy(&fs->anchor, buf, len);
+			fs->have_anchor++;
+			break;
+		case JE_DYNSB:
+			if (len != sizeof(fs->dynsb))
+				goto bad_len;
+			memcpy(&fs->dynsb, buf, len);
+			fs->have_dynsb++;
+			break;
+		case JE_ERASECOUNT:
+			if (len % sizeof(__be32))
+				goto bad_len;
+			break;
+		case JE_SPILLOUT:
+			if (len != sizeof(__be32))
+				goto bad_len;
+			next = be32_to_cpu(*(__be32 *)buf);
+			if (next == 0 || next >= fs->no_segs) {
+				fsck_error(fs, "journal: spillout to bad "
+						"segment %lld\n", next);
+				next = 0;
+			}
+			break;
+		case JE_FREE_SEGMENTS:
+			if (!(be64_to_cpu(fs->ds.ds_feature_incompat) &
+						LOGFS_FEATURE_FREE_SEGMENTS))
+				fsck_error(fs, "journal: free segments without "
+						"the feature bit\n");
+			if (len % sizeof(struct logfs_je_free_segments))
+				goto bad_len;
+			err = add_free_segments(fs, buf, len);
+			if (err)
+				return err;
+			break;
+		case JE_OBJ_ALIAS:
+			if (len % sizeof(struct logfs_obj_alias))
+				goto bad_len;
+			err = add_alias(fs, buf, len);
+			if (err)
+				return err;
+			break;
+		case JE_AREA:
+			if (len < sizeof(struct logfs_je_area))
+				goto bad_len;
+			err = check_area(fs, buf, len);
+			if (err)
+				return err;
+			break;
+		default:
+			fsck_info(fs, "journal: ignoring entry type 0x%x at "
+					"0x%llx\n", type, base + pos);
+			break;
+		}
+		continue;
+bad_len:
+		fsck_error(fs, "journal: entry type 0x%x at 0x%llx has bad "
+				"length %d\n", type, base + pos, len);
+	}
+	return next;
+}
+
+/*
+ * Each journal segment is scanned for its last valid commit.  The one
+ * whose dynsb has the highest gec is the newest, earlier journal segments
+ * win ties, as mkfs writes identical replicas.  From there JE_SPILLOUT
+ * entries lead to further segments, each with a commit of its own.  Only
+ * the superblocks and the journal get read, so this is cheap regardless
+ * of device size.
+ */
+int fsck_read_journal(struct fsck *fs)
+{
+	struct jseg js, best;
+	__be64 *ofs = NULL;
+	void *buf = NULL;
+	s64 pos, next;
+	u64 gec, best_gec = 0;
+	int i, n, err = -ENOMEM;
+
+	memset(&js, 0, sizeof(js));
+	memset(&best, 0, sizeof(best));
+	js.je = malloc(fs->segsize / 16 * sizeof(u32));
+	best.je = malloc(fs->segsize / 16 * sizeof(u32));
+	ofs = malloc(fs->blocksize);
+	buf = malloc(fs->blocksize);
+	if (!fs->map) {
+		js.buf = malloc(fs->segsize);
+		best.buf = malloc(fs->segsize);
+		if (!js.buf || !best.buf)
+			goto out;
+	}
+	if (!js.je || !best.je || !ofs || !buf)
+		goto out;
+
+	for (i = 0; i < fs->no_journal_segs; i++) {
+		err = read_jseg(fs, &js, fs->journal_seg[i]);
+		if (err) {
+			fsck_info(fs, "journal segment %u: invalid header\n",
+					fs->journal_seg[i]);
+			continue;
+		}
+		pos = last_commit(fs, &js, ofs);
+		if (pos < 0) {
+			fsck_info(fs, "journal segment %u: no valid commit\n",
+					js.segno);
+			continue;
+		}
+		n = check_commit(fs, &js, pos, ofs);
+		gec = commit_gec(fs, &js, ofs, n, buf);
+		fsck_info(fs, "journal segment %u: commit at 0x%llx, gec "
+				"%llu\n", js.segno, pos, gec);
+		if (best.no_je && gec <= best_gec)
+			continue;
+		best_gec = gec;
+		swap(js, best);
+	}
+	if (!best.no_je) {
+		fsck_error(fs, "journal: no valid commit found\n");
+		err = -EINVAL;
+		goto out;
+	}
+
+	fs->journal_segno = best.segno;
+	fs->no_journal_chain = 0;
+	for (;;) {
+		fs->no_journal_chain++;
+		pos = last_commit(fs, &best, ofs);
+		if (pos < 0) {
+			fsck_error(fs, "journal: no valid commit in spillout "
+					"segment %u\n", best.segno);
+			break;
+		}
+		n = check_commit(fs, &best, pos, ofs);
+		next = read_commit(fs, &best, ofs, n, buf);
+		if (next < 0) {
+			err = next;
+			goto out;
+		}
+		if (next == 0)
+			break;
+		if (fs->no_journal_chain >= fs->no_segs) {
+			fsck_error(fs, "journal: spillout loop\n");
+			break;
+		}
+		if (read_jseg(fs, &best, next)) {
+			fsck_error(fs, "journal: bad spillout segment %lld\n",
+					next);
+			break;
+		}
+	}
+
+	err = 0;
+	if (!fs->have_anchor)
+		fsck_error(fs, "journal: no anchor\n");
+	if (!fs->have_dynsb)
+		fsck_error(fs, "journal: no dynamic superblock\n");
+out:
+	if (!fs->map) {
+		free(js.buf);
+		free(best.buf);
+	}
+	free(js.je);
+	free(best.je);
+	free(ofs);
+	free(buf);
+	return err;
+}
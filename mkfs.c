@@ -20,7 +20,9 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <aio.h>
 #define __USE_UNIX98
 #include <unistd.h>
 #include <zlib.h>
@@ -46,6 +48,10 @@ static u8 blockshift = 12;
 static u8 writeshift = 0;
 static u32 no_journal_segs = 4;
 static u32 bad_seg_reserve = 4;
+static u32 reorder_window;
+static u64 feature_compat;
+static u64 feature_incompat;
+static u8 journal_compr = COMPR_ZLIB;
 
 /* journal entries */
 static __be64 je_array[64];
@@ -58,44 +64,6 @@ static int interactice_mode = 1;
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static int logfs_compress(void *in, void *out, size_t inlen, size_t outlen)
-{
-	struct z_stream_s stream;
-	int err, ret;
-
-	ret = -EIO;
-	memset(&stream, 0, sizeof(stream));
-	err = deflateInit(&stream, 3);
-	if (err != Z_OK)
-		goto error;
-
-	stream.next_in = in;
-	stream.avail_in = inlen;
-	stream.total_in = 0;
-	stream.next_out = out;
-	stream.avail_out = outlen;
-	stream.total_out = 0;
-
-	err = deflate(&stream, Z_FINISH);
-	if (err != Z_STREAM_END)
-		goto error;
-
-	err = deflateEnd(&stream);
-	if (err != Z_OK)
-	goto error;
-
-	if (stream.total_out >= stream.total_in)
-		goto error;
-
-	ret = stream.total_out;
-error:
-	return ret;
-}
-
-
-////////////////////////////////////////////////////////////////////////////////
-
-
 static int mtd_erase(struct super_block *sb, u64 ofs, size_t size)
 {
 	if (ofs >= 0x100000000ull) {
@@ -122,8 +90,7 @@ static int mtd_prepare_sb(struct super_block *sb)
 
 	/* 1st superblock at the beginning */
 	segno = get_segment(sb);
-	sb->segment_entry[segno].ec_level = ec_level(1, 0);
-	sb->segment_entry[segno].valid = cpu_to_be32(RESERVED);
+	set_segment_entry(sb, segno, ec_level(1, 0), cpu_to_be32(RESERVED));
 	sb->sb_ofs1 = (u64)segno * sb->segsize;
 
 	/* 2nd superblock at the end */
@@ -131,8 +98,8 @@ static int mtd_prepare_sb(struct super_block *sb)
 		err = mtd_erase(sb, (u64)segno * sb->segsize, sb->segsize);
 		if (err)
 			continue;
-		sb->segment_entry[segno].ec_level = ec_level(1, 0);
-		sb->segment_entry[segno].valid = cpu_to_be32(RESERVED);
+		set_segment_entry(sb, segno, ec_level(1, 0),
+				cpu_to_be32(RESERVED));
 		sb->sb_ofs2 = (u64)(segno + 1) * sb->segsize - 0x1000;
 		break;
 	}
@@ -147,14 +114,12 @@ static int bdev_prepare_sb(struct super_block *sb)
 
 	/* 1st superblock at the beginning */
 	segno = get_segment(sb);
-	sb->segment_entry[segno].ec_level = ec_level(1, 0);
-	sb->segment_entry[segno].valid = cpu_to_be32(RESERVED);
+	set_segment_entry(sb, segno, ec_level(1, 0), cpu_to_be32(RESERVED));
 	sb->sb_ofs1 = (u64)segno * sb->segsize;
 
 	/* 2nd superblock at the end */
 	segno = sb->no_segs - 1;
-	sb->segment_entry[segno].ec_level = ec_level(1, 0);
-	sb->segment_entry[segno].valid = cpu_to_be32(RESERVED);
+	set_segment_entry(sb, segno, ec_level(1, 0), cpu_to_be32(RESERVED));
 	sb->sb_ofs2 = (u64)(segno) * sb->segsize - 0x1000;
 	return 0;
 }
@@ -216,6 +181,63 @@ static const struct logfs_device_operations bdev_ops = {
 	.erase = bdev_erase,
 };
 
+/*
+ * Journal and superblock writes are only needed once mkfs is done.  They
+ * are queued here and handed to lio_listio() by write_batch_submit(), which
+ * waits for all of them and flushes the device once.  Queued buffers are
+ * owned by the batch until then.
+ *
+ * glibc runs the requests for one descriptor in order.  The writes only
+ * fill the page cache though, the single fsync() issues them together.
+ */
+#define MAX_BATCH (2 + LOGFS_JOURNAL_SEGS)
+
+static struct aiocb write_batch[MAX_BATCH];
+static int no_batch;
+
+static void write_batch_add(struct super_block *sb, u64 ofs, size_t size,
+		void *buf)
+{
+	struct aiocb *cb = write_batch + no_batch++;
+
+	BUG_ON(no_batch > MAX_BATCH);
+	memset(cb, 0, sizeof(*cb));
+	cb->aio_fildes = sb->fd;
+	cb->aio_offset = ofs;
+	cb->aio_buf = buf;
+	cb->aio_nbytes = size;
+	cb->aio_lio_opcode = LIO_WRITE;
+}
+
+static int write_batch_submit(struct super_block *sb)
+{
+	struct aiocb *list[MAX_BATCH];
+	int i, queued, done, ret = 0;
+
+	for (i = 0; i < no_batch; i++)
+		list[i] = write_batch + i;
+	/*
+	 * If lio_listio() fails, some requests may still be in flight and the
+	 * status of the others is unspecified.  Wait for the former and write
+	 * everything synchronously.  Requests that fail are rewritten, too.
+	 */
+	queued = !lio_listio(LIO_NOWAIT, list, no_batch, NULL);
+	for (i = 0; i < no_batch; i++) {
+		while (aio_error(list[i]) == EINPROGRESS)
+			aio_suspend((const struct aiocb * const *)&list[i], 1,
+					NULL);
+		done = queued && aio_return(list[i]) == list[i]->aio_nbytes;
+		if (!done && safe_pwrite(sb->fd, (void *)list[i]->aio_buf,
+					list[i]->aio_nbytes, list[i]->aio_offset))
+			ret = -EIO;
+		free((void *)list[i]->aio_buf);
+	}
+	no_batch = 0;
+	if (fsync(sb->fd) && !ret)
+		ret = -EIO;
+	return ret;
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -234,15 +256,39 @@ static void set_segment_header(struct logfs_segment_header *sh, u8 type,
 	sh->crc = logfs_crc32(sh, LOGFS_SEGMENT_HEADERSIZE, 4);
 }
 
-static int write_inode(struct super_block *sb, u64 ino)
+struct ino_run {
+	u64 *ino;
+	size_t count;
+};
+
+static void collect_ino(void *elem, long opaque, u64 ino, size_t index)
 {
-	struct inode *inode;
+	struct ino_run *run = (void *)opaque;
 
-	inode = find_or_create_inode(sb, ino);
-	if (!inode)
+	/* visitor walks the tree from the highest key down */
+	run->ino[run->count - 1 - index] = ino;
+}
+
+static int write_inodes(struct super_block *sb)
+{
+	struct ino_run run;
+	size_t i, n;
+	int err;
+
+	run.count = btree_visitor64(&sb->ino_tree, 0, NULL);
+	run.ino = malloc(run.count * sizeof(u64));
+	if (!run.ino)
 		return -ENOMEM;
-	return logfs_file_write(sb, LOGFS_INO_MASTER, ino, 0, OBJ_INODE,
-			&inode->di);
+	btree_visitor64(&sb->ino_tree, (long)&run, collect_ino);
+
+	/* master inode lives in the journal, not in the inode file */
+	for (i = n = 0; i < run.count; i++)
+		if (run.ino[i] != LOGFS_INO_MASTER)
+			run.ino[n++] = run.ino[i];
+
+	err = logfs_write_inodes(sb, run.ino, n);
+	free(run.ino);
+	return err;
 }
 
 static int write_segment_file(struct super_block *sb)
@@ -272,11 +318,7 @@ static int write_segment_file(struct super_block *sb)
 		if (err)
 			return err;
 	}
-	err = logfs_file_flush(sb, LOGFS_INO_SEGFILE);
-	if (err)
-		return err;
-
-	return write_inode(sb, LOGFS_INO_SEGFILE);
+	return logfs_file_flush(sb, LOGFS_INO_SEGFILE);
 }
 
 static int write_rootdir(struct super_block *sb)
@@ -293,7 +335,7 @@ static int write_rootdir(struct super_block *sb)
 		di->di_flags |= cpu_to_be32(LOGFS_IF_COMPRESSED);
 	di->di_mode	= cpu_to_be16(S_IFDIR | 0755);
 	di->di_refcount	= cpu_to_be32(1);
-	return write_inode(sb, LOGFS_INO_ROOT);
+	return 0;
 }
 
 /* journal */
@@ -314,6 +356,9 @@ static size_t __write_header(struct logfs_journal_header *jh, size_t len,
 	return ALIGN(len, 16) + sizeof(*jh);
 }
 
+/* Space taken by a journal entry with @len bytes of payload */
+#define JE_SIZE(len) (sizeof(struct logfs_journal_header) + ALIGN(len, 16))
+
 static size_t write_header(struct logfs_journal_header *h, size_t datalen,
 		u16 type)
 {
@@ -334,6 +379,7 @@ static size_t je_anchor(struct super_block *sb, void *_da, u16 *type)
 	da->da_last_ino	= cpu_to_be64(LOGFS_RESERVED_INOS);
 	da->da_size	= cpu_to_be64(LOGFS_RESERVED_INOS * sb->blocksize);
 	da->da_used_bytes = inode->di.di_used_bytes;
+	da->da_height	= inode->di.di_height;
 	for (i = 0; i < LOGFS_EMBEDDED_FIELDS; i++)
 		da->da_data[i] = inode->di.di_data[i];
 	*type = JE_ANCHOR;
@@ -352,36 +398,131 @@ static size_t je_dynsb(struct super_block *sb, void *_dynsb, u16 *type)
 	return sizeof(*dynsb);
 }
 
+static size_t je_erasecount(struct super_block *sb, void *_ec, u16 *type)
+{
+	struct logfs_je_journal_ec *ec = _ec;
+	u32 segno;
+	int i;
+
+	for (i = 0; i < no_journal_segs; i++) {
+		segno = sb->journal_seg[i];
+		ec->ec[i] = cpu_to_be32(
+				be32_to_cpu(sb->segment_entry[segno].ec_level) >> 4);
+	}
+	*type = JE_ERASECOUNT;
+	return no_journal_segs * sizeof(__be32);
+}
+
+/* Written last, once the journal itself has taken all segments it needs */
+static size_t je_free_segments(struct super_block *sb, void *_fs, u16 *type)
+{
+	struct logfs_je_free_segments *fs = _fs;
+	struct logfs_segment_entry *se;
+	u32 segno;
+	int k = 0;
+
+	for (segno = sb->lastseg; segno < sb->no_segs; segno++) {
+		se = sb->segment_entry + segno;
+		if (se->ec_level || se->valid)
+			continue;
+		fs[k].segno = cpu_to_be32(segno);
+		fs[k].ec = cpu_to_be32(be32_to_cpu(se->ec_level) >> 4);
+		if (++k == MAX_CACHED_SEGS)
+			break;
+	}
+	*type = JE_FREE_SEGMENTS;
+	return k * sizeof(*fs);
+}
+
+/*
+ * One entry per open area.  area_cursor is the next area to look at.  All
+ * areas are left closed once they carry a segment summary, as appending to
+ * them would leave the summary stale.
+ */
+static int area_cursor;
+
+static int area_pending(struct super_block *sb)
+{
+	if (sb->feature_compat & LOGFS_FEATURE_SUMMARY)
+		return 0;
+	for ( ; area_cursor < LOGFS_NO_AREAS; area_cursor++)
+		if (sb->area[area_cursor].buf)
+			return 1;
+	return 0;
+}
+
+static size_t je_area(struct super_block *sb, void *_a, u16 *type)
+{
+	struct logfs_je_area *a = _a;
+	struct logfs_area *area = sb->area + area_cursor;
+	u32 wbuf_len = area->used_bytes & (sb->writesize - 1);
+
+	a->segno	= cpu_to_be32(area->segno);
+	a->used_bytes	= cpu_to_be32(area->used_bytes);
+	a->gc_level	= area_cursor;
+	a->vim		= VIM_DEFAULT;
+	/* partially filled write unit follows */
+	memcpy(a + 1, area->buf + area->used_bytes - wbuf_len, wbuf_len);
+	area_cursor++;
+	*type = JE_AREA;
+	return sizeof(*a) + wbuf_len;
+}
+
+/*
+ * Aliases are streamed, one journal entry worth at a time.  alias_cursor is
+ * the first segment not covered by any previous entry.  Only segments in
+ * sb->dirty_segs have an entry worth aliasing.
+ */
+static u32 alias_cursor;
+
+static int alias_pending(struct super_block *sb)
+{
+	alias_cursor = find_next_bit(sb->dirty_segs, sb->no_segs, alias_cursor);
+	return alias_cursor < sb->no_segs;
+}
+
 static size_t je_alias(struct super_block *sb, void *_oa, u16 *type)
 {
 	struct logfs_obj_alias *oa = _oa;
-	struct logfs_segment_entry *se;
-	u64 val;
-	int i, k;
+	struct logfs_obj_alias template = {
+		.ino = cpu_to_be64(LOGFS_INO_SEGFILE),
+	};
+	unsigned long i;
+	int k, max;
 	int ashift, amask;
 
-	ashift = blockshift - 3; /* 8 bytes per alias */
+	ashift = sb->blocksize_bits - 3; /* 8 bytes per alias */
 	amask = (1 << ashift) - 1;
-	memset(oa, 0, sb->blocksize);
+	max = sb->blocksize / sizeof(*oa);
 	k = 0;
-	for (i = 0; i < sb->no_segs; i++) {
-		se = sb->segment_entry + i;
-		if (se->ec_level || se->valid) {
-			val = (u64)be32_to_cpu(se->ec_level) << 32 |
-				be32_to_cpu(se->valid);
-			oa[k].ino = cpu_to_be64(LOGFS_INO_SEGFILE);
-			oa[k].bix = cpu_to_be64(i >> ashift);
-			oa[k].val = cpu_to_be64(val);
-			oa[k].level = 0;
-			oa[k].child_no = cpu_to_be16(i & amask);
-			k++;
-		}
+	for (i = find_next_bit(sb->dirty_segs, sb->no_segs, alias_cursor);
+			i < sb->no_segs && k < max;
+			i = find_next_bit(sb->dirty_segs, sb->no_segs, i + 1)) {
+		oa[k] = template;
+		oa[k].bix = cpu_to_be64(i >> ashift);
+		/* a segment entry already is the big endian ec_level:valid */
+		memcpy(&oa[k].val, sb->segment_entry + i, sizeof(oa[k].val));
+		oa[k].child_no = cpu_to_be16(i & amask);
+		k++;
 	}
+	alias_cursor = i;
 
 	*type = JE_OBJ_ALIAS;
 	return k * sizeof(*oa);
 }
 
+/* Segment the journal continues in once the current one is full */
+static u32 spill_segno;
+
+static size_t je_spillout(struct super_block *sb, void *_segno, u16 *type)
+{
+	__be32 *segno = _segno;
+
+	*segno = cpu_to_be32(spill_segno);
+	*type = JE_SPILLOUT;
+	return sizeof(*segno);
+}
+
 static size_t je_commit(struct super_block *sb, void *h, u16 *type)
 {
 	*type = JE_COMMIT;
@@ -398,7 +539,7 @@ static size_t write_je(struct super_block *sb,
 	void *data;
 	ssize_t len, max, compr_len, pad_len;
 	u16 type;
-	u8 compr = COMPR_ZLIB;
+	u8 compr = sb->compr;
 
 	header += jpos;
 	data = header + sizeof(struct logfs_journal_header);
@@ -409,9 +550,12 @@ static size_t write_je(struct super_block *sb,
 	if (len == 0)
 		return write_header(header, 0, type);
 
-	max = sb->blocksize - jpos;
-	compr_len = logfs_compress(scratch, data, len, max);
-	if ((compr_len < 0) || (type == JE_COMMIT)) {
+	/* an entry may not exceed one block, nor the end of the segment */
+	max = min(sb->blocksize, sb->segsize - jpos - JE_SIZE(0));
+	compr_len = -EINVAL;
+	if (compr != COMPR_NONE && type != JE_COMMIT)
+		compr_len = logfs_compress(scratch, data, len, max, compr);
+	if (compr_len < 0) {
 		BUG_ON(len > max);
 		memcpy(data, scratch, len);
 		compr_len = len;
@@ -424,31 +568,144 @@ static size_t write_je(struct super_block *sb,
 	return __write_header(header, compr_len, len, type, compr);
 }
 
+static size_t start_journal_seg(struct super_block *sb, void *journal,
+		u32 segno)
+{
+	memset(journal, 0, sb->segsize);
+	set_segment_header(journal, SEG_JOURNAL, 0, segno);
+	no_je = 0;
+	return ALIGN(sizeof(struct logfs_segment_header), 16);
+}
+
+/*
+ * The first journal segment is replicated to all journal segments.  Each
+ * copy differs only in its segment header and in the offsets recorded by
+ * the commit entry at @commit.
+ */
+static int queue_journal(struct super_block *sb, void *journal, size_t commit)
+{
+	struct logfs_journal_header *jh;
+	__be64 *ofs;
+	u64 delta;
+	void *buf;
+	int i, k, n;
+
+	for (i = 0; i < no_journal_segs; i++) {
+		buf = malloc(sb->segsize);
+		if (!buf)
+			return -ENOMEM;
+		memcpy(buf, journal, sb->segsize);
+		delta = (u64)sb->journal_seg[i] * sb->segsize -
+			(u64)sb->journal_seg[0] * sb->segsize;
+		set_segment_header(buf, SEG_JOURNAL, 0, sb->journal_seg[i]);
+		jh = buf + commit;
+		ofs = (void *)(jh + 1);
+		n = be16_to_cpu(jh->h_len) / sizeof(*ofs);
+		for (k = 0; k < n; k++)
+			ofs[k] = cpu_to_be64(be64_to_cpu(ofs[k]) + delta);
+		jh->h_crc = logfs_crc32(jh, be16_to_cpu(jh->h_len) +
+				sizeof(*jh), 4);
+		write_batch_add(sb, (u64)sb->journal_seg[i] * sb->segsize,
+				sb->segsize, buf);
+	}
+	return 0;
+}
+
+/* Spill segments are written right away, the buffer gets reused */
+static int finish_journal_seg(struct super_block *sb, void *journal, u32 seg,
+		size_t commit)
+{
+	if (seg == sb->journal_seg[0])
+		return queue_journal(sb, journal, commit);
+	return sb->dev_ops->write(sb, (u64)seg * sb->segsize, sb->segsize,
+			journal);
+}
+
+/*
+ * Aliases for all segment entries may not fit into a single journal
+ * segment.  Once it is full, the remaining ones spill into further
+ * segments.  Each segment ends with a JE_SPILLOUT pointing to the next one,
+ * the last one with the list of free segments instead, followed by a
+ * JE_COMMIT covering its own entries.
+ */
 static int make_journal(struct super_block *sb)
 {
 	void *journal, *scratch;
-	size_t jpos;
+	size_t jpos, reserve, commit;
 	u32 seg;
+	int ret = -ENOMEM;
 
-	seg = sb->journal_seg[0];
-	/* TODO: add segment to superblock, segfile */
-	journal = zalloc(sb->segsize);
-	if (!journal)
-		return -ENOMEM;
-
-	scratch = zalloc(2 * sb->blocksize);
-	if (!scratch)
-		return -ENOMEM;
+	/*
+	 * Room for JE_SPILLOUT and JE_COMMIT at the end of each segment, plus
+	 * JE_FREE_SEGMENTS in the last one
+	 */
+	reserve = JE_SIZE(sizeof(__be32)) + JE_SIZE(sizeof(je_array));
+	if (sb->feature_incompat & LOGFS_FEATURE_FREE_SEGMENTS)
+		reserve += JE_SIZE(MAX_CACHED_SEGS *
+				sizeof(struct logfs_je_free_segments));
+	BUG_ON(ALIGN(sizeof(struct logfs_segment_header), 16) +
+			JE_SIZE(sb->blocksize) + reserve > sb->segsize);
+
+	journal = malloc(sb->segsize);
+	scratch = zalloc(sb->blocksize);
+	if (!journal || !scratch)
+		goto out;
 
-	set_segment_header(journal, SEG_JOURNAL, 0, seg);
-	jpos = ALIGN(sizeof(struct logfs_segment_header), 16);
-	/* erasecount is not written - implicitly set to 0 */
-	/* neither are summary, index, wbuf */
+	seg = sb->journal_seg[0];
+	jpos = start_journal_seg(sb, journal, seg);
+	/* summary and index are not written */
 	jpos += write_je(sb, jpos, scratch, journal, seg, je_anchor);
 	jpos += write_je(sb, jpos, scratch, journal, seg, je_dynsb);
-	jpos += write_je(sb, jpos, scratch, journal, seg, je_alias);
+	jpos += write_je(sb, jpos, scratch, journal, seg, je_erasecount);
+	/* areas that do not fit are closed, their tail is written below */
+	area_cursor = 0;
+	while (area_pending(sb) && no_je < ARRAY_SIZE(je_array) - 1 &&
+			jpos + JE_SIZE(sb->blocksize) + reserve <= sb->segsize &&
+			sizeof(struct logfs_je_area) + sb->writesize <=
+			sb->blocksize)
+		jpos += write_je(sb, jpos, scratch, journal, seg, je_area);
+	for ( ; area_pending(sb); area_cursor++) {
+		ret = close_area(sb, sb->area + area_cursor);
+		if (ret)
+			goto out;
+	}
+	alias_cursor = 0;
+	for (;;) {
+		while (alias_pending(sb) && no_je < ARRAY_SIZE(je_array) - 1 &&
+				jpos + JE_SIZE(sb->blocksize) + reserve <=
+				sb->segsize)
+			jpos += write_je(sb, jpos, scratch, journal, seg,
+					je_alias);
+		if (!alias_pending(sb))
+			break;
+
+		/*
+		 * The spill segment needs an alias itself.  It usually lies
+		 * past the cursor, but not when only the sb2 alias is left.
+		 */
+		spill_segno = get_segment(sb);
+		set_segment_entry(sb, spill_segno, ec_level(1, 0),
+				cpu_to_be32(RESERVED));
+		alias_cursor = min(alias_cursor, spill_segno);
+		jpos += write_je(sb, jpos, scratch, journal, seg, je_spillout);
+		commit = jpos;
+		jpos += write_je(sb, jpos, scratch, journal, seg, je_commit);
+		ret = finish_journal_seg(sb, journal, seg, commit);
+		if (ret)
+			goto out;
+		seg = spill_segno;
+		jpos = start_journal_seg(sb, journal, seg);
+	}
+	if (sb->feature_incompat & LOGFS_FEATURE_FREE_SEGMENTS)
+		jpos += write_je(sb, jpos, scratch, journal, seg,
+				je_free_segments);
+	commit = jpos;
 	jpos += write_je(sb, jpos, scratch, journal, seg, je_commit);
-	return sb->dev_ops->write(sb, seg * sb->segsize, sb->segsize, journal);
+	ret = finish_journal_seg(sb, journal, seg, commit);
+out:
+	free(scratch);
+	free(journal);
+	return ret;
 }
 
 /* superblock */
@@ -456,13 +713,17 @@ static int make_journal(struct super_block *sb)
 static int make_super(struct super_block *sb)
 {
 	struct logfs_disk_super _ds, *ds = &_ds;
-	void *sector;
+	void *sector, *sector2;
 	int secsize = ALIGN(sizeof(*ds), sb->writesize);
-	int i, ret;
+	int i;
 
 	sector = zalloc(secsize);
-	if (!sector)
+	sector2 = zalloc(secsize);
+	if (!sector || !sector2) {
+		free(sector);
+		free(sector2);
 		return -ENOMEM;
+	}
 
 	memset(ds, 0, sizeof(*ds));
 	set_segment_header((void *)ds, SEG_SUPER, 0, 0);
@@ -474,10 +735,10 @@ static int make_super(struct super_block *sb)
 	ds->ds_iblock_levels	= 4; /* 3+1, 512GiB */
 	ds->ds_data_levels	= 1; /* old, young, unknown */
 
-	ds->ds_feature_incompat	= 0;
+	ds->ds_feature_incompat	= cpu_to_be64(sb->feature_incompat);
 	ds->ds_feature_ro_compat= 0;
 
-	ds->ds_feature_compat	= 0;
+	ds->ds_feature_compat	= cpu_to_be64(sb->feature_compat);
 	ds->ds_feature_flags	= 0;
 
 	ds->ds_filesystem_size	= cpu_to_be64(sb->fssize);
@@ -496,11 +757,10 @@ static int make_super(struct super_block *sb)
 	ds->ds_crc = logfs_crc32(ds, sizeof(*ds), LOGFS_SEGMENT_HEADERSIZE + 12);
 
 	memcpy(sector, ds, sizeof(*ds));
-	ret = sb->dev_ops->write(sb, sb->sb_ofs1, secsize, sector);
-	if (!ret)
-		ret = sb->dev_ops->write(sb, sb->sb_ofs2, secsize, sector);
-	free(sector);
-	return ret;
+	memcpy(sector2, ds, sizeof(*ds));
+	write_batch_add(sb, sb->sb_ofs1, secsize, sector);
+	write_batch_add(sb, sb->sb_ofs2, secsize, sector2);
+	return 0;
 }
 
 /* main stuff */
@@ -513,8 +773,8 @@ static void prepare_journal(struct super_block *sb)
 	for (i = 0; i < no_journal_segs; i++) {
 		segno = get_segment(sb);
 		sb->journal_seg[i] = segno;
-		sb->segment_entry[segno].ec_level = ec_level(1, 0);
-		sb->segment_entry[segno].valid = cpu_to_be32(RESERVED);
+		set_segment_entry(sb, segno, ec_level(1, 0),
+				cpu_to_be32(RESERVED));
 	}
 }
 
@@ -535,8 +795,9 @@ static void mkfs(struct super_block *sb)
 		fail("segment shift too large (max 30)");
 	if (segshift <= blockshift)
 		fail("segment shift must be larger than block shift");
-	if (blockshift != 12)
-		fail("blockshift must be 12");
+	/* object and journal headers store lengths in 16 bits */
+	if (blockshift < 12 || blockshift > 15)
+		fail("blockshift must be between 12 and 15");
 	if (writeshift > 16)
 		fail("writeshift too large (max 16)");
 	if (segshift < writeshift)
@@ -545,6 +806,12 @@ static void mkfs(struct super_block *sb)
 	sb->blocksize = 1 << blockshift;
 	sb->blocksize_bits = blockshift;
 	sb->writesize = 1 << writeshift;
+	sb->pending_window = reorder_window;
+	sb->feature_compat = feature_compat;
+	sb->feature_incompat = feature_incompat;
+	sb->compr = journal_compr;
+	if (journal_compr == COMPR_LZ4)
+		sb->feature_incompat |= LOGFS_FEATURE_LZ4;
 
 	sb->no_segs = sb->fssize >> segshift;
 	sb->fssize = (u64)sb->no_segs << segshift;
@@ -571,7 +838,8 @@ static void mkfs(struct super_block *sb)
 	}
 
 	sb->segment_entry = zalloc(sb->no_segs * sizeof(sb->segment_entry[0]));
-	if (!sb->segment_entry)
+	sb->dirty_segs = zalloc(BITS_TO_LONGS(sb->no_segs) * sizeof(long));
+	if (!sb->segment_entry || !sb->dirty_segs)
 		fail("out of memory");
 
 	ret = sb->dev_ops->prepare_sb(sb);
@@ -587,6 +855,10 @@ static void mkfs(struct super_block *sb)
 	if (ret)
 		fail("could not create root inode");
 
+	ret = write_inodes(sb);
+	if (ret)
+		fail("could not write inodes");
+
 	ret = flush_segments(sb);
 	if (ret)
 		fail("could not write segments");
@@ -594,7 +866,7 @@ static void mkfs(struct super_block *sb)
 	 * prepare sb
 	 * prepare journal
 	 * write segment file (create alias)
-	 * write inodes (create alias)
+	 * write all inodes in one sorted pass (create alias)
 	 * flush segments
 	 * write journal (including aliases)
 	 * write sb
@@ -608,7 +880,9 @@ static void mkfs(struct super_block *sb)
 	if (ret)
 		fail("could not create superblock");
 
-	fsync(sb->fd);
+	ret = write_batch_submit(sb);
+	if (ret)
+		fail("could not write journal and superblocks");
 	printf("\nFinished generating LogFS\n");
 }
 
@@ -618,9 +892,17 @@ static struct super_block *__open_device(const char *name)
 	const struct logfs_device_operations *ops = &bdev_ops;
 	struct mtd_info_user mtd;
 	struct stat stat;
-	int err;
+	int i, err;
 
 	sb = zalloc(sizeof(*sb));
+	btree_pool_init(&sb->btree_pool, LOGFS_BTREE_NODESIZE);
+	btree_init64_nodesize(&sb->ino_tree, LOGFS_BTREE_NODESIZE);
+	btree_set_finger64(&sb->ino_tree, &sb->ino_finger);
+	btree_set_pool64(&sb->ino_tree, &sb->btree_pool);
+	for (i = 0; i < LOGFS_NO_AREAS; i++) {
+		btree_init128_nodesize(&sb->block_tree[i], LOGFS_BTREE_NODESIZE);
+		btree_set_pool128(&sb->block_tree[i], &sb->btree_pool);
+	}
 	sb->fd = open(name, O_WRONLY | O_EXCL | O_LARGEFILE);
 	if (sb->fd == -1)
 		fail("could not open device");
@@ -689,16 +971,24 @@ static void usage(void)
 "\n"
 "Options:\n"
 "  -c --compress        turn compression on\n"
+"  -b --blockshift      block shift in bits\n"
 "  -h --help            display this help\n"
+"     --free-segments   list free segments in the journal, older kernels\n"
+"                       cannot mount the filesystem\n"
+"     --journal-compr   journal compression: none, zlib (default) or lz4\n"
+"     --reorder-window  data blocks held back to group them by file\n"
+"                       (default: 0, off).  1024 to 4096 blocks keep\n"
+"                       interleaved files together, 64 barely helps\n"
+"     --segment-summary end each segment with a list of its objects\n"
 "  -s --segshift        segment shift in bits\n"
 "  -w --writeshift      write shift in bits\n"
 "     --demo-mode	skip bad block scan; don't erase device\n"
 "     --non-interactive turn off safety question before writing\n"
 "\n"
-"Segment size and write size are powers of two.  To specify them, the\n"
-"appropriate power is specified with the \"-s\" or \"-w\" options, instead\n"
-"of the actual size.  E.g. \"mklogfs -w8\" will set a writesize\n"
-"of 256 Bytes (2^8).\n\n");
+"Segment size, block size and write size are powers of two.  To specify\n"
+"them, the appropriate power is specified with the \"-s\", \"-b\" or \"-w\"\n"
+"options, instead of the actual size.  E.g. \"mklogfs -w8\" will set a\n"
+"writesize of 256 Bytes (2^8).\n\n");
 }
 
 int main(int argc, char **argv)
@@ -708,14 +998,19 @@ int main(int argc, char **argv)
 	check_crc32();
 	for (;;) {
 		int oi = 1;
-		char short_opts[] = "chs:w:";
+		char short_opts[] = "b:chs:w:";
 		static const struct option long_opts[] = {
 			{"bad-segment-reserve",	1, NULL, 'B'},
+			{"blockshift",		1, NULL, 'b'},
 			{"compress",		0, NULL, 'c'},
 			{"journal-segments",	1, NULL, 'j'},
 			{"help",		0, NULL, 'h'},
+			{"journal-compr",	1, NULL, 'J'},
 			{"non-interactive",	0, NULL, 'n'},
 			{"demo-mode",		0, NULL, 'q'},
+			{"free-segments",	0, NULL, 'F'},
+			{"reorder-window",	1, NULL, 'r'},
+			{"segment-summary",	0, NULL, 'S'},
 			{"segshift",		1, NULL, 's'},
 			{"writeshift",		1, NULL, 'w'},
 			{ }
@@ -736,6 +1031,21 @@ int main(int argc, char **argv)
 		case 'j':
 			no_journal_segs = strtoul(optarg, NULL, 0);
 			break;
+		case 'J':
+			if (!strcmp(optarg, "none"))
+				journal_compr = COMPR_NONE;
+			else if (!strcmp(optarg, "zlib"))
+				journal_compr = COMPR_ZLIB;
+			else if (!strcmp(optarg, "lz4"))
+				journal_compr = COMPR_LZ4;
+			else {
+				usage();
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'F':
+			feature_incompat |= LOGFS_FEATURE_FREE_SEGMENTS;
+			break;
 		case 'h':
 			usage();
 			exit(EXIT_SUCCESS);
@@ -745,6 +1055,12 @@ int main(int argc, char **argv)
 		case 'q':
 			quick_bad_block_scan = 1;
 			break;
+		case 'r':
+			reorder_window = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			feature_compat |= LOGFS_FEATURE_SUMMARY;
+			break;
 		case 's':
 			user_segshift = strtoul(optarg, NULL, 0);
 			break;
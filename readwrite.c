@@ -36,13 +36,21 @@ static inline int child_no(struct super_block *sb, u64 bix)
 struct inode *find_or_create_inode(struct super_block *sb, u64 ino)
 {
 	struct inode *inode;
-	int err;
+	int i, err;
 
 	inode = btree_lookup64(&sb->ino_tree, ino);
 	if (!inode) {
 		inode = zalloc(sizeof(*inode) + sb->blocksize);
 		if (!inode)
 			return NULL;
+		for (i = 0; i < LOGFS_MAX_LEVELS; i++) {
+			btree_init64_nodesize(&inode->block_tree[i],
+					LOGFS_BTREE_NODESIZE);
+			btree_set_finger64(&inode->block_tree[i],
+					&inode->block_finger[i]);
+			btree_set_pool64(&inode->block_tree[i],
+					&sb->btree_pool);
+		}
 		err = btree_insert64(&sb->ino_tree, ino, inode);
 		if (err)
 			return NULL;
@@ -74,6 +82,10 @@ static int write_direct(struct super_block *sb, struct inode *inode, u64 ino,
 {
 	s64 ofs;
 
+	if (sb->pending_window && ino != LOGFS_INO_MASTER)
+		return logfs_segment_queue(sb, buf, type, ino, bix,
+				&inode->di.di_data[bix]);
+
 	ofs = logfs_segment_write(sb, buf, type, ino, bix, 0);
 	if (ofs < 0)
 		return ofs;
@@ -85,7 +97,7 @@ static u64 bixmask(struct super_block *sb, u8 level)
 {
 	if (level == 0)
 		return 0;
-	return (1 << ((sb->blocksize_bits - 3) * level)) - 1;
+	return (1ULL << ((sb->blocksize_bits - 3) * level)) - 1;
 }
 
 static int write_loop(struct super_block *sb, struct inode *inode, u64 ino,
@@ -99,6 +111,10 @@ static int write_loop(struct super_block *sb, struct inode *inode, u64 ino,
 	iblock = find_or_create_block(sb, inode, parent_bix, level + 1);
 	if (!iblock)
 		return -ENOMEM;
+	if (level == 0 && sb->pending_window && ino != LOGFS_INO_MASTER)
+		return logfs_segment_queue(sb, buf, type, ino, bix,
+				&iblock[get_bits(sb, bix, level)]);
+
 	ofs = logfs_segment_write(sb, buf, type, ino, bix, level);
 	if (ofs < 0)
 		return ofs;
@@ -106,16 +122,17 @@ static int write_loop(struct super_block *sb, struct inode *inode, u64 ino,
 	return 0;
 }
 
-static inline u64 maxbix(u8 height)
+static inline u64 maxbix(struct super_block *sb, u8 height)
 {
-	return 1ULL << (LOGFS_BLOCK_BITS * height);
+	return 1ULL << ((sb->blocksize_bits - 3) * height);
 }
 
-static void grow_inode(struct inode *inode, u64 bix, u8 level)
+static void grow_inode(struct super_block *sb, struct inode *inode, u64 bix,
+		u8 level)
 {
 	if (level != 0)
 		return;
-	while (bix > maxbix(inode->di.di_height))
+	while (bix >= maxbix(sb, inode->di.di_height))
 		inode->di.di_height++;
 }
 
@@ -131,13 +148,144 @@ int logfs_file_write(struct super_block *sb, u64 ino, u64 bix, u8 level,
 	if (level == 0 && bix < I0_BLOCKS)
 		return write_direct(sb, inode, ino, bix, type, buf);
 
-	grow_inode(inode, bix, level);
+	grow_inode(sb, inode, bix, level);
 	return write_loop(sb, inode, ino, bix, level, type, buf);
 }
 
+/*
+ * Batched inode writer.  Inodes are written to the inode file in ascending
+ * order, so the indirect blocks of the inode file can be built in a single
+ * streaming pass.  Only one indirect block per level is kept in memory.  As
+ * soon as a write moves past the range covered by it, the block is complete
+ * and gets written out immediately, its offset going into the next level.
+ */
+struct ifile_stream {
+	u64 bix[LOGFS_MAX_LEVELS + 1];
+	__be64 *block[LOGFS_MAX_LEVELS + 1];
+	struct inode *master;
+};
+
+static int stream_put(struct super_block *sb, struct ifile_stream *s,
+		u64 bix, u8 level, s64 ofs);
+
+static int stream_flush_level(struct super_block *sb, struct ifile_stream *s,
+		u8 level)
+{
+	s64 ofs;
+	int err;
+
+	ofs = logfs_segment_write(sb, s->block[level], OBJ_BLOCK,
+			LOGFS_INO_MASTER, s->bix[level], level);
+	if (ofs < 0)
+		return ofs;
+	if (level == s->master->di.di_height)
+		s->master->di.di_data[INDIRECT_INDEX] = cpu_to_be64(ofs);
+	else {
+		err = stream_put(sb, s, s->bix[level], level, ofs);
+		if (err)
+			return err;
+	}
+	free(s->block[level]);
+	s->block[level] = NULL;
+	return 0;
+}
+
+static int stream_put(struct super_block *sb, struct ifile_stream *s,
+		u64 bix, u8 level, s64 ofs)
+{
+	u8 parent = level + 1;
+	u64 parent_bix = bix | bixmask(sb, parent);
+	int err;
+
+	if (s->block[parent] && s->bix[parent] != parent_bix) {
+		err = stream_flush_level(sb, s, parent);
+		if (err)
+			return err;
+	}
+	if (!s->block[parent]) {
+		s->block[parent] = zalloc(sb->blocksize);
+		if (!s->block[parent])
+			return -ENOMEM;
+		s->bix[parent] = parent_bix;
+	}
+	s->block[parent][get_bits(sb, bix, level)] = cpu_to_be64(ofs);
+	return 0;
+}
+
+int logfs_write_inodes(struct super_block *sb, u64 *ino, size_t count)
+{
+	struct ifile_stream s;
+	struct inode *inode;
+	size_t i;
+	s64 ofs;
+	u8 level;
+	int err;
+
+	err = logfs_segment_drain(sb);
+	if (err)
+		return err;
+
+	if (count == 0)
+		return 0;
+
+	memset(&s, 0, sizeof(s));
+	s.master = find_or_create_inode(sb, LOGFS_INO_MASTER);
+	if (!s.master)
+		return -ENOMEM;
+	/* The stream owns the inode file's indirect blocks */
+	BUG_ON(s.master->di.di_height);
+	if (ino[count - 1] >= I0_BLOCKS)
+		grow_inode(sb, s.master, ino[count - 1], 0);
+
+	for (i = 0; i < count; i++) {
+		BUG_ON(ino[i] == LOGFS_INO_MASTER);
+		BUG_ON(i > 0 && ino[i] <= ino[i - 1]);
+		inode = btree_lookup64(&sb->ino_tree, ino[i]);
+		err = -EINVAL;
+		if (!inode)
+			goto out;
+
+		if (ino[i] < I0_BLOCKS) {
+			err = write_direct(sb, s.master, LOGFS_INO_MASTER,
+					ino[i], OBJ_INODE, &inode->di);
+			if (err)
+				goto out;
+			continue;
+		}
+		ofs = logfs_segment_write(sb, &inode->di, OBJ_INODE,
+				LOGFS_INO_MASTER, ino[i], 0);
+		if (ofs < 0) {
+			err = ofs;
+			goto out;
+		}
+		err = stream_put(sb, &s, ino[i], 0, ofs);
+		if (err)
+			goto out;
+	}
+
+	for (level = 1; level <= s.master->di.di_height; level++) {
+		if (!s.block[level])
+			continue;
+		err = stream_flush_level(sb, &s, level);
+		if (err)
+			goto out;
+	}
+out:
+	/* flushed levels are NULL already */
+	for (level = 1; level <= LOGFS_MAX_LEVELS; level++)
+		free(s.block[level]);
+	return err;
+}
+
+static void free_block(void *block, long opaque, u64 bix, size_t index)
+{
+	free(block);
+}
+
 int logfs_file_flush(struct super_block *sb, u64 ino)
 {
 	struct btree_head64 *tree;
+	struct btree_cursor cursor;
 	struct inode *inode;
 	__be64 *iblock;
 	s64 ofs;
@@ -148,22 +296,28 @@ int logfs_file_flush(struct super_block *sb, u64 ino)
 	inode = find_or_create_inode(sb, ino);
 	BUG_ON(!inode);
 
+	/* indirect blocks must not be written before the data they point to */
+	err = logfs_segment_drain(sb);
+	if (err)
+		return err;
+
 	if (inode->di.di_height == 0)
 		return 0;
 
 	for (level = 1; level < inode->di.di_height; level++) {
 		tree = &inode->block_tree[level];
-		for (;;) {
-			bix = btree_last64(tree);
-			iblock = btree_remove64(tree, bix);
-			if (!iblock)
-				break;
+#ifdef BTREE_DEBUG
+		btree_check(&tree->h, &btree_geo64);
+#endif
+		iblock = btree_cursor_last64(&cursor, tree);
+		for ( ; iblock; iblock = btree_cursor_prev(&cursor)) {
+			bix = btree_cursor_key64(&cursor);
 			err = logfs_file_write(sb, ino, bix, level, OBJ_BLOCK,
 					iblock);
 			if (err)
 				return err;
-			free(iblock);
 		}
+		btree_grim_visitor64(tree, 0, free_block);
 	}
 	BUG_ON(level != inode->di.di_height);
 	tree = &inode->block_tree[level];
@@ -0,0 +1,310 @@
+/*
+ * scan.c
+ *
+ * Copyright (c) 2007-2008 Joern Engel <joern@logfs.org>
+ *
+ * License: GPL version 2
+ */
+#define _LARGEFILE64_SOURCE
+#define __USE_FILE_OFFSET64
+#include <asm/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kerncompat.h"
+#include "logfs_abi.h"
+#include "logfs.h"
+#include "fsck.h"
+
+/*
+ * Every segment is checked on its own, so workers simply claim chunks of
+ * consecutive segments until none are left.  A chunk is at least
+ * SCAN_CHUNK bytes, which keeps device reads large and sequential, be it
+ * readahead of the mapping or a single pread().  Results go to fs->seg and
+ * get reported in segment order once all workers are done.
+ */
+#define SCAN_CHUNK	(4 << 20)
+
+struct scan_ctl {
+	struct fsck *fs;
+	pthread_mutex_t lock;
+	u32 next;			/* first segment not claimed yet */
+	u32 chunk_segs;
+	int err;
+};
+
+static int all_bytes(const void *buf, int c, size_t len)
+{
+	const u8 *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (p[i] != c)
+			return 0;
+	return 1;
+}
+
+static void seg_bad(struct seg_info *si, u32 ofs, const char *why)
+{
+	if (si->why)
+		return;
+	si->bad_ofs = ofs;
+	si->why = why;
+}
+
+/* The summary has to list exactly the objects found by the walk */
+static void check_summary(struct fsck *fs, struct seg_info *si, void *seg)
+{
+	struct logfs_segment_summary *ss = seg + fs->segsize - sizeof(*ss);
+	struct logfs_summary_entry *se;
+	struct logfs_object_header *oh;
+	u32 i, n = be32_to_cpu(ss->ss_count);
+	size_t len = n * sizeof(*se) + sizeof(*ss);
+
+	if (be32_to_cpu(ss->ss_magic) != LOGFS_SUMMARY_MAGIC ||
+			len > fs->segsize - si->used_bytes) {
+		seg_bad(si, fs->segsize - sizeof(*ss), "no segment summary");
+		return;
+	}
+	se = seg + fs->segsize - len;
+	if (ss->ss_crc != logfs_crc32(se, len - sizeof(ss->ss_crc), 0)) {
+		seg_bad(si, fs->segsize - len, "bad segment summary crc");
+		return;
+	}
+	if (n != si->objects) {
+		seg_bad(si, fs->segsize - len, "segment summary count");
+		return;
+	}
+	for (i = 0; i < n; i++, se++) {
+		oh = seg + be32_to_cpu(se->ofs);
+		if (be32_to_cpu(se->ofs) >= si->used_bytes ||
+				oh->ino != se->ino || oh->bix != se->bix ||
+				oh->len != se->len || oh->type != se->type) {
+			seg_bad(si, be32_to_cpu(se->ofs),
+					"segment summary mismatch");
+			return;
+		}
+	}
+}
+
+/*
+ * Objects follow each other until the first erased header.  A header that
+ * fails its crc ends the walk, as its length cannot be trusted.  A bad
+ * payload only marks the object.
+ */
+static int scan_ostore(struct fsck *fs, struct seg_info *si, void *seg,
+		u32 segno, struct index_writer *w)
+{
+	struct logfs_segment_header *sh = seg;
+	struct logfs_object_header *oh;
+	u32 pos, len;
+	int err;
+
+	for (pos = LOGFS_SEGMENT_HEADERSIZE;
+			pos + sizeof(*oh) <= fs->segsize; ) {
+		oh = seg + pos;
+		if (all_bytes(oh, 0xff, sizeof(*oh)))
+			break;
+		if (oh->crc != logfs_crc32(oh, LOGFS_OBJECT_HEADERSIZE - 4,
+					4)) {
+			seg_bad(si, pos, "bad object header crc");
+			break;
+		}
+		len = be16_to_cpu(oh->len);
+		if (len > fs->segsize - pos - sizeof(*oh)) {
+			seg_bad(si, pos, "object exceeds segment");
+			break;
+		}
+		if (oh->type < OBJ_BLOCK || oh->type > OBJ_DENTRY)
+			seg_bad(si, pos, "bad object type");
+		if (oh->compr > COMPR_LZ4)
+			seg_bad(si, pos, "bad object compression");
+		if (oh->data_crc != logfs_crc32(oh + 1, len, 0))
+			seg_bad(si, pos, "bad object data crc");
+		if (w) {
+			/* ifile objects live LOGFS_MAX_LEVELS GC levels up */
+			err = index_add(w, be64_to_cpu(oh->ino),
+					be64_to_cpu(oh->bix),
+					si->level % LOGFS_MAX_LEVELS,
+					(u64)segno * fs->segsize + pos,
+					sizeof(*oh) + len, be64_to_cpu(sh->gec));
+			if (err)
+				return err;
+		}
+		si->objects++;
+		pos += sizeof(*oh) + len;
+	}
+	si->used_bytes = pos;
+
+	if (be64_to_cpu(fs->ds.ds_feature_compat) & LOGFS_FEATURE_SUMMARY)
+		check_summary(fs, si, seg);
+	return 0;
+}
+
+static int scan_segment(struct fsck *fs, u32 segno, void *seg,
+		struct index_writer *w)
+{
+	struct logfs_segment_header *sh = seg;
+	struct seg_info *si = fs->seg + segno;
+
+	if (sh->crc != logfs_crc32(sh, LOGFS_SEGMENT_HEADERSIZE, 4)) {
+		/* mkfs only erases the segments it uses */
+		if (all_bytes(sh, 0xff, sizeof(*sh)) ||
+				all_bytes(sh, 0, sizeof(*sh)))
+			si->type = SEG_FREE;
+		else
+			si->type = SEG_UNKNOWN;
+		return 0;
+	}
+	si->type = sh->type;
+	si->level = sh->level;
+	if (be32_to_cpu(sh->segno) != segno && sh->type != SEG_SUPER)
+		seg_bad(si, 0, "segment number mismatch");
+	switch (sh->type) {
+	case SEG_OSTORE:
+		return scan_ostore(fs, si, seg, segno, w);
+	case SEG_SUPER:
+	case SEG_JOURNAL:
+		/* checked by fsck_read_super() and fsck_read_journal() */
+		break;
+	default:
+		seg_bad(si, 0, "bad segment type");
+		si->type = SEG_UNKNOWN;
+		break;
+	}
+	return 0;
+}
+
+static void *scan_worker(void *_ctl)
+{
+	struct scan_ctl *ctl = _ctl;
+	struct fsck *fs = ctl->fs;
+	size_t chunk_len = (size_t)ctl->chunk_segs * fs->segsize;
+	struct index_writer *w = NULL;
+	void *buf = NULL, *chunk;
+	u32 first, n, i;
+	u64 ofs;
+	int err = 0;
+
+	if (!fs->map && posix_memalign(&buf, 4096, chunk_len)) {
+		ctl->err = -ENOMEM;
+		return NULL;
+	}
+	if (fs->index) {
+		w = index_writer_alloc(fs->index);
+		if (!w) {
+			free(buf);
+			ctl->err = -ENOMEM;
+			return NULL;
+		}
+	}
+	for (;;) {
+		pthread_mutex_lock(&ctl->lock);
+		first = ctl->next;
+		n = min(ctl->chunk_segs, fs->no_segs - first);
+		ctl->next += n;
+		pthread_mutex_unlock(&ctl->lock);
+		if (!n || err)
+			break;
+
+		ofs = (u64)first * fs->segsize;
+		if (fs->map)
+			madvise(fs->map + ofs, (size_t)n * fs->segsize,
+					MADV_WILLNEED);
+		chunk = dev_read(fs, ofs, (size_t)n * fs->segsize, buf);
+		if (!chunk) {
+			for (i = 0; i < n; i++)
+				seg_bad(fs->seg + first + i, 0, "read error");
+			continue;
+		}
+		for (i = 0; i < n && !err; i++)
+			err = scan_segment(fs, first + i,
+					chunk + (size_t)i * fs->segsize, w);
+		/* keep the footprint down on large devices */
+		dev_release(fs, ofs, (size_t)n * fs->segsize);
+	}
+	if (!err)
+		err = index_writer_free(w);
+	else
+		index_writer_free(w);
+	if (err)
+		ctl->err = err;
+	free(buf);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int fsck_scan(struct fsck *fs, int threads)
+{
+	struct scan_ctl ctl;
+	pthread_t *tid;
+	u32 segno, count[SEG_UNKNOWN + 1];
+	u64 objects = 0, checked = 0;
+	double t;
+	int i, started;
+
+	fs->seg = calloc(fs->no_segs, sizeof(*fs->seg));
+	tid = calloc(threads, sizeof(*tid));
+	if (!fs->seg || !tid) {
+		free(tid);
+		return -ENOMEM;
+	}
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.fs = fs;
+	ctl.chunk_segs = max(SCAN_CHUNK / fs->segsize, 1u);
+	pthread_mutex_init(&ctl.lock, NULL);
+
+	t = now();
+	for (started = 0; started < threads; started++)
+		if (pthread_create(tid + started, NULL, scan_worker, &ctl))
+			break;
+	if (!started)
+		scan_worker(&ctl);
+	for (i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+	t = now() - t;
+	pthread_mutex_destroy(&ctl.lock);
+	free(tid);
+	if (ctl.err)
+		return ctl.err;
+
+	memset(count, 0, sizeof(count));
+	for (segno = 0; segno < fs->no_segs; segno++) {
+		struct seg_info *si = fs->seg + segno;
+
+		count[si->type]++;
+		objects += si->objects;
+		/* all but ostore segments only get their header looked at */
+		if (si->type == SEG_OSTORE)
+			checked += si->used_bytes;
+		else
+			checked += LOGFS_SEGMENT_HEADERSIZE;
+		if (si->why)
+			fsck_error(fs, "segment %u at 0x%llx: %s\n", segno,
+					(u64)segno * fs->segsize + si->bad_ofs,
+					si->why);
+		else if (si->type == SEG_UNKNOWN)
+			fsck_info(fs, "segment %u: unrecognized header\n",
+					segno);
+	}
+	printf("%u segments: %u ostore, %u journal, %u super, %u free, "
+			"%u unrecognized\n", fs->no_segs, count[SEG_OSTORE],
+			count[SEG_JOURNAL], count[SEG_SUPER],
+			count[SEG_FREE], count[SEG_UNKNOWN]);
+	printf("%llu objects, %llu of %llu MiB checked in %.3fs (%.1f MiB/s, "
+			"%d threads)\n", objects, checked >> 20,
+			((u64)fs->no_segs * fs->segsize) >> 20, t,
+			checked / (t * (1 << 20)), started ? started : 1);
+	return 0;
+}
@@ -51,14 +51,57 @@ u32 get_segment(struct super_block *sb)
 		err = sb->dev_ops->erase(sb, ofs, sb->segsize);
 		if (err) {
 			/* bad segment */
-			sb->segment_entry[segno].ec_level = cpu_to_be32(BADSEG);
-			sb->segment_entry[segno].valid = cpu_to_be32(RESERVED);
+			set_segment_entry(sb, segno, cpu_to_be32(BADSEG),
+					cpu_to_be32(RESERVED));
 			printf("Bad block at 0x%llx\n", ofs);
 		}
 	} while (err);
 	return segno;
 }
 
+/* Room the segment summary takes with @count entries */
+static size_t summary_size(struct super_block *sb, u32 count)
+{
+	if (!(sb->feature_compat & LOGFS_FEATURE_SUMMARY))
+		return 0;
+	return count * sizeof(struct logfs_summary_entry) +
+		sizeof(struct logfs_segment_summary);
+}
+
+static void add_summary(struct super_block *sb, struct logfs_area *area,
+		struct logfs_object_header *oh, u8 level)
+{
+	struct logfs_summary_entry *se;
+
+	if (!area->summary)
+		return;
+	se = area->summary + area->no_summary++;
+	se->ino = oh->ino;
+	se->bix = oh->bix;
+	se->ofs = cpu_to_be32(area->used_bytes);
+	se->len = oh->len;
+	se->level = level;
+	se->type = oh->type;
+}
+
+static void write_summary(struct super_block *sb, struct logfs_area *area)
+{
+	struct logfs_segment_summary *ss;
+	size_t len = summary_size(sb, area->no_summary);
+	void *p = area->buf + sb->segsize - len;
+
+	if (!area->summary)
+		return;
+	BUG_ON(area->used_bytes > sb->segsize - len);
+	memcpy(p, area->summary,
+			area->no_summary * sizeof(struct logfs_summary_entry));
+	ss = area->buf + sb->segsize - sizeof(*ss);
+	ss->ss_magic = cpu_to_be32(LOGFS_SUMMARY_MAGIC);
+	ss->ss_count = cpu_to_be32(area->no_summary);
+	ss->pad = 0;
+	ss->ss_crc = logfs_crc32(p, len - sizeof(ss->ss_crc), 0);
+}
+
 static void __init_area(struct super_block *sb, struct logfs_area *area,
 		u8 level)
 {
@@ -67,6 +110,7 @@ static void __init_area(struct super_block *sb, struct logfs_area *area,
 	memset(area->buf, 0xff, sb->segsize);
 	area->segno = get_segment(sb);
 	area->used_bytes = sizeof(*sh);
+	area->no_summary = 0;
 	sh->pad = 0;
 	sh->type = SEG_OSTORE;
 	sh->level = level;
@@ -76,29 +120,43 @@ static void __init_area(struct super_block *sb, struct logfs_area *area,
 	sh->crc = logfs_crc32(sh, LOGFS_SEGMENT_HEADERSIZE, 4);
 }
 
-static void init_area(struct super_block *sb, struct logfs_area *area,
+static int init_area(struct super_block *sb, struct logfs_area *area,
 		u8 level)
 {
+	u32 max_objects;
+
 	if (area->buf)
-		return;
+		return 0;
 
 	area->buf = malloc(sb->segsize);
+	if (!area->buf)
+		return -ENOMEM;
+	if (sb->feature_compat & LOGFS_FEATURE_SUMMARY) {
+		/* every object costs at least its header plus its entry */
+		max_objects = sb->segsize / (LOGFS_OBJECT_HEADERSIZE +
+				sizeof(struct logfs_summary_entry));
+		area->summary = calloc(max_objects, sizeof(*area->summary));
+		if (!area->summary)
+			return -ENOMEM;
+	}
 	__init_area(sb, area, level);
+	return 0;
 }
 
+/* Writes the first @len bytes of the area, the rest stays erased */
 static int finish_area(struct super_block *sb, struct logfs_area *area,
-		int final, u8 level)
+		int final, u8 level, u32 len)
 {
 	u64 ofs = (u64)area->segno * sb->segsize;
 	int err;
 
-	err = sb->dev_ops->write(sb, ofs, sb->segsize, area->buf);
+	write_summary(sb, area);
+	err = sb->dev_ops->write(sb, ofs, len, area->buf);
 	if (err)
 		return err;
 
-	sb->segment_entry[area->segno].ec_level = ec_level(1, level);
-	sb->segment_entry[area->segno].valid =
-		cpu_to_be32(area->used_bytes - LOGFS_SEGMENT_HEADERSIZE);
+	set_segment_entry(sb, area->segno, ec_level(1, level), cpu_to_be32(
+				area->used_bytes - LOGFS_SEGMENT_HEADERSIZE));
 	if (final)
 		return 0;
 
@@ -140,6 +198,7 @@ s64 logfs_segment_write(struct super_block *sb, void *buf, u8 type,
 	int err;
 	s64 ofs;
 	u16 len = obj_len(sb, type);
+	u8 obj_level = level;
 
 	if (ino == LOGFS_INO_MASTER)
 		level += LOGFS_MAX_LEVELS;
@@ -154,13 +213,17 @@ s64 logfs_segment_write(struct super_block *sb, void *buf, u8 type,
 	oh.crc = logfs_crc32(&oh, LOGFS_OBJECT_HEADERSIZE - 4, 4);
 	oh.data_crc = logfs_crc32(buf, len, 0);
 
-	init_area(sb, area, level);
-	if (area->used_bytes + sizeof(oh) + sb->blocksize > sb->segsize) {
-		err = finish_area(sb, area, 0, level);
+	err = init_area(sb, area, level);
+	if (err)
+		return err;
+	if (area->used_bytes + sizeof(oh) + sb->blocksize +
+			summary_size(sb, area->no_summary + 1) > sb->segsize) {
+		err = finish_area(sb, area, 0, level, sb->segsize);
 		if (err)
 			return err;
 	}
-	ofs = area->segno * sb->segsize + area->used_bytes;
+	ofs = (u64)area->segno * sb->segsize + area->used_bytes;
+	add_summary(sb, area, &oh, obj_level);
 	copybuf(area, &oh, sizeof(oh));
 	copybuf(area, buf, len);
 	err = grow_inode(sb, ino, sizeof(oh) + len);
@@ -169,18 +232,116 @@ s64 logfs_segment_write(struct super_block *sb, void *buf, u8 type,
 	return ofs;
 }
 
+/*
+ * Reorder window.  Data blocks from several files written in an interleaved
+ * fashion would end up interleaved on the medium as well.  Instead they get
+ * buffered here and are written sorted by (ino, bix) once the window is full
+ * or before anything that may point to them gets written.  Each file's blocks
+ * end up physically contiguous, which helps readahead and lets GC free whole
+ * segments when a file is deleted.
+ */
+static int pending_cmp(const void *_a, const void *_b)
+{
+	const struct logfs_pending *a = _a, *b = _b;
+
+	if (a->ino != b->ino)
+		return a->ino < b->ino ? -1 : 1;
+	if (a->bix != b->bix)
+		return a->bix < b->bix ? -1 : 1;
+	return a->seq < b->seq ? -1 : 1;
+}
+
+int logfs_segment_drain(struct super_block *sb)
+{
+	struct logfs_pending *p;
+	u32 i, n = sb->no_pending;
+	s64 ofs;
+
+	if (n == 0)
+		return 0;
+
+	sb->no_pending = 0;
+	qsort(sb->pending, n, sizeof(*p), pending_cmp);
+	for (i = 0; i < n; i++) {
+		p = sb->pending + i;
+		ofs = logfs_segment_write(sb, p->buf, p->type, p->ino, p->bix,
+				0);
+		if (ofs < 0)
+			return ofs;
+		*p->ptr = cpu_to_be64(ofs);
+	}
+	return 0;
+}
+
+int logfs_segment_queue(struct super_block *sb, void *buf, u8 type,
+		u64 ino, u64 bix, __be64 *ptr)
+{
+	struct logfs_pending *p;
+	u32 n = sb->no_pending;
+	int err;
+
+	BUG_ON(!sb->pending_window);
+	if (!sb->pending) {
+		sb->pending = calloc(sb->pending_window, sizeof(*p));
+		sb->pending_buf = malloc((size_t)sb->pending_window *
+				sb->blocksize);
+		if (!sb->pending || !sb->pending_buf)
+			return -ENOMEM;
+	}
+
+	p = sb->pending + n;
+	p->ino = ino;
+	p->bix = bix;
+	p->seq = n;
+	p->type = type;
+	p->buf = sb->pending_buf + (size_t)n * sb->blocksize;
+	p->ptr = ptr;
+	memcpy(p->buf, buf, obj_len(sb, type));
+	sb->no_pending = n + 1;
+
+	if (sb->no_pending == sb->pending_window) {
+		err = logfs_segment_drain(sb);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * Areas the journal may keep open are written up to their last full write
+ * unit.  The journal carries the partial one, and the kernel programs the
+ * erased tail when it appends.  Writing the tail here as well would program
+ * those pages twice on NAND.
+ */
 int flush_segments(struct super_block *sb)
 {
 	struct logfs_area *area;
+	u32 len;
 	int i, err;
 
+	err = logfs_segment_drain(sb);
+	if (err)
+		return err;
+
 	for (i = 0; i < LOGFS_NO_AREAS; i++) {
 		area = sb->area + i;
-		if (area->buf) {
-			err = finish_area(sb, area, 1, i);
-			if (err)
-				return err;
-		}
+		if (!area->buf)
+			continue;
+		len = sb->segsize;
+		if (!(sb->feature_compat & LOGFS_FEATURE_SUMMARY))
+			len = area->used_bytes & ~(sb->writesize - 1);
+		err = finish_area(sb, area, 1, i, len);
+		if (err)
+			return err;
 	}
 	return 0;
 }
+
+/* Writes the rest of an area the journal has no room to keep open */
+int close_area(struct super_block *sb, struct logfs_area *area)
+{
+	u32 len = area->used_bytes & ~(sb->writesize - 1);
+
+	return sb->dev_ops->write(sb, (u64)area->segno * sb->segsize + len,
+			sb->segsize - len, area->buf + len);
+}
@@ -0,0 +1,369 @@
+/*
+ * space.c
+ *
+ * Copyright (c) 2007-2008 Joern Engel <joern@logfs.org>
+ *
+ * License: GPL version 2
+ */
+#define _LARGEFILE64_SOURCE
+#define __USE_FILE_OFFSET64
+#include <asm/types.h>
+#include <errno.h>
+
+#include "kerncompat.h"
+#include "logfs_abi.h"
+#include "logfs.h"
+#include "fsck.h"
+
+/*
+ * Space accounting.  Every object the walk accepts is live and gets charged
+ * to its segment and to the inode owning it, with objects of the inode file
+ * going to the master inode.  Each walk worker counts in a space_count of
+ * its own.  Once the walk is done they get merged and compared against the
+ * segment file with the aliases from the journal applied, di_used_bytes of
+ * every inode, da_used_bytes and ds_used_bytes.
+ */
+#define NO_INO		(~0ull)
+
+struct ino_space {
+	u64 ino;			/* NO_INO if unused */
+	u64 used;			/* live bytes found */
+	u64 recorded;			/* di_used_bytes */
+	int have_inode;
+};
+
+struct space_count {
+	u32 no_segs;
+	u32 segshift;
+	u32 *seg_bytes;
+	struct ino_space *ino;
+	size_t ino_size;		/* power of two */
+	size_t no_ino;
+	struct ino_space *last;		/* most objects belong to the previous */
+	u64 total;
+};
+
+static struct ino_space *alloc_table(size_t size)
+{
+	struct ino_space *table = malloc(size * sizeof(*table));
+	size_t i;
+
+	if (!table)
+		return NULL;
+	for (i = 0; i < size; i++)
+		table[i].ino = NO_INO;
+	return table;
+}
+
+struct space_count *space_alloc(struct fsck *fs)
+{
+	struct space_count *sc = zalloc(sizeof(*sc));
+
+	if (!sc)
+		return NULL;
+	sc->no_segs = fs->no_segs;
+	sc->segshift = fs->ds.ds_segment_shift;
+	sc->seg_bytes = calloc(fs->no_segs, sizeof(*sc->seg_bytes));
+	sc->ino_size = 1024;
+	sc->ino = alloc_table(sc->ino_size);
+	if (!sc->seg_bytes || !sc->ino) {
+		space_free(sc);
+		return NULL;
+	}
+	return sc;
+}
+
+void space_free(struct space_count *sc)
+{
+	if (!sc)
+		return;
+	free(sc->seg_bytes);
+	free(sc->ino);
+	free(sc);
+}
+
+static size_t ino_hash(struct space_count *sc, u64 ino)
+{
+	return (ino * 0x9e3779b97f4a7c15ull) >> 32 & (sc->ino_size - 1);
+}
+
+static struct ino_space *find_slot(struct space_count *sc, u64 ino)
+{
+	size_t i = ino_hash(sc, ino);
+
+	while (sc->ino[i].ino != NO_INO && sc->ino[i].ino != ino)
+		i = (i + 1) & (sc->ino_size - 1);
+	return sc->ino + i;
+}
+
+/* Doubles the table once it is half full */
+static int grow_table(struct space_count *sc)
+{
+	struct ino_space *old = sc->ino, *slot;
+	size_t i, old_size = sc->ino_size;
+
+	sc->ino = alloc_table(2 * old_size);
+	if (!sc->ino) {
+		sc->ino = old;
+		return -ENOMEM;
+	}
+	sc->ino_size = 2 * old_size;
+	for (i = 0; i < old_size; i++) {
+		if (old[i].ino == NO_INO)
+			continue;
+		slot = find_slot(sc, old[i].ino);
+		*slot = old[i];
+	}
+	free(old);
+	sc->last = NULL;
+	return 0;
+}
+
+static struct ino_space *get_ino(struct space_count *sc, u64 ino)
+{
+	struct ino_space *slot;
+
+	if (sc->last && sc->last->ino == ino)
+		return sc->last;
+	if (2 * (sc->no_ino + 1) > sc->ino_size && grow_table(sc))
+		return NULL;
+	slot = find_slot(sc, ino);
+	if (slot->ino == NO_INO) {
+		memset(slot, 0, sizeof(*slot));
+		slot->ino = ino;
+		sc->no_ino++;
+	}
+	sc->last = slot;
+	return slot;
+}
+
+/* Charges a live object of @len bytes at @ofs to inode @ino */
+int space_add(struct space_count *sc, u64 ino, u64 ofs, u32 len)
+{
+	struct ino_space *slot = get_ino(sc, ino);
+
+	if (!slot)
+		return -ENOMEM;
+	slot->used += len;
+	sc->seg_bytes[ofs >> sc->segshift] += len;
+	sc->total += len;
+	return 0;
+}
+
+/* Records di_used_bytes of inode @ino */
+int space_inode(struct space_count *sc, u64 ino, u64 used_bytes)
+{
+	struct ino_space *slot = get_ino(sc, ino);
+
+	if (!slot)
+		return -ENOMEM;
+	slot->recorded = used_bytes;
+	slot->have_inode = 1;
+	return 0;
+}
+
+/* Adds the counts of @src to @dst and frees @src */
+int space_merge(struct space_count *dst, struct space_count *src)
+{
+	struct ino_space *slot, *s;
+	size_t i;
+
+	for (i = 0; i < dst->no_segs; i++)
+		dst->seg_bytes[i] += src->seg_bytes[i];
+	dst->total += src->total;
+	for (i = 0; i < src->ino_size; i++) {
+		s = src->ino + i;
+		if (s->ino == NO_INO)
+			continue;
+		slot = get_ino(dst, s->ino);
+		if (!slot)
+			return -ENOMEM;
+		slot->used += s->used;
+		if (s->have_inode) {
+			slot->recorded = s->recorded;
+			slot->have_inode = 1;
+		}
+	}
+	space_free(src);
+	return 0;
+}
+
+static int ino_cmp(const void *_a, const void *_b)
+{
+	const struct ino_space *a = _a, *b = _b;
+
+	if (a->ino != b->ino)
+		return a->ino < b->ino ? -1 : 1;
+	return 0;
+}
+
+/*
+ * The segment file as of the last commit: its blocks with the aliases from
+ * the journal applied.  The walk has already checked that the index points
+ * to the very blocks the segment file inode does.
+ */
+static struct logfs_segment_entry *read_segfile(struct fsck *fs)
+{
+	struct logfs_segment_entry *se;
+	struct logfs_object_header *oh;
+	struct logfs_obj_alias *oa;
+	const struct obj_entry *e;
+	u32 per_block = fs->blocksize / sizeof(*se);
+	u64 bix, segno;
+	size_t i;
+	void *buf;
+	int ret = -EIO;
+
+	se = calloc(ALIGN(fs->no_segs, per_block), sizeof(*se));
+	buf = malloc(LOGFS_OBJECT_HEADERSIZE + fs->blocksize);
+	if (!se || !buf) {
+		free(se);
+		free(buf);
+		return NULL;
+	}
+	for (bix = 0; bix * per_block < fs->no_segs; bix++) {
+		e = index_lookup(fs->index, LOGFS_INO_SEGFILE, bix, 0);
+		if (!e)
+			continue;
+		/* scan only bounds the length by the segment end */
+		if (e->len < sizeof(*oh) ||
+				e->len > LOGFS_OBJECT_HEADERSIZE + fs->blocksize) {
+			fsck_error(fs, "segment file: block %llu at 0x%llx has "
+					"bad length %u\n", bix, e->ofs, e->len);
+			continue;
+		}
+		oh = dev_read(fs, e->ofs, e->len, buf);
+		if (oh)
+			ret = logfs_uncompress(oh + 1, se + bix * per_block,
+					e->len - sizeof(*oh), fs->blocksize,
+					oh->compr);
+		if (!oh || ret != fs->blocksize)
+			fsck_error(fs, "segment file: cannot read block %llu "
+					"at 0x%llx\n", bix, e->ofs);
+	}
+	free(buf);
+
+	for (i = 0; i < fs->no_alias; i++) {
+		oa = fs->alias + i;
+		if (be64_to_cpu(oa->ino) != LOGFS_INO_SEGFILE || oa->level) {
+			fsck_info(fs, "alias %zu: inode %llu level %u not "
+					"checked\n", i,
+					(u64)be64_to_cpu(oa->ino), oa->level);
+			continue;
+		}
+		segno = be64_to_cpu(oa->bix) * per_block +
+			be16_to_cpu(oa->child_no);
+		if (be16_to_cpu(oa->child_no) >= per_block ||
+				segno >= fs->no_segs) {
+			fsck_error(fs, "alias %zu: segment file block %llu "
+					"entry %u is beyond the filesystem\n",
+					i, (u64)be64_to_cpu(oa->bix),
+					be16_to_cpu(oa->child_no));
+			continue;
+		}
+		/* a segment entry is the big endian ec_level:valid */
+		memcpy(se + segno, &oa->val, sizeof(*se));
+	}
+	return se;
+}
+
+static u64 check_segments(struct fsck *fs, struct space_count *sc,
+		struct logfs_segment_entry *se)
+{
+	struct seg_info *si;
+	u32 segno, valid, ec_level;
+	u64 divergent = 0;
+
+	for (segno = 0; segno < fs->no_segs; segno++) {
+		si = fs->seg + segno;
+		valid = be32_to_cpu(se[segno].valid);
+		ec_level = be32_to_cpu(se[segno].ec_level);
+		if (valid == RESERVED) {
+			if (si->type == SEG_OSTORE) {
+				fsck_error(fs, "segment %u: reserved in the "
+						"segment file, but holds "
+						"objects, %u bytes live\n",
+						segno, sc->seg_bytes[segno]);
+				divergent++;
+			}
+			continue;
+		}
+		if (si->type == SEG_JOURNAL) {
+			fsck_error(fs, "segment %u: journal segment not "
+					"reserved in the segment file\n",
+					segno);
+			divergent++;
+		}
+		if (valid != sc->seg_bytes[segno]) {
+			fsck_error(fs, "segment %u: %u valid bytes in the "
+					"segment file, %u live\n", segno,
+					valid, sc->seg_bytes[segno]);
+			divergent++;
+		}
+		if (si->type == SEG_OSTORE && (ec_level & 0xf) != si->level) {
+			fsck_error(fs, "segment %u: level %u in the segment "
+					"file, %u in the segment header\n",
+					segno, ec_level & 0xf, si->level);
+			divergent++;
+		}
+	}
+	return divergent;
+}
+
+/* Sorts the table by inode number, it is no hash table afterwards */
+static u64 check_inodes(struct fsck *fs, struct space_count *sc)
+{
+	struct ino_space *slot;
+	u64 divergent = 0;
+	size_t i, n;
+
+	for (i = n = 0; i < sc->ino_size; i++)
+		if (sc->ino[i].ino != NO_INO)
+			sc->ino[n++] = sc->ino[i];
+	qsort(sc->ino, n, sizeof(*sc->ino), ino_cmp);
+	sc->last = NULL;
+	for (i = 0; i < n; i++) {
+		slot = sc->ino + i;
+		if (!slot->have_inode || slot->used == slot->recorded)
+			continue;
+		fsck_error(fs, "inode %llu: %llu used bytes recorded, %llu "
+				"live\n", slot->ino, slot->recorded, slot->used);
+		divergent++;
+	}
+	return divergent;
+}
+
+/* Compares the merged counts in fs->space with what the filesystem says */
+int fsck_check_space(struct fsck *fs)
+{
+	struct space_count *sc = fs->space;
+	struct logfs_segment_entry *se;
+	u64 divergent;
+	u32 segno, live_segs = 0;
+
+	/* the master inode lives in the journal */
+	if (fs->have_anchor && space_inode(sc, LOGFS_INO_MASTER,
+				be64_to_cpu(fs->anchor.da_used_bytes)))
+		return -ENOMEM;
+	se = read_segfile(fs);
+	if (!se)
+		return -ENOMEM;
+	divergent = check_segments(fs, sc, se);
+	free(se);
+	divergent += check_inodes(fs, sc);
+	if (fs->have_dynsb &&
+			be64_to_cpu(fs->dynsb.ds_used_bytes) != sc->total) {
+		fsck_error(fs, "dynsb: %llu used bytes recorded, %llu live\n",
+				(u64)be64_to_cpu(fs->dynsb.ds_used_bytes),
+				sc->total);
+		divergent++;
+	}
+
+	for (segno = 0; segno < fs->no_segs; segno++)
+		if (sc->seg_bytes[segno])
+			live_segs++;
+	printf("%llu live bytes in %u segments, %zu inodes, %llu accounting "
+			"error(s)\n", sc->total, live_segs, sc->no_ino,
+			divergent);
+	return 0;
+}
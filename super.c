@@ -0,0 +1,347 @@
+/*
+ * super.c
+ *
+ * Copyright (c) 2007-2008 Joern Engel <joern@logfs.org>
+ *
+ * License: GPL version 2
+ */
+#define _LARGEFILE64_SOURCE
+#define __USE_FILE_OFFSET64
+#include <asm/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "kerncompat.h"
+#include <mtd/mtd-abi.h>
+#include "logfs_abi.h"
+#include "logfs.h"
+#include "fsck.h"
+
+/* A superblock copy may sit in any of the first or last 64 segments */
+#define SUPER_SEARCH	64
+
+static int safe_pread(int fd, char *buf, size_t size, u64 ofs)
+{
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = pread(fd, buf, size, ofs);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EIO;
+		buf += ret;
+		ofs += ret;
+		size -= ret;
+	}
+	return 0;
+}
+
+int fsck_open(struct fsck *fs, const char *name)
+{
+	struct mtd_info_user mtd;
+	struct stat stat;
+	int err;
+
+	fs->fd = open(name, O_RDONLY | O_LARGEFILE);
+	if (fs->fd == -1)
+		return -errno;
+
+	err = fstat(fs->fd, &stat);
+	if (err)
+		return -errno;
+
+	switch (stat.st_mode & S_IFMT) {
+	case S_IFREG:
+		fs->devsize = stat.st_size;
+		break;
+	case S_IFBLK:
+		err = ioctl(fs->fd, BLKGETSIZE64, &fs->devsize);
+		if (err)
+			return -errno;
+		break;
+	case S_IFCHR:
+		if (major(stat.st_rdev) != 90)
+			return -ENODEV;
+		err = ioctl(fs->fd, MEMGETINFO, &mtd);
+		if (err)
+			return -errno;
+		fs->devsize = mtd.size;
+		fs->erasesize = mtd.erasesize;
+		return 0;
+	default:
+		return -ENODEV;
+	}
+
+	if (fs->devsize == 0)
+		return -EINVAL;
+	/* private, so dev_patch() can write the few pages it touches */
+	fs->map = mmap(NULL, fs->devsize, PROT_READ, MAP_PRIVATE, fs->fd, 0);
+	if (fs->map == MAP_FAILED) {
+		/* pread works everywhere */
+		fs->map = NULL;
+		return 0;
+	}
+	madvise(fs->map, fs->devsize, MADV_RANDOM);
+	return 0;
+}
+
+/*
+ * Returns a pointer to @len bytes at @ofs.  These are either mapped or read
+ * into @buf, so callers must not write through the pointer.
+ */
+void *dev_read(struct fsck *fs, u64 ofs, size_t len, void *buf)
+{
+	struct dev_patch *p;
+	u64 start, end;
+	int i;
+
+	if (ofs > fs->devsize || len > fs->devsize - ofs)
+		return NULL;
+	if (fs->map)
+		return fs->map + ofs;
+	if (safe_pread(fs->fd, buf, len, ofs))
+		return NULL;
+	for (i = 0; i < fs->no_patch; i++) {
+		p = fs->patch + i;
+		start = max(ofs, p->ofs);
+		end = min(ofs + len, p->ofs + p->len);
+		if (start < end)
+			memcpy(buf + start - ofs, p->data + start - p->ofs,
+					end - start);
+	}
+	return buf;
+}
+
+/*
+ * The partially filled write unit of an open area only exists in the
+ * journal, the device is still erased there.  Lays @len bytes of @data over
+ * the device at @ofs for all later dev_read() calls.
+ */
+int dev_patch(struct fsck *fs, u64 ofs, const void *data, u32 len)
+{
+	struct dev_patch *p = fs->patch + fs->no_patch;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	u64 start, end;
+
+	if (!len)
+		return 0;
+	if (ofs > fs->devsize || len > fs->devsize - ofs ||
+			fs->no_patch == ARRAY_SIZE(fs->patch))
+		return -EINVAL;
+	p->data = malloc(len);
+	if (!p->data)
+		return -ENOMEM;
+	memcpy(p->data, data, len);
+	p->ofs = ofs;
+	p->len = len;
+	fs->no_patch++;
+	if (!fs->map)
+		return 0;
+	start = ofs & ~(pagesize - 1);
+	end = ALIGN(ofs + len, pagesize);
+	if (mprotect(fs->map + start, end - start, PROT_READ | PROT_WRITE))
+		return -errno;
+	memcpy(fs->map + ofs, data, len);
+	mprotect(fs->map + start, end - start, PROT_READ);
+	return 0;
+}
+
+/*
+ * Drops the mapped pages of a range that has been looked at.  Pages written
+ * by dev_patch() would be lost, so ranges holding one are kept.
+ */
+void dev_release(struct fsck *fs, u64 ofs, size_t len)
+{
+	struct dev_patch *p;
+	int i;
+
+	if (!fs->map)
+		return;
+	for (i = 0; i < fs->no_patch; i++) {
+		p = fs->patch + i;
+		if (p->ofs < ofs + len && ofs < p->ofs + p->len)
+			return;
+	}
+	madvise(fs->map + ofs, len, MADV_DONTNEED);
+}
+
+/* Returns NULL if the superblock at @ofs is valid, the reason otherwise */
+static const char *check_super(struct fsck *fs, u64 ofs,
+		struct logfs_disk_super *ds)
+{
+	struct logfs_disk_super buf, *p;
+
+	p = dev_read(fs, ofs, sizeof(*p), &buf);
+	if (!p)
+		return "cannot read";
+	if (be64_to_cpu(p->ds_magic) != LOGFS_MAGIC)
+		return "bad magic";
+	if (p->ds_sh.crc != logfs_crc32(&p->ds_sh, LOGFS_SEGMENT_HEADERSIZE,
+				4))
+		return "bad segment header crc";
+	if (p->ds_sh.type != SEG_SUPER)
+		return "bad segment type";
+	if (p->ds_crc != logfs_crc32(p, sizeof(*p),
+				LOGFS_SEGMENT_HEADERSIZE + 12))
+		return "bad crc";
+	memcpy(ds, p, sizeof(*ds));
+	return NULL;
+}
+
+/* Looks for any valid copy, so the geometry is known */
+static int find_super(struct fsck *fs, u64 *ofs)
+{
+	struct logfs_disk_super ds;
+	u64 step = fs->erasesize;
+	int i, shift;
+
+	/* 1st copy: beginning of the device or first good eraseblock */
+	for (i = 0; i < (step ? SUPER_SEARCH : 1); i++) {
+		*ofs = i * step;
+		if (!check_super(fs, *ofs, &ds))
+			return 0;
+	}
+
+	/* 2nd copy: 4KiB before the end of the last good segment */
+	if (step) {
+		for (i = 1; i <= SUPER_SEARCH; i++) {
+			if (fs->devsize < i * step)
+				break;
+			*ofs = fs->devsize - (i - 1) * step - 0x1000;
+			if (!check_super(fs, *ofs, &ds))
+				return 0;
+		}
+		return -EINVAL;
+	}
+	for (shift = 13; shift <= 30; shift++) {
+		if ((fs->devsize >> shift) < 2)
+			break;
+		*ofs = (((fs->devsize >> shift) - 1) << shift) - 0x1000;
+		if (!check_super(fs, *ofs, &ds))
+			return 0;
+	}
+	return -EINVAL;
+}
+
+static int check_geometry(struct fsck *fs)
+{
+	struct logfs_disk_super *ds = &fs->ds;
+	u64 fssize = be64_to_cpu(ds->ds_filesystem_size);
+	u64 incompat = be64_to_cpu(ds->ds_feature_incompat);
+	u32 segno;
+	int i, k;
+
+	if (ds->ds_block_shift < 12 || ds->ds_block_shift > 15 ||
+			ds->ds_segment_shift <= ds->ds_block_shift ||
+			ds->ds_segment_shift > 30 ||
+			ds->ds_write_shift > ds->ds_segment_shift) {
+		fsck_error(fs, "superblock: bad shifts %u/%u/%u\n",
+				ds->ds_segment_shift, ds->ds_block_shift,
+				ds->ds_write_shift);
+		return -EINVAL;
+	}
+	fs->segsize = 1 << ds->ds_segment_shift;
+	fs->blocksize = 1 << ds->ds_block_shift;
+	fs->writesize = 1 << ds->ds_write_shift;
+	fs->no_segs = fssize >> ds->ds_segment_shift;
+	/* mkfs leaves ds_segment_size unset */
+	if (ds->ds_segment_size &&
+			be32_to_cpu(ds->ds_segment_size) != fs->segsize)
+		fsck_error(fs, "superblock: segment size %u, shift %u\n",
+				be32_to_cpu(ds->ds_segment_size),
+				ds->ds_segment_shift);
+	if (fssize > fs->devsize) {
+		fsck_error(fs, "superblock: filesystem size %llu exceeds "
+				"device size %llu\n", fssize, fs->devsize);
+		return -EINVAL;
+	}
+	if (incompat & ~LOGFS_FEATURES_INCOMPAT) {
+		fsck_error(fs, "superblock: unknown incompat features "
+				"0x%llx\n", incompat & ~LOGFS_FEATURES_INCOMPAT);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < 2; i++) {
+		fs->sb_ofs[i] = be64_to_cpu(ds->ds_super_ofs[i]);
+		if (fs->sb_ofs[i] + sizeof(*ds) > fssize)
+			fsck_error(fs, "superblock: copy %d at 0x%llx is beyond "
+					"the filesystem\n", i, fs->sb_ofs[i]);
+	}
+
+	fs->no_journal_segs = 0;
+	for (i = 0; i < LOGFS_JOURNAL_SEGS; i++) {
+		segno = be32_to_cpu(ds->ds_journal_seg[i]);
+		if (!segno)
+			continue;
+		if (segno >= fs->no_segs) {
+			fsck_error(fs, "superblock: journal segment %u is "
+					"beyond the filesystem\n", segno);
+			continue;
+		}
+		for (k = 0; k < fs->no_journal_segs; k++)
+			if (fs->journal_seg[k] == segno)
+				break;
+		if (k < fs->no_journal_segs) {
+			fsck_error(fs, "superblock: journal segment %u listed "
+					"twice\n", segno);
+			continue;
+		}
+		fs->journal_seg[fs->no_journal_segs++] = segno;
+	}
+	if (!fs->no_journal_segs) {
+		fsck_error(fs, "superblock: no journal segments\n");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Both superblock copies are located through ds_super_ofs of whichever
+ * copy is found first and have to be valid and identical.  A single valid
+ * copy is enough to continue.
+ */
+int fsck_read_super(struct fsck *fs)
+{
+	struct logfs_disk_super ds;
+	const char *why;
+	u64 ofs;
+	int i, err, good = 0;
+
+	err = find_super(fs, &ofs);
+	if (err) {
+		fsck_error(fs, "no valid superblock found\n");
+		return err;
+	}
+	check_super(fs, ofs, &fs->ds);
+	err = check_geometry(fs);
+	if (err)
+		return err;
+
+	for (i = 0; i < 2; i++) {
+		why = check_super(fs, fs->sb_ofs[i], &ds);
+		if (!why && memcmp(&ds, &fs->ds, sizeof(ds)))
+			why = "differs from other copy";
+		if (why) {
+			fsck_error(fs, "superblock %d at 0x%llx: %s\n", i,
+					fs->sb_ofs[i], why);
+			continue;
+		}
+		fsck_info(fs, "superblock %d at 0x%llx: ok\n", i,
+				fs->sb_ofs[i]);
+		good++;
+	}
+	if (!good && ofs != fs->sb_ofs[0] && ofs != fs->sb_ofs[1])
+		fsck_error(fs, "using stray superblock at 0x%llx\n", ofs);
+	return 0;
+}
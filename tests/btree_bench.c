@@ -0,0 +1,252 @@
+/*
+ * btree_bench.c	- single-threaded btree microbenchmark
+ *
+ * License: GPLv2
+ *
+ * Times insert, lookup, last, visit, merge and remove for the geo32, geo64
+ * and geo128 instances, with trees of 1e3 entries and every power of ten
+ * up to the limit given with -n.  Results are in nanoseconds per entry.
+ * Key orders:
+ *
+ * seq		- ascending
+ * rand		- a random permutation, every key unique
+ * adv		- descending, with 128bit keys only differing in their second
+ *		  half, and removed in an order that leaves every leaf half
+ *		  empty before the rest follows, so removes keep rebalancing
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../btree.h"
+
+enum { KEYS_SEQ, KEYS_RAND, KEYS_ADV, NO_KEY_ORDERS };
+
+static const char *key_orders[] = { "seq", "rand", "adv" };
+
+struct instance {
+	const char *name;
+	struct btree_geo *geo;
+	void *(*lookup)(struct btree_head *head, unsigned long *key);
+	int (*insert)(struct btree_head *head, unsigned long *key, void *val);
+	void *(*remove)(struct btree_head *head, unsigned long *key);
+	unsigned long *(*last)(struct btree_head *head);
+};
+
+static struct instance instances[] = {
+	{ "geo32", &btree_geo32, btree_lookup_geo32, btree_insert_geo32,
+		btree_remove_geo32, btree_last_geo32 },
+	{ "geo64", &btree_geo64, btree_lookup_geo64, btree_insert_geo64,
+		btree_remove_geo64, btree_last_geo64 },
+	{ "geo128", &btree_geo128, btree_lookup_geo128, btree_insert_geo128,
+		btree_remove_geo128, btree_last_geo128 },
+};
+
+static int nodesize = 512;
+static struct btree_pool pool;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* A bijection on 32 or 64 bits, so random keys never repeat */
+static u64 mix(u64 x, int bits)
+{
+	u64 mask = bits == 64 ? ~0ull : (1ull << bits) - 1;
+
+	x = (x * 0x9e3779b97f4a7c15ull) & mask;
+	x ^= x >> (bits / 2);
+	x = (x * 0xbf58476d1ce4e5b9ull) & mask;
+	x ^= x >> (bits / 2 - 3);
+	return x;
+}
+
+static void make_key(struct instance *in, int order, size_t i, size_t n,
+		unsigned long *key)
+{
+	int bits = in->geo == &btree_geo32 ? 32 : 64;
+
+	switch (order) {
+	case KEYS_SEQ:
+		key[0] = i;
+		key[1] = 0;
+		break;
+	case KEYS_RAND:
+		key[0] = mix(i, bits);
+		key[1] = mix(i ^ 0x5555, bits);
+		break;
+	default:
+		key[0] = in->geo->keylen > 1 ? 0x1234 : n - i;
+		key[1] = n - i;
+		break;
+	}
+}
+
+/* Remove order for adv, odd insert positions first */
+static size_t remove_index(int order, size_t i, size_t n)
+{
+	size_t half = n / 2;
+
+	if (order != KEYS_ADV)
+		return i;
+	return i < half ? 2 * i + 1 : 2 * (i - half);
+}
+
+static void visit(void *elem, long opaque, unsigned long *key, size_t index,
+		void *func2)
+{
+	*(unsigned long *)opaque += (unsigned long)elem;
+}
+
+static void init_tree(struct btree_head *head)
+{
+	btree_init_nodesize(head, nodesize);
+	btree_set_pool(head, &pool);
+}
+
+static void bench(struct instance *in, int order, size_t n)
+{
+	int keylen = in->geo->keylen;
+	unsigned long *keys, sum = 0, dup[2];
+	struct btree_head head, victim;
+	double t, t_ins, t_look, t_last, t_visit, t_merge, t_rem;
+	size_t i, k;
+
+	keys = malloc(n * keylen * sizeof(long));
+	if (!keys) {
+		printf("%-6s %-4s %10zu  out of memory\n", in->name,
+				key_orders[order], n);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		unsigned long key[2];
+
+		make_key(in, order, i, n, key);
+		memcpy(keys + i * keylen, key, keylen * sizeof(long));
+	}
+
+	btree_pool_init(&pool, nodesize);
+	init_tree(&head);
+	t = now();
+	for (i = 0; i < n; i++)
+		if (in->insert(&head, keys + i * keylen, (void *)(i + 1)))
+			goto oom;
+	t_ins = now() - t;
+
+	t = now();
+	for (i = 0; i < n; i++)
+		sum += (unsigned long)in->lookup(&head, keys + i * keylen);
+	t_look = now() - t;
+
+	t = now();
+	for (i = 0; i < n; i++)
+		sum += *in->last(&head);
+	t_last = now() - t;
+
+	t = now();
+	btree_visitor(&head, in->geo, (long)&sum, visit, visit);
+	t_visit = now() - t;
+
+	t = now();
+	for (i = 0; i < n; i++) {
+		k = remove_index(order, i, n);
+		sum += (unsigned long)in->remove(&head, keys + k * keylen);
+	}
+	t_rem = now() - t;
+
+	/* two trees with every other key merged into one */
+	init_tree(&victim);
+	for (i = 0; i < n; i++)
+		if (in->insert(i & 1 ? &victim : &head, keys + i * keylen,
+					(void *)(i + 1)))
+			goto oom;
+	t = now();
+	if (btree_merge(&head, &victim, in->geo, dup))
+		goto oom;
+	t_merge = now() - t;
+	btree_grim_visitor(&head, in->geo, 0, NULL, NULL);
+
+	printf("%-6s %-4s %10zu %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+			in->name, key_orders[order], n, t_ins / n * 1e9,
+			t_look / n * 1e9, t_last / n * 1e9, t_visit / n * 1e9,
+			t_merge / n * 1e9, t_rem / n * 1e9);
+	/* keep the compiler from dropping the lookups */
+	if (sum == 42)
+		printf("\n");
+	btree_pool_destroy(&pool);
+	free(keys);
+	return;
+oom:
+	printf("%-6s %-4s %10zu  out of memory\n", in->name, key_orders[order],
+			n);
+	btree_pool_destroy(&pool);
+	free(keys);
+}
+
+static void usage(void)
+{
+	printf(
+"btree_bench <options>\n"
+"\n"
+"Options:\n"
+"  -b          node size in bytes (default: 512)\n"
+"  -g          only this instance: geo32, geo64 or geo128\n"
+"  -k          only this key order: seq, rand or adv\n"
+"  -n          largest tree, rounded down to a power of ten\n"
+"              (default: 1000000, at most 100000000)\n"
+"\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *only_geo = NULL, *only_keys = NULL;
+	size_t n, max = 1000000;
+	int c, g, order;
+
+	while ((c = getopt(argc, argv, "b:g:hk:n:")) != -1) {
+		switch (c) {
+		case 'b':
+			nodesize = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			only_geo = optarg;
+			break;
+		case 'k':
+			only_keys = optarg;
+			break;
+		case 'n':
+			max = strtod(optarg, NULL);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	if (max > 100000000)
+		max = 100000000;
+
+	printf("%-6s %-4s %10s %8s %8s %8s %8s %8s %8s\n", "tree", "keys",
+			"entries", "insert", "lookup", "last", "visit",
+			"merge", "remove");
+	for (g = 0; g < ARRAY_SIZE(instances); g++) {
+		if (only_geo && strcmp(only_geo, instances[g].name))
+			continue;
+		for (order = 0; order < NO_KEY_ORDERS; order++) {
+			if (only_keys && strcmp(only_keys, key_orders[order]))
+				continue;
+			for (n = 1000; n <= max; n *= 10)
+				bench(instances + g, order, n);
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,585 @@
+/*
+ * btree_fuzz.c	- differential test of btree against a sorted array
+ *
+ * License: GPLv2
+ *
+ * Each run picks a geometry, node size, finger and pool at random and
+ * applies random inserts, removes, lookups, merges, bulk loads and cursor
+ * walks to the tree and to a sorted array modelling it.  Results have to
+ * agree, and btree_check() has to pass after every step.  Operations go
+ * through the generic functions or the fixed-geometry instances at random.
+ * The parallel visitors run with up to MAX_THREADS threads, and the tree
+ * of each run is torn down by the parallel grim visitor at its end.
+ *
+ * A failure prints the seed of its run, "-s <seed> -r 1" replays it.
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BTREE_DEBUG
+#include "../btree.h"
+
+#define MAX_LOAD	20000
+#define MAX_MERGE	2000
+#define MAX_THREADS	9
+
+struct ent {
+	unsigned long key[2];
+	void *val;
+};
+
+struct fuzz {
+	u64 seed, run_seed;
+	unsigned long step;
+	const char *op;
+
+	/* tree under test */
+	struct btree_geo *geo;
+	int keylen;
+	int nodesize;
+	struct btree_head head;
+	struct btree_finger finger;
+	struct btree_pool pool;
+	int use_pool;
+	void *(*lookup)(struct btree_head *head, unsigned long *key);
+	int (*insert)(struct btree_head *head, unsigned long *key, void *val);
+	void *(*remove)(struct btree_head *head, unsigned long *key);
+	unsigned long *(*last)(struct btree_head *head);
+
+	/* the model, sorted by key */
+	struct ent *ent;
+	size_t no_ent, size;
+	unsigned long range;
+	unsigned long next_val;
+};
+
+static const int nodesizes[] = { 128, 256, 512, 1024, 4096 };
+
+static u64 rnd(struct fuzz *f)
+{
+	f->seed ^= f->seed << 13;
+	f->seed ^= f->seed >> 7;
+	f->seed ^= f->seed << 17;
+	return f->seed;
+}
+
+static void fail(struct fuzz *f, const char *why)
+{
+	fprintf(stderr, "btree_fuzz: seed %llu, step %lu, %s: %s\n",
+			f->run_seed, f->step, f->op, why);
+	exit(EXIT_FAILURE);
+}
+
+static int keycmp(struct fuzz *f, const unsigned long *k1,
+		const unsigned long *k2)
+{
+	int i;
+
+	for (i = 0; i < f->keylen; i++) {
+		if (k1[i] < k2[i])
+			return -1;
+		if (k1[i] > k2[i])
+			return 1;
+	}
+	return 0;
+}
+
+/* Index of the first entry not below @key */
+static size_t find(struct fuzz *f, unsigned long *key, int *found)
+{
+	size_t lo = 0, hi = f->no_ent, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (keycmp(f, f->ent[mid].key, key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*found = lo < f->no_ent && !keycmp(f, f->ent[lo].key, key);
+	return lo;
+}
+
+static void model_insert(struct fuzz *f, size_t i, unsigned long *key,
+		void *val)
+{
+	if (f->no_ent == f->size) {
+		f->size = f->size ? 2 * f->size : 1024;
+		f->ent = realloc(f->ent, f->size * sizeof(*f->ent));
+		if (!f->ent)
+			fail(f, "out of memory");
+	}
+	memmove(f->ent + i + 1, f->ent + i, (f->no_ent - i) * sizeof(*f->ent));
+	memset(f->ent[i].key, 0, sizeof(f->ent[i].key));
+	memcpy(f->ent[i].key, key, f->keylen * sizeof(long));
+	f->ent[i].val = val;
+	f->no_ent++;
+}
+
+static void model_remove(struct fuzz *f, size_t i)
+{
+	f->no_ent--;
+	memmove(f->ent + i, f->ent + i + 1, (f->no_ent - i) * sizeof(*f->ent));
+}
+
+static void *new_val(struct fuzz *f)
+{
+	f->next_val += 2;
+	return (void *)(uintptr_t)f->next_val;
+}
+
+static void random_key(struct fuzz *f, unsigned long *key)
+{
+	key[0] = rnd(f) % f->range;
+	key[1] = f->keylen > 1 ? rnd(f) % 4 : 0;
+}
+
+/* Half of the time a key that is present */
+static void pick_key(struct fuzz *f, unsigned long *key)
+{
+	if (f->no_ent && rnd(f) & 1)
+		memcpy(key, f->ent[rnd(f) % f->no_ent].key, 2 * sizeof(long));
+	else
+		random_key(f, key);
+}
+
+static void op_lookup(struct fuzz *f)
+{
+	unsigned long key[2];
+	size_t i;
+	int found;
+	void *val;
+
+	f->op = "lookup";
+	pick_key(f, key);
+	i = find(f, key, &found);
+	val = rnd(f) & 1 ? btree_lookup(&f->head, f->geo, key) :
+		f->lookup(&f->head, key);
+	if (val != (found ? f->ent[i].val : NULL))
+		fail(f, "wrong value");
+}
+
+static void op_insert(struct fuzz *f)
+{
+	unsigned long key[2];
+	size_t i;
+	int found, err;
+	void *val;
+
+	f->op = "insert";
+	random_key(f, key);
+	i = find(f, key, &found);
+	/* two identical keys are not allowed */
+	if (found)
+		return;
+	val = new_val(f);
+	err = rnd(f) & 1 ? btree_insert(&f->head, f->geo, key, val) :
+		f->insert(&f->head, key, val);
+	if (err)
+		fail(f, "insert failed");
+	model_insert(f, i, key, val);
+}
+
+static void op_remove(struct fuzz *f)
+{
+	unsigned long key[2];
+	size_t i;
+	int found;
+	void *val;
+
+	f->op = "remove";
+	pick_key(f, key);
+	i = find(f, key, &found);
+	val = rnd(f) & 1 ? btree_remove(&f->head, f->geo, key) :
+		f->remove(&f->head, key);
+	if (val != (found ? f->ent[i].val : NULL))
+		fail(f, "wrong value");
+	if (found)
+		model_remove(f, i);
+}
+
+static void op_last(struct fuzz *f)
+{
+	unsigned long *key;
+
+	f->op = "last";
+	key = rnd(f) & 1 ? btree_last(&f->head, f->geo) : f->last(&f->head);
+	if (!key != !f->no_ent)
+		fail(f, "wrong emptiness");
+	if (key && keycmp(f, key, f->ent[f->no_ent - 1].key))
+		fail(f, "wrong key");
+}
+
+static void init_tree(struct fuzz *f, struct btree_head *head, int nodesize,
+		int use_pool)
+{
+	btree_init_nodesize(head, nodesize);
+	if (use_pool)
+		btree_set_pool(head, &f->pool);
+}
+
+/* Merges a tree of keys not yet present, possibly of another node size */
+static void op_merge(struct fuzz *f)
+{
+	struct btree_head victim;
+	unsigned long key[2], dup[2];
+	size_t i, n, count;
+	int found, nodesize, same;
+
+	f->op = "merge";
+	same = rnd(f) & 1;
+	nodesize = same ? f->nodesize :
+		nodesizes[rnd(f) % ARRAY_SIZE(nodesizes)];
+	init_tree(f, &victim, nodesize, same && f->use_pool);
+	count = rnd(f) & 7 ? rnd(f) % 64 : rnd(f) % MAX_MERGE;
+	/* the victim gets its entries in the model right away */
+	for (n = 0; n < count; n++) {
+		random_key(f, key);
+		i = find(f, key, &found);
+		if (found)
+			continue;
+		model_insert(f, i, key, new_val(f));
+		if (btree_insert(&victim, f->geo, key, f->ent[i].val))
+			fail(f, "victim insert failed");
+	}
+	if (btree_merge(&f->head, &victim, f->geo, dup))
+		fail(f, "merge failed");
+	if (victim.node)
+		fail(f, "victim not empty");
+}
+
+struct visit_thread {
+	struct fuzz *f;
+	size_t count;
+	unsigned long last[2];
+};
+
+static unsigned char *visit_seen;
+static int visit_ordered;
+
+static void visit_parallel(void *elem, long opaque, unsigned long *key,
+		size_t index, void *func2)
+{
+	struct visit_thread *t = (void *)opaque;
+	struct fuzz *f = t->f;
+	size_t i;
+	int found;
+
+	i = find(f, key, &found);
+	if (!found || elem != f->ent[i].val)
+		fail(f, "wrong value");
+	if (visit_ordered ? index != f->no_ent - 1 - i : index != t->count)
+		fail(f, "wrong index");
+	if (t->count && keycmp(f, key, t->last) >= 0)
+		fail(f, "thread saw keys out of order");
+	memcpy(t->last, key, f->keylen * sizeof(long));
+	t->count++;
+	__atomic_fetch_add(visit_seen + i, 1, __ATOMIC_RELAXED);
+}
+
+/* Every entry exactly once, and with @reap every node freed */
+static void op_visit_parallel(struct fuzz *f, int reap)
+{
+	struct visit_thread t[MAX_THREADS];
+	long opaque[MAX_THREADS];
+	int i, threads, flags;
+	size_t j, n, sum = 0;
+
+	f->op = reap ? "grim visit parallel" : "visit parallel";
+	threads = 1 + rnd(f) % MAX_THREADS;
+	flags = rnd(f) & 1 ? BTREE_VISIT_ORDERED : 0;
+	visit_ordered = flags & BTREE_VISIT_ORDERED;
+	visit_seen = calloc(f->no_ent + 1, 1);
+	if (!visit_seen)
+		fail(f, "out of memory");
+	for (i = 0; i < threads; i++) {
+		memset(t + i, 0, sizeof(t[i]));
+		t[i].f = f;
+		opaque[i] = (long)(t + i);
+	}
+	if (reap)
+		n = btree_grim_visitor_parallel(&f->head, f->geo, threads,
+				flags, opaque, visit_parallel, visit_parallel);
+	else
+		n = btree_visitor_parallel(&f->head, f->geo, threads, flags,
+				opaque, visit_parallel, visit_parallel);
+	if (n != f->no_ent)
+		fail(f, "wrong count");
+	for (i = 0; i < threads; i++)
+		sum += t[i].count;
+	if (sum != n)
+		fail(f, "wrong sum of thread counts");
+	for (j = 0; j < n; j++)
+		if (visit_seen[j] != 1)
+			fail(f, "entry not visited exactly once");
+	free(visit_seen);
+	if (!reap)
+		return;
+	f->no_ent = 0;
+	if (f->head.node || f->head.height)
+		fail(f, "tree not empty");
+	if (f->use_pool && btree_pool_check(&f->pool))
+		fail(f, "nodes not returned to the pool");
+}
+
+/* Replaces the tree with a bulk loaded one of random size */
+static void op_load(struct fuzz *f)
+{
+	unsigned long key[2], *keys;
+	void **vals;
+	size_t i, n, count;
+	int found;
+
+	if (rnd(f) & 1)
+		op_visit_parallel(f, 1);
+	else
+		btree_grim_visitor(&f->head, f->geo, 0, NULL, NULL);
+	f->op = "load";
+	f->no_ent = 0;
+	count = rnd(f) & 3 ? rnd(f) % 256 : rnd(f) % MAX_LOAD;
+	for (n = 0; n < count; n++) {
+		random_key(f, key);
+		i = find(f, key, &found);
+		if (!found)
+			model_insert(f, i, key, new_val(f));
+	}
+	keys = malloc((f->no_ent + 1) * f->keylen * sizeof(long));
+	vals = malloc((f->no_ent + 1) * sizeof(*vals));
+	if (!keys || !vals)
+		fail(f, "out of memory");
+	for (i = 0; i < f->no_ent; i++) {
+		memcpy(keys + i * f->keylen, f->ent[i].key,
+				f->keylen * sizeof(long));
+		vals[i] = f->ent[i].val;
+	}
+	if (btree_load(&f->head, f->geo, keys, vals, f->no_ent))
+		fail(f, "load failed");
+	free(keys);
+	free(vals);
+}
+
+/* The cursor has to sit on entry @i, or off the tree if @i is out of range */
+static void check_cursor(struct fuzz *f, struct btree_cursor *c, void *val,
+		long i)
+{
+	unsigned long *key = btree_cursor_key(c);
+
+	if (i < 0 || i >= f->no_ent) {
+		if (val || key)
+			fail(f, "cursor should be off the tree");
+		return;
+	}
+	if (val != f->ent[i].val)
+		fail(f, "wrong cursor value");
+	if (!key || keycmp(f, key, f->ent[i].key))
+		fail(f, "wrong cursor key");
+}
+
+static void op_cursor(struct fuzz *f)
+{
+	struct btree_cursor c;
+	unsigned long key[2];
+	int k, steps, found;
+	long i;
+	void *val;
+
+	f->op = "cursor";
+	switch (rnd(f) % 3) {
+	case 0:
+		val = btree_cursor_first(&c, &f->head, f->geo);
+		i = 0;
+		break;
+	case 1:
+		val = btree_cursor_last(&c, &f->head, f->geo);
+		i = (long)f->no_ent - 1;
+		break;
+	default:
+		pick_key(f, key);
+		val = btree_cursor_seek(&c, &f->head, f->geo, key);
+		i = find(f, key, &found);
+		break;
+	}
+	check_cursor(f, &c, val, i);
+	steps = rnd(f) % 16;
+	for (k = 0; k < steps && i >= 0 && i < f->no_ent; k++) {
+		switch (rnd(f) % 4) {
+		case 0:
+		case 1:
+			val = btree_cursor_next(&c);
+			i++;
+			break;
+		case 2:
+			val = btree_cursor_prev(&c);
+			i--;
+			break;
+		default:
+			f->op = "cursor remove";
+			val = btree_cursor_remove(&c);
+			model_remove(f, i);
+			i--;
+			break;
+		}
+		check_cursor(f, &c, val, i);
+	}
+}
+
+static unsigned long *visit_keys;
+
+static void visit(void *elem, long opaque, unsigned long *key, size_t index,
+		void *func2)
+{
+	struct fuzz *f = (void *)opaque;
+
+	if (index >= f->no_ent || elem != f->ent[f->no_ent - 1 - index].val)
+		fail(f, "wrong value");
+	memcpy(visit_keys + index * f->keylen, key, f->keylen * sizeof(long));
+}
+
+/* Visitors go from the largest key down */
+static void op_visit(struct fuzz *f)
+{
+	size_t i, n;
+
+	f->op = "visit";
+	visit_keys = malloc((f->no_ent + 1) * f->keylen * sizeof(long));
+	if (!visit_keys)
+		fail(f, "out of memory");
+	n = btree_visitor(&f->head, f->geo, (long)f, visit, visit);
+	if (n != f->no_ent)
+		fail(f, "wrong count");
+	for (i = 0; i < n; i++)
+		if (keycmp(f, visit_keys + i * f->keylen,
+					f->ent[n - 1 - i].key))
+			fail(f, "wrong key");
+	free(visit_keys);
+}
+
+static void run(struct fuzz *f, u64 seed, unsigned long steps, int verbose)
+{
+	static const char *geos[] = { "geo32", "geo64", "geo128" };
+	int g, use_finger;
+	size_t count;
+	u64 op;
+
+	memset(f, 0, sizeof(*f));
+	f->run_seed = seed;
+	f->seed = seed * 0x9e3779b97f4a7c15ull + 1;
+	g = rnd(f) % 3;
+	switch (g) {
+	case 0:
+		f->geo = &btree_geo32;
+		f->lookup = btree_lookup_geo32;
+		f->insert = btree_insert_geo32;
+		f->remove = btree_remove_geo32;
+		f->last = btree_last_geo32;
+		break;
+	case 1:
+		f->geo = &btree_geo64;
+		f->lookup = btree_lookup_geo64;
+		f->insert = btree_insert_geo64;
+		f->remove = btree_remove_geo64;
+		f->last = btree_last_geo64;
+		break;
+	default:
+		f->geo = &btree_geo128;
+		f->lookup = btree_lookup_geo128;
+		f->insert = btree_insert_geo128;
+		f->remove = btree_remove_geo128;
+		f->last = btree_last_geo128;
+		break;
+	}
+	f->keylen = f->geo->keylen;
+	f->nodesize = nodesizes[rnd(f) % ARRAY_SIZE(nodesizes)];
+	f->use_pool = rnd(f) & 1;
+	use_finger = rnd(f) & 1;
+	/* small ranges keep hitting present keys, large ones grow the tree */
+	f->range = 16ul << rnd(f) % 12;
+	if (verbose)
+		printf("seed %llu: %s, %d byte nodes, %spool, %sfinger, "
+				"keys below %lu\n", seed, geos[g],
+				f->nodesize, f->use_pool ? "" : "no ",
+				use_finger ? "" : "no ", f->range);
+
+	btree_pool_init(&f->pool, f->nodesize);
+	init_tree(f, &f->head, f->nodesize, f->use_pool);
+	if (use_finger)
+		btree_set_finger(&f->head, &f->finger);
+	for (f->step = 0; f->step < steps; f->step++) {
+		op = rnd(f) % 100;
+		if (op < 30)
+			op_insert(f);
+		else if (op < 55)
+			op_remove(f);
+		else if (op < 75)
+			op_lookup(f);
+		else if (op < 80)
+			op_last(f);
+		else if (op < 92)
+			op_cursor(f);
+		else if (op < 95)
+			op_merge(f);
+		else if (op < 97)
+			op_load(f);
+		else if (op < 98)
+			op_visit(f);
+		else
+			op_visit_parallel(f, 0);
+		count = btree_check(&f->head, f->geo);
+		if (count != f->no_ent)
+			fail(f, "wrong number of entries");
+	}
+	op_visit_parallel(f, 1);
+	btree_pool_destroy(&f->pool);
+	free(f->ent);
+}
+
+static void usage(void)
+{
+	printf(
+"btree_fuzz <options>\n"
+"\n"
+"Options:\n"
+"  -n          steps per run (default: 20000)\n"
+"  -r          number of runs (default: 50)\n"
+"  -s          seed of the first run (default: 1)\n"
+"  -v          print the configuration of each run\n"
+"\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long steps = 20000, runs = 50, i;
+	u64 seed = 1;
+	int c, verbose = 0;
+	struct fuzz f;
+
+	while ((c = getopt(argc, argv, "hn:r:s:v")) != -1) {
+		switch (c) {
+		case 'n':
+			steps = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			runs = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	for (i = 0; i < runs; i++)
+		run(&f, seed + i, steps, verbose);
+	printf("btree_fuzz: %lu runs of %lu steps passed\n", runs, steps);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,264 @@
+/*
+ * btree_stress.c	- concurrent lookups against writers
+ *
+ * License: GPLv2
+ *
+ * Readers look up keys with btree_lookup_sync64() while writers insert and
+ * remove others, both through the _sync operations and in exclusive
+ * batches that split and merge nodes.  Even keys are inserted up front and
+ * never removed, so a reader must always find them.  Odd keys come and go,
+ * a reader may find them or not.  Either way the value must belong to the
+ * key.  Keys 1 mod 4 belong to the _sync writers, keys 3 mod 4 to the
+ * exclusive ones, so neither inserts a key the other has just inserted.
+ *
+ * With -b it measures lookups per second for 1, 2, 4... readers up to the
+ * number of cpus instead, without and with a writer.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../btree.h"
+
+#define NO_KEYS		(1 << 18)	/* even and odd */
+#define BATCH		512
+
+static struct btree_head64 tree;
+static struct btree_sync tree_sync;
+static struct btree_pool pool;
+static volatile int stop;
+static unsigned long failures;
+
+struct worker {
+	pthread_t thread;
+	u64 seed;
+	unsigned long ops;
+};
+
+static u64 rnd(u64 *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
+}
+
+static void *key_val(u64 key)
+{
+	return (void *)(uintptr_t)(key * 2 + 1);
+}
+
+static void *reader(void *_w)
+{
+	struct worker *w = _w;
+	u64 key;
+	void *val;
+
+	while (!stop) {
+		key = rnd(&w->seed) % NO_KEYS;
+		val = btree_lookup_sync64(&tree, key);
+		if (val ? val != key_val(key) : !(key & 1)) {
+			__atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+			fprintf(stderr, "key %llu: got %p\n", key, val);
+		}
+		w->ops++;
+	}
+	return NULL;
+}
+
+/* Single keys through the _sync operations */
+static void *writer(void *_w)
+{
+	struct worker *w = _w;
+	u64 key;
+
+	while (!stop) {
+		key = (rnd(&w->seed) % NO_KEYS & ~3ull) | 1;
+		if (!(rnd(&w->seed) & 1))
+			btree_remove_sync64(&tree, key);
+		else if (!btree_lookup_sync64(&tree, key))
+			btree_insert_sync64(&tree, key, key_val(key));
+		w->ops++;
+	}
+	return NULL;
+}
+
+/*
+ * Runs of keys in exclusive batches.  Filling and emptying a whole range
+ * splits and merges leaves without touching their stripes.
+ */
+static void *batch_writer(void *_w)
+{
+	struct worker *w = _w;
+	u64 key, first;
+	int i, insert;
+
+	while (!stop) {
+		first = (rnd(&w->seed) % (NO_KEYS - 4 * BATCH) & ~3ull) | 3;
+		insert = rnd(&w->seed) & 1;
+		btree_sync_lock(&tree.h);
+		for (i = 0; i < BATCH; i++) {
+			key = first + 4 * i;
+			if (!insert)
+				btree_remove64(&tree, key);
+			else if (!btree_lookup64(&tree, key))
+				btree_insert64(&tree, key, key_val(key));
+		}
+		btree_sync_unlock(&tree.h);
+		w->ops++;
+	}
+	return NULL;
+}
+
+static void setup(void)
+{
+	u64 key;
+
+	btree_pool_init(&pool, 512);
+	btree_init64_nodesize(&tree, 512);
+	btree_set_pool64(&tree, &pool);
+	if (btree_sync_init(&tree_sync))
+		exit(EXIT_FAILURE);
+	btree_set_sync64(&tree, &tree_sync);
+	for (key = 0; key < NO_KEYS; key++)
+		if (btree_insert64(&tree, key, key_val(key)))
+			exit(EXIT_FAILURE);
+}
+
+static void start(struct worker *w, void *(*fn)(void *), u64 seed)
+{
+	memset(w, 0, sizeof(*w));
+	w->seed = seed * 0x9e3779b97f4a7c15ull + 1;
+	if (pthread_create(&w->thread, NULL, fn, w))
+		exit(EXIT_FAILURE);
+}
+
+/*
+ * Runs @readers readers and @writers of each kind for @secs seconds.  Only
+ * one writer of each kind may run, see above.
+ */
+static unsigned long run(int readers, int writers, double secs,
+		unsigned long *writes)
+{
+	struct worker w[readers + 2 * writers];
+	unsigned long lookups = 0;
+	int i, n = 0;
+
+	stop = 0;
+	for (i = 0; i < readers; i++, n++)
+		start(w + n, reader, n);
+	for (i = 0; i < writers; i++, n += 2) {
+		start(w + n, writer, n);
+		start(w + n + 1, batch_writer, n + 1);
+	}
+	usleep(secs * 1e6);
+	stop = 1;
+	*writes = 0;
+	for (i = 0; i < n; i++) {
+		pthread_join(w[i].thread, NULL);
+		if (i < readers)
+			lookups += w[i].ops;
+		else
+			*writes += w[i].ops;
+	}
+	return lookups;
+}
+
+static int check_tree(void)
+{
+	u64 key;
+	void *val;
+
+#ifdef BTREE_DEBUG
+	btree_check(&tree.h, &btree_geo64);
+#endif
+	for (key = 0; key < NO_KEYS; key++) {
+		val = btree_lookup64(&tree, key);
+		if (val ? val != key_val(key) : !(key & 1)) {
+			fprintf(stderr, "key %llu: got %p after the run\n",
+					key, val);
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+static void bench(double secs)
+{
+	int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long lookups, writes;
+	int readers, writers;
+
+	printf("readers  writers  lookups/s  per reader  writes/s\n");
+	for (writers = 0; writers <= 1; writers++) {
+		for (readers = 1; ; readers *= 2) {
+			if (readers > cpus)
+				readers = cpus;
+			lookups = run(readers, writers, secs, &writes);
+			printf("%7d  %7d  %9.0f  %10.0f  %8.0f\n", readers,
+					2 * writers, lookups / secs,
+					lookups / secs / readers,
+					writes / secs);
+			if (readers == cpus)
+				break;
+		}
+	}
+}
+
+static void usage(void)
+{
+	printf(
+"btree_stress <options>\n"
+"\n"
+"Options:\n"
+"  -b          measure lookup throughput instead\n"
+"  -j          number of readers (default: number of cpus, at least 2)\n"
+"  -t          seconds to run (default: 2)\n"
+"\n");
+}
+
+int main(int argc, char **argv)
+{
+	int c, readers = sysconf(_SC_NPROCESSORS_ONLN), do_bench = 0;
+	unsigned long lookups, writes;
+	double secs = 2;
+
+	while ((c = getopt(argc, argv, "bhj:t:")) != -1) {
+		switch (c) {
+		case 'b':
+			do_bench = 1;
+			break;
+		case 'j':
+			readers = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			secs = strtod(optarg, NULL);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	if (readers < 2)
+		readers = 2;
+
+	setup();
+	if (do_bench) {
+		bench(secs);
+	} else {
+		lookups = run(readers, 1, secs, &writes);
+		printf("btree_stress: %lu lookups, %lu writes, %lu failures\n",
+				lookups, writes, failures);
+	}
+	if (check_tree() || failures)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,395 @@
+/*
+ * compr_test.c	- round trips and bad input for the compression codecs
+ *
+ * License: GPLv2
+ *
+ * Compresses random inputs of mixed compressibility with zlib and LZ4 and
+ * checks that they decompress to the original.  Output buffers are followed
+ * by guard bytes, which no call may touch, also when the output is too
+ * small.  Truncated, corrupted and random compressed input must fail or
+ * come out short, never overrun the output.  Decoder input is copied to a
+ * buffer of its exact size, so a build with -fsanitize=address also
+ * catches reads past its end.
+ *
+ * With -b it measures ratio and speed of both codecs on 4KiB blocks
+ * instead: alias journal entries as mklogfs writes them, and the files
+ * given on the command line.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../kerncompat.h"
+#include "../logfs.h"
+
+#define MAX_LEN		(70 * 1024)	/* past the LZ4 match distance */
+#define GUARD		64
+#define GUARD_BYTE	0xa5
+#define BENCH_BLOCK	4096
+#define BENCH_BYTES	(32 << 20)	/* per payload and codec */
+
+static const struct codec {
+	const char *name;
+	u8 compr;
+} codecs[] = {
+	{ "zlib", COMPR_ZLIB },
+	{ "lz4", COMPR_LZ4 },
+};
+
+static u64 seed = 1;
+static unsigned long cases, failures;
+
+static u64 rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+
+	if (!p)
+		fail("out of memory");
+	return p;
+}
+
+/* Literal runs, byte runs and copies from earlier on, overlapping or not */
+static void gen(u8 *buf, size_t len)
+{
+	size_t pos = 0, n, dist, i;
+
+	while (pos < len) {
+		n = rnd() & 7 ? 1 + rnd() % 64 : 1 + rnd() % 1000;
+		if (n > len - pos)
+			n = len - pos;
+		switch (rnd() % 3) {
+		case 0:
+			for (i = 0; i < n; i++)
+				buf[pos + i] = rnd();
+			break;
+		case 1:
+			memset(buf + pos, rnd(), n);
+			break;
+		default:
+			if (!pos) {
+				memset(buf, 0, n);
+				break;
+			}
+			dist = rnd() & 3 ? 1 + rnd() % min(pos, (size_t)64) :
+				1 + rnd() % pos;
+			for (i = 0; i < n; i++)
+				buf[pos + i] = buf[pos + i - dist];
+			break;
+		}
+		pos += n;
+	}
+}
+
+static size_t gen_len(void)
+{
+	switch (rnd() % 8) {
+	case 0:
+		return rnd() % 32;	/* around LZ4_MFLIMIT */
+	case 1:
+		return rnd() % MAX_LEN;
+	default:
+		return rnd() % 8192;
+	}
+}
+
+static void report(const char *codec, size_t len, const char *why)
+{
+	fprintf(stderr, "compr_test: case %lu, %s, %zu bytes: %s\n", cases,
+			codec, len, why);
+	failures++;
+}
+
+static void *guarded(size_t len)
+{
+	u8 *p = xmalloc(len + GUARD);
+
+	memset(p + len, GUARD_BYTE, GUARD);
+	return p;
+}
+
+static int guard_ok(const u8 *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < GUARD; i++)
+		if (p[len + i] != GUARD_BYTE)
+			return 0;
+	return 1;
+}
+
+/* Decodes @len bytes of @in from a copy of exactly that size */
+static int decode(const struct codec *c, const u8 *in, size_t len, u8 *out,
+		size_t outlen)
+{
+	u8 *copy = xmalloc(len);
+	int ret;
+
+	memcpy(copy, in, len);
+	ret = logfs_uncompress(copy, out, len, outlen, c->compr);
+	free(copy);
+	return ret;
+}
+
+static void check_bad_input(const struct codec *c, const u8 *cbuf, int clen,
+		size_t len)
+{
+	u8 *bad = xmalloc(clen + 1), *out = guarded(len);
+	int i, n, ret, cut;
+
+	/* truncated */
+	cut = rnd() % clen;
+	ret = decode(c, cbuf, cut, out, len);
+	if (ret >= (int)len || !guard_ok(out, len))
+		report(c->name, len, "truncated input accepted");
+
+	/* a few bytes flipped */
+	memcpy(bad, cbuf, clen);
+	n = 1 + rnd() % 4;
+	for (i = 0; i < n; i++)
+		bad[rnd() % clen] ^= 1 + rnd() % 255;
+	ret = decode(c, bad, clen, out, len);
+	if (ret > (int)len || !guard_ok(out, len))
+		report(c->name, len, "corrupted input overran the output");
+
+	/* plain garbage */
+	for (i = 0; i < clen; i++)
+		bad[i] = rnd();
+	ret = decode(c, bad, clen, out, len);
+	if (ret > (int)len || !guard_ok(out, len))
+		report(c->name, len, "random input overran the output");
+	free(bad);
+	free(out);
+}
+
+static void check_case(const struct codec *c, const u8 *in, size_t len)
+{
+	u8 *cbuf = guarded(len), *out = guarded(len);
+	size_t tight;
+	int clen, ret;
+
+	clen = logfs_compress((void *)in, cbuf, len, len, c->compr);
+	if (!guard_ok(cbuf, len))
+		report(c->name, len, "compression overran the output");
+	if (clen < 0)
+		goto out;
+	if (clen >= len) {
+		report(c->name, len, "compressed output not smaller");
+		goto out;
+	}
+
+	ret = decode(c, cbuf, clen, out, len);
+	if (ret != len || memcmp(in, out, len) || !guard_ok(out, len))
+		report(c->name, len, "round trip failed");
+
+	/* one byte short of the output it needs */
+	if (len) {
+		memset(out + len - 1, GUARD_BYTE, GUARD + 1);
+		ret = decode(c, cbuf, clen, out, len - 1);
+		if (ret >= 0 || !guard_ok(out, len - 1))
+			report(c->name, len, "decoded into a short buffer");
+	}
+
+	/* compressing into less room than it needs must fail cleanly */
+	tight = clen ? rnd() % clen : 0;
+	memset(cbuf + tight, GUARD_BYTE, GUARD);
+	ret = logfs_compress((void *)in, cbuf, len, tight, c->compr);
+	if (ret > (int)tight || !guard_ok(cbuf, tight))
+		report(c->name, len, "compressed into a short buffer");
+
+	if (clen)
+		check_bad_input(c, cbuf, clen, len);
+out:
+	free(cbuf);
+	free(out);
+}
+
+static void run_checks(unsigned long n)
+{
+	u8 *in = xmalloc(MAX_LEN);
+	size_t len;
+	int i;
+
+	for (cases = 0; cases < n; cases++) {
+		len = gen_len();
+		gen(in, len);
+		for (i = 0; i < ARRAY_SIZE(codecs); i++)
+			check_case(codecs + i, in, len);
+	}
+	free(in);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Alias entries for consecutive segments, as in a fresh image's journal */
+static size_t alias_payload(u8 **data)
+{
+	struct logfs_obj_alias *oa;
+	size_t i, n = 256 * BENCH_BLOCK / sizeof(*oa);
+
+	oa = zalloc(n * sizeof(*oa));
+	if (!oa)
+		fail("out of memory");
+	for (i = 0; i < n; i++) {
+		oa[i].ino = cpu_to_be64(LOGFS_INO_SEGFILE);
+		oa[i].bix = cpu_to_be64(i >> 9);
+		oa[i].child_no = cpu_to_be16(i & 511);
+		oa[i].val = cpu_to_be64((u64)ec_level(1, rnd() % 3) << 32 |
+				(rnd() & 3 ? 0 : rnd() % (256 << 10)));
+	}
+	*data = (u8 *)oa;
+	return n * sizeof(*oa);
+}
+
+static size_t file_payload(int no_files, char **files, u8 **data)
+{
+	size_t len = 0, size = 0, n;
+	u8 *buf = NULL;
+	FILE *f;
+	int i;
+
+	for (i = 0; i < no_files; i++) {
+		f = fopen(files[i], "r");
+		if (!f)
+			fail(files[i]);
+		do {
+			if (len + BENCH_BLOCK > size) {
+				size = 2 * size + BENCH_BLOCK;
+				buf = realloc(buf, size);
+				if (!buf)
+					fail("out of memory");
+			}
+			n = fread(buf + len, 1, BENCH_BLOCK, f);
+			len += n;
+		} while (n);
+		fclose(f);
+	}
+	*data = buf;
+	return len - len % BENCH_BLOCK;
+}
+
+static void bench_payload(const char *name, u8 *data, size_t len)
+{
+	const struct codec *c;
+	size_t i, rounds, in, out;
+	double t, t_comp, t_uncomp;
+	int *clen, k;
+	u8 *cbuf, *ubuf;
+
+	if (!len)
+		return;
+	rounds = BENCH_BYTES / len + 1;
+	clen = xmalloc(len / BENCH_BLOCK * sizeof(*clen));
+	cbuf = xmalloc(len);
+	ubuf = xmalloc(BENCH_BLOCK);
+	for (k = 0; k < ARRAY_SIZE(codecs); k++) {
+		c = codecs + k;
+		t = now();
+		for (i = 0; i < rounds * len; i += BENCH_BLOCK)
+			clen[i % len / BENCH_BLOCK] = logfs_compress(
+					data + i % len, cbuf + i % len,
+					BENCH_BLOCK, BENCH_BLOCK, c->compr);
+		t_comp = now() - t;
+
+		/* blocks that do not compress are stored as they are */
+		t = now();
+		for (i = 0; i < rounds * len; i += BENCH_BLOCK)
+			if (clen[i % len / BENCH_BLOCK] > 0)
+				logfs_uncompress(cbuf + i % len, ubuf,
+						clen[i % len / BENCH_BLOCK],
+						BENCH_BLOCK, c->compr);
+		t_uncomp = now() - t;
+
+		for (i = in = out = 0; i < len; i += BENCH_BLOCK) {
+			in += BENCH_BLOCK;
+			out += clen[i / BENCH_BLOCK] > 0 ?
+				clen[i / BENCH_BLOCK] : BENCH_BLOCK;
+		}
+		printf("%-8s %-5s %9zu %6.3f %9.1f %9.1f\n", name, c->name,
+				len, (double)out / in,
+				rounds * len / t_comp / 1e6,
+				rounds * len / t_uncomp / 1e6);
+	}
+	free(clen);
+	free(cbuf);
+	free(ubuf);
+}
+
+static void bench(int no_files, char **files)
+{
+	u8 *data = NULL;
+	size_t len;
+
+	printf("%-8s %-5s %9s %6s %9s %9s\n", "payload", "codec", "bytes",
+			"ratio", "comp MB/s", "dec MB/s");
+	len = alias_payload(&data);
+	bench_payload("journal", data, len);
+	free(data);
+	data = NULL;
+	len = file_payload(no_files, files, &data);
+	bench_payload("files", data, len);
+	free(data);
+}
+
+static void usage(void)
+{
+	printf(
+"compr_test <options> [files]\n"
+"\n"
+"Options:\n"
+"  -b          measure ratio and speed on 4KiB blocks of journal entries\n"
+"              and of the given files instead\n"
+"  -n          number of random inputs (default: 20000)\n"
+"  -s          seed (default: 1)\n"
+"\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long n = 20000;
+	int c, do_bench = 0;
+
+	while ((c = getopt(argc, argv, "bhn:s:")) != -1) {
+		switch (c) {
+		case 'b':
+			do_bench = 1;
+			break;
+		case 'n':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	seed = seed * 0x9e3779b97f4a7c15ull + 1;
+
+	if (do_bench) {
+		bench(argc - optind, argv + optind);
+		return EXIT_SUCCESS;
+	}
+	run_checks(n);
+	printf("compr_test: %lu inputs, %lu failures\n", n, failures);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,115 @@
+/*
+ * corrupt.c	- damage one object of a logfs image
+ *
+ * License: GPLv2
+ *
+ * Finds the first suitable object of the segment file and damages it in
+ * place, so that logfsck has something to find:
+ *
+ *   header   flips a bit of the block index, the header crc no longer
+ *            matches
+ *   payload  flips a bit of a data block, the data crc no longer matches
+ *   pointer  moves the first pointer of an indirect block one segment on
+ *            and fixes up the data crc, only the walk can tell
+ *
+ * Only uncompressed objects are touched.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../kerncompat.h"
+#include "../logfs.h"
+
+enum { HEADER, PAYLOAD, POINTER };
+
+static const char *modes[] = { "header", "payload", "pointer" };
+
+static int damage(int mode, void *seg, u32 segsize, u64 seg_ofs)
+{
+	struct logfs_segment_header *sh = seg;
+	struct logfs_object_header *oh;
+	__be64 *ptr;
+	u32 pos, len, i;
+
+	if (sh->crc != logfs_crc32(sh, LOGFS_SEGMENT_HEADERSIZE, 4) ||
+			sh->type != SEG_OSTORE)
+		return 0;
+	/* indirect blocks of the segment file sit one GC level up */
+	if ((sh->level != 0) != (mode == POINTER))
+		return 0;
+	for (pos = LOGFS_SEGMENT_HEADERSIZE;
+			pos + sizeof(*oh) <= segsize; pos += sizeof(*oh) + len) {
+		oh = seg + pos;
+		len = be16_to_cpu(oh->len);
+		if (oh->crc != logfs_crc32(oh, LOGFS_OBJECT_HEADERSIZE - 4, 4) ||
+				len > segsize - pos - sizeof(*oh))
+			return 0;
+		if (be64_to_cpu(oh->ino) != LOGFS_INO_SEGFILE ||
+				oh->type != OBJ_BLOCK ||
+				oh->compr != COMPR_NONE || !len)
+			continue;
+		switch (mode) {
+		case HEADER:
+			oh->bix ^= cpu_to_be64(1);
+			break;
+		case PAYLOAD:
+			*(u8 *)(oh + 1) ^= 1;
+			break;
+		case POINTER:
+			ptr = (__be64 *)(oh + 1);
+			for (i = 0; i < len / sizeof(*ptr) && !ptr[i]; i++)
+				;
+			if (i == len / sizeof(*ptr))
+				continue;
+			ptr[i] = cpu_to_be64(be64_to_cpu(ptr[i]) + segsize);
+			oh->data_crc = logfs_crc32(oh + 1, len, 0);
+			break;
+		}
+		printf("corrupt: %s of object at 0x%llx\n", modes[mode],
+				seg_ofs + pos);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct logfs_disk_super *ds;
+	struct stat st;
+	u32 segsize;
+	u64 ofs;
+	void *map;
+	int fd, mode;
+
+	for (mode = 0; mode < ARRAY_SIZE(modes); mode++)
+		if (argc == 3 && !strcmp(argv[1], modes[mode]))
+			break;
+	if (mode == ARRAY_SIZE(modes)) {
+		printf("corrupt <header|payload|pointer> <image>\n");
+		return EXIT_FAILURE;
+	}
+	fd = open(argv[2], O_RDWR);
+	if (fd < 0 || fstat(fd, &st))
+		fail("could not open image");
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		fail("could not map image");
+	ds = map;
+	if (be64_to_cpu(ds->ds_magic) != LOGFS_MAGIC)
+		fail("not a logfs image");
+	segsize = 1 << ds->ds_segment_shift;
+
+	for (ofs = segsize; ofs + segsize <= st.st_size; ofs += segsize)
+		if (damage(mode, map + ofs, segsize, ofs))
+			break;
+	if (ofs + segsize > st.st_size)
+		fail("no object to corrupt");
+	munmap(map, st.st_size);
+	close(fd);
+	return EXIT_SUCCESS;
+}
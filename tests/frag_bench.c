@@ -0,0 +1,217 @@
+/*
+ * frag_bench.c	- fragmentation of interleaved file writes
+ *
+ * License: GPLv2
+ *
+ * Writes several files through the mklogfs write path, one block of each
+ * file in turn, and counts the segments holding each file's data blocks.
+ * Nothing is written to disk.  The device write hook parses every segment
+ * as it is written instead.  Each reorder window size given with -w gets a
+ * fresh filesystem.  The "ideal" line is the count a file written on its
+ * own, starting in a fresh segment, would get.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../kerncompat.h"
+#include "../logfs.h"
+
+#define MAX_WINDOWS	16
+
+static int no_files = 16;
+static int no_blocks = 300;
+static int segshift = 18;
+static int blockshift = 12;
+
+/* per file: segments holding its data, last segment counted */
+static u32 *touched;
+static u32 *last_seg;
+
+static int frag_prepare_sb(struct super_block *sb)
+{
+	return 0;
+}
+
+static int frag_write(struct super_block *sb, u64 ofs, size_t size, void *buf)
+{
+	struct logfs_segment_header *sh = buf;
+	struct logfs_object_header *oh;
+	u32 segno = ofs >> segshift;
+	size_t pos = LOGFS_SEGMENT_HEADERSIZE;
+	u64 f;
+
+	/* only whole areas, counted from their start */
+	if (ofs & (sb->segsize - 1) || sh->level != 0)
+		return 0;
+	while (pos + LOGFS_OBJECT_HEADERSIZE <= size) {
+		oh = buf + pos;
+		if (oh->len == cpu_to_be16(0xffff))
+			break;
+		f = be64_to_cpu(oh->ino) - LOGFS_RESERVED_INOS;
+		if (f < no_files && last_seg[f] != segno + 1) {
+			last_seg[f] = segno + 1;
+			touched[f]++;
+		}
+		pos += LOGFS_OBJECT_HEADERSIZE + be16_to_cpu(oh->len);
+	}
+	return 0;
+}
+
+static int frag_erase(struct super_block *sb, u64 ofs, size_t size)
+{
+	return 0;
+}
+
+static const struct logfs_device_operations frag_ops = {
+	.prepare_sb	= frag_prepare_sb,
+	.write		= frag_write,
+	.erase		= frag_erase,
+};
+
+static struct super_block *frag_sb(u32 window)
+{
+	struct super_block *sb;
+	u64 bytes;
+
+	sb = zalloc(sizeof(*sb));
+	btree_pool_init(&sb->btree_pool, LOGFS_BTREE_NODESIZE);
+	btree_init64_nodesize(&sb->ino_tree, LOGFS_BTREE_NODESIZE);
+	btree_set_finger64(&sb->ino_tree, &sb->ino_finger);
+	btree_set_pool64(&sb->ino_tree, &sb->btree_pool);
+	sb->segsize = 1 << segshift;
+	sb->blocksize = 1 << blockshift;
+	sb->blocksize_bits = blockshift;
+	/* flush_segments() writes the open areas up to the last object */
+	sb->writesize = 1;
+	sb->pending_window = window;
+
+	/* data, indirect blocks and a partial segment per area */
+	bytes = (u64)no_files * no_blocks * (sb->blocksize +
+			LOGFS_OBJECT_HEADERSIZE);
+	sb->no_segs = 2 * (bytes >> segshift) + 4 * LOGFS_NO_AREAS;
+	sb->fssize = (u64)sb->no_segs << segshift;
+	sb->segment_entry = zalloc(sb->no_segs * sizeof(sb->segment_entry[0]));
+	sb->dirty_segs = zalloc(BITS_TO_LONGS(sb->no_segs) * sizeof(long));
+	if (!sb->segment_entry || !sb->dirty_segs)
+		fail("out of memory");
+	sb->dev_ops = &frag_ops;
+	return sb;
+}
+
+static void report(const char *name)
+{
+	u32 min = ~0, max = 0, sum = 0;
+	int f;
+
+	for (f = 0; f < no_files; f++) {
+		sum += touched[f];
+		if (touched[f] < min)
+			min = touched[f];
+		if (touched[f] > max)
+			max = touched[f];
+	}
+	printf("%-8s %8.1f %6u %6u\n", name, (double)sum / no_files, min, max);
+}
+
+static void run(u32 window)
+{
+	struct super_block *sb = frag_sb(window);
+	void *block = malloc(sb->blocksize);
+	char name[16];
+	int f, bix;
+
+	if (!block)
+		fail("out of memory");
+	memset(touched, 0, no_files * sizeof(*touched));
+	memset(last_seg, 0, no_files * sizeof(*last_seg));
+	for (bix = 0; bix < no_blocks; bix++) {
+		for (f = 0; f < no_files; f++) {
+			memset(block, f, sb->blocksize);
+			if (logfs_file_write(sb, LOGFS_RESERVED_INOS + f, bix,
+						0, OBJ_BLOCK, block))
+				fail("could not write block");
+		}
+	}
+	for (f = 0; f < no_files; f++)
+		if (logfs_file_flush(sb, LOGFS_RESERVED_INOS + f))
+			fail("could not flush file");
+	if (flush_segments(sb))
+		fail("could not write segments");
+	free(block);
+
+	snprintf(name, sizeof(name), "%u", window);
+	report(name);
+}
+
+static void usage(void)
+{
+	printf(
+"frag_bench <options>\n"
+"\n"
+"Options:\n"
+"  -b          blockshift (default: 12)\n"
+"  -f          number of files (default: 16)\n"
+"  -n          blocks per file (default: 300)\n"
+"  -s          segshift (default: 18)\n"
+"  -w          reorder window in blocks, may be repeated\n"
+"              (default: 0 64 256 1024 4096)\n"
+"\n");
+}
+
+int main(int argc, char **argv)
+{
+	u32 windows[MAX_WINDOWS] = { 0, 64, 256, 1024, 4096 };
+	int c, i, no_windows = 0;
+	u32 per_seg, ideal;
+
+	while ((c = getopt(argc, argv, "b:f:hn:s:w:")) != -1) {
+		switch (c) {
+		case 'b':
+			blockshift = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			no_files = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			no_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			segshift = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			if (no_windows == MAX_WINDOWS)
+				fail("too many windows");
+			windows[no_windows++] = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	if (blockshift < 12 || blockshift > 15 || segshift <= blockshift ||
+			segshift > 30 || no_files < 1 || no_blocks < 1)
+		fail("bad geometry");
+	if (!no_windows)
+		no_windows = 5;
+
+	touched = calloc(no_files, sizeof(*touched));
+	last_seg = calloc(no_files, sizeof(*last_seg));
+	if (!touched || !last_seg)
+		fail("out of memory");
+
+	printf("%d files of %d blocks, %d byte blocks, %d byte segments\n",
+			no_files, no_blocks, 1 << blockshift, 1 << segshift);
+	printf("%-8s %8s %6s %6s\n", "window", "segs", "min", "max");
+	per_seg = ((1 << segshift) - LOGFS_SEGMENT_HEADERSIZE) /
+		((1 << blockshift) + LOGFS_OBJECT_HEADERSIZE);
+	ideal = (no_blocks + per_seg - 1) / per_seg;
+	printf("%-8s %8.1f %6u %6u\n", "ideal", (double)ideal, ideal, ideal);
+	for (i = 0; i < no_windows; i++)
+		run(windows[i]);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# logfsck must catch a damaged object header, payload and pointer, report
+# each with the check meant for it and exit with FSCK_UNCORRECTED (4).
+#
+# The last case checks an intact image with "-m 1".  128GiB of 8KiB
+# segments gives a segment file of 16384 blocks and the index some 33000
+# objects.  That is past half the 1MiB budget, so flush_run() spills runs,
+# and past the whole of it, so alloc_result() merges into a temporary
+# file.  Reading the sparse image dominates the run time.
+#
+MKLOGFS=${MKLOGFS:-./mklogfs}
+LOGFSCK=${LOGFSCK:-./logfsck}
+CORRUPT=${CORRUPT:-tests/corrupt}
+IMG=$(mktemp) || exit 1
+trap 'rm -f $IMG $IMG.log' EXIT
+
+mkimg()
+{
+	rm -f $IMG
+	truncate -s $1 $IMG || exit 1
+	$MKLOGFS --non-interactive -s 13 $IMG > /dev/null || exit 1
+}
+
+fail=0
+for c in "header:bad object header crc" "payload:bad object data crc" \
+		"pointer:^inode 3 block"; do
+	what=${c%%:*}
+	mkimg 256M
+	$CORRUPT $what $IMG > /dev/null || exit 1
+	$LOGFSCK $IMG > $IMG.log
+	rc=$?
+	if [ $rc != 4 ]; then
+		echo "fsck_corrupt: $what: logfsck returned $rc, not 4"
+		fail=1
+	elif ! grep -q "${c#*:}" $IMG.log; then
+		echo "fsck_corrupt: $what: no \"${c#*:}\" reported"
+		fail=1
+	fi
+done
+
+mkimg 128G
+if ! $LOGFSCK -m 1 $IMG > $IMG.log; then
+	echo "fsck_corrupt: logfsck -m 1 failed"
+	grep -E '^segment|^inode|error' $IMG.log | head -5
+	fail=1
+elif ! grep -q "runs spilled" $IMG.log ||
+		grep -q " 0 of [0-9]* runs spilled" $IMG.log ||
+		! grep -q "in a temporary file" $IMG.log; then
+	echo "fsck_corrupt: logfsck -m 1 did not spill"
+	grep '^index' $IMG.log
+	fail=1
+fi
+[ $fail = 0 ] && echo "fsck_corrupt: ok"
+exit $fail
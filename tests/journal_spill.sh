@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Journal spill cases for mklogfs, each image must pass logfsck.
+#
+# With 8KiB segments and an uncompressed journal the aliases fill a journal
+# segment every 128 segments.  At 481-484 and 989-992 MiB the spill happens
+# when only the alias of the second superblock is left, which sits past the
+# spill segment.
+#
+MKLOGFS=${MKLOGFS:-./mklogfs}
+LOGFSCK=${LOGFSCK:-./logfsck}
+IMG=$(mktemp) || exit 1
+trap 'rm -f $IMG' EXIT
+
+fail=0
+for mb in 400 480 481 484 485 700 988 989 992 993; do
+	rm -f $IMG
+	truncate -s ${mb}M $IMG || exit 1
+	if ! $MKLOGFS --non-interactive --journal-compr none -s 13 $IMG \
+			> /dev/null; then
+		echo "journal_spill: mklogfs failed at $mb MiB"
+		fail=1
+		continue
+	fi
+	if ! $LOGFSCK $IMG > $IMG.log; then
+		echo "journal_spill: logfsck failed at $mb MiB"
+		grep -E '^segment|error' $IMG.log | head -5
+		fail=1
+	fi
+	rm -f $IMG.log
+done
+[ $fail = 0 ] && echo "journal_spill: ok"
+exit $fail